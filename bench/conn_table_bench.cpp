@@ -0,0 +1,167 @@
+// 连接表的缓存效率对比：以fd为下标的http_conn大数组（原来的成员顺序） 与 conn_table中按需分配、热数据在前的http_conn
+// 编译：g++ -O2 bench/conn_table_bench.cpp -pthread -o conn_table_bench
+// 运行：./conn_table_bench [连接数] [事件数]
+// 支持时用perf_event_open统计缓存未命中，虚拟机或perf_event_paranoid限制时显示n/a
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../http/http_conn.h"
+#include "../reactor/conn_table.h"
+
+#define MAX_FD 65536
+
+// 原来http_conn的成员顺序：fd在开头，读下标在地址之后，响应计数在响应队列之后，解析状态在更后面
+struct old_conn {
+    int m_sockfd;
+    int m_epollfd;
+    timer_wheel<http_conn>* m_timers;
+    wheel_timer<http_conn>* m_timer;
+    sockaddr_in m_address;
+    char* m_read_buf;
+    int m_read_size;
+    int m_read_idx;
+    char* m_write_buf;
+    int m_write_size;
+    int m_write_idx;
+    http_response m_responses[http_conn::MAX_PIPELINE];
+    int m_resp_head;
+    int m_resp_count;
+    int m_request_start;
+    int m_checked_idx;
+    int m_start_line;
+    int m_line_len;
+    char* m_url;
+    char* m_version;
+    http_conn::METHOD m_method;
+    char* m_host;
+    bool m_linger;
+    int m_content_length;
+    http_conn::CHECK_STATE m_check_state;
+    char m_real_file[http_conn::FILENAME_LEN];
+    struct stat m_file_stat;
+    int m_file_fd;
+    file_entry* m_file;
+
+    bool waiting_request() const { return m_read_idx == 0; }
+    bool has_buffered_request() const { return m_resp_count == 0 && m_read_idx > 0; }
+};
+
+// 一个硬件计数器，打不开时valid()为false
+struct counter {
+    int fd;
+
+    counter(uint64_t config)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~counter() { if(fd >= 0) close(fd); }
+    bool valid() const { return fd >= 0; }
+    void start() { if(fd >= 0) { ioctl(fd, PERF_EVENT_IOC_RESET, 0); ioctl(fd, PERF_EVENT_IOC_ENABLE, 0); } }
+    long long stop()
+    {
+        long long value = -1;
+        if(fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if(::read(fd, &value, sizeof(value)) != sizeof(value)) value = -1;
+        }
+        return value;
+    }
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile long sink;
+
+// Reactor处理一个事件时对连接的访问：取fd、判断是否在等待请求、是否还有流水线请求
+template<typename T>
+static inline long touch(T* conn)
+{
+    return conn->waiting_request() + conn->has_buffered_request() * 2;
+}
+
+static void report(const char* name, double seconds, long events, counter& misses, long long m)
+{
+    printf("%-10s %10.1f", name, seconds * 1e9 / events);
+    if(misses.valid() && m >= 0) {
+        printf(" %14.3f\n", (double)m / events);
+    }else{
+        printf(" %14s\n", "n/a");
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int conns = argc > 1 ? atoi(argv[1]) : 10000;
+    long events = argc > 2 ? atol(argv[2]) : 20000000;
+    if(conns <= 0 || conns + 16 > MAX_FD) {
+        printf("bad connection count\n");
+        return 1;
+    }
+
+    // 已经打开的连接的fd，事件按随机顺序落在它们上面
+    int* fds = new int[conns];
+    for(int i = 0; i < conns; ++i) fds[i] = 16 + i;
+    int* order = new int[1 << 20];
+    srand(1);
+    for(int i = 0; i < (1 << 20); ++i) order[i] = fds[rand() % conns];
+
+    old_conn* users = new old_conn[MAX_FD];
+    for(int i = 0; i < conns; ++i) {
+        memset(&users[fds[i]], 0, sizeof(old_conn));
+        users[fds[i]].m_sockfd = fds[i];
+    }
+
+    conn_table<http_conn> table(MAX_FD);
+    for(int i = 0; i < conns; ++i) {
+        http_conn* c = table.attach(fds[i]);
+        memset((void*)c, 0, sizeof(http_conn));
+    }
+
+    printf("connections %d, sizeof old %zu, sizeof http_conn %zu\n", conns, sizeof(old_conn), sizeof(http_conn));
+    counter misses(PERF_COUNT_HW_CACHE_MISSES);
+    printf("%-10s %10s %14s\n", "layout", "ns/event", "misses/event");
+
+    misses.start();
+    double start = now();
+    long s = 0;
+    for(long i = 0; i < events; ++i) {
+        s += touch(&users[order[i & ((1 << 20) - 1)]]);
+    }
+    double t = now() - start;
+    report("fd-array", t, events, misses, misses.stop());
+    sink += s;
+
+    misses.start();
+    start = now();
+    s = 0;
+    for(long i = 0; i < events; ++i) {
+        s += touch(table.get(order[i & ((1 << 20) - 1)]));
+    }
+    t = now() - start;
+    report("conn_table", t, events, misses, misses.stop());
+    sink += s;
+
+    delete [] users;
+    delete [] order;
+    delete [] fds;
+    return 0;
+}
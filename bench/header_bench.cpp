@@ -0,0 +1,97 @@
+// 响应头生成吞吐量对比：每个请求用vsnprintf逐行格式化 与 引用预先生成的响应头
+// 编译：g++ -O2 bench/header_bench.cpp -pthread -o header_bench
+// 运行：./header_bench [每种情况的次数]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "../http/http_conn.h"
+
+#define BUFFER_SIZE 1024
+
+// 原来process_write中add_status_line、add_headers这一组函数的做法，每个请求格式化五次
+struct formatter {
+    char buf[BUFFER_SIZE];
+    int idx;
+
+    bool add_response(const char* format, ...)
+    {
+        if(idx >= BUFFER_SIZE) return false;
+        va_list arg_list;
+        va_start(arg_list, format);
+        int len = vsnprintf(buf + idx, BUFFER_SIZE - 1 - idx, format, arg_list);
+        va_end(arg_list);
+        if(len >= (BUFFER_SIZE - 1 - idx)) return false;
+        idx += len;
+        return true;
+    }
+
+    bool format(off_t size, bool linger)
+    {
+        idx = 0;
+        return add_response("%s %d %s\r\n", "HTTP/1.1", 200, ok_200_title) &&
+               add_response("Content-Length: %d\r\n", (int)size) &&
+               add_response("Content-Type:%s\r\n", "text/html") &&
+               add_response("Connection: %s\r\n", linger ? "keep-alive" : "close") &&
+               add_response("%s", "\r\n");
+    }
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 防止编译器把没有使用的结果优化掉
+static volatile size_t sink;
+
+int main(int argc, char* argv[])
+{
+    long total = argc > 1 ? atol(argv[1]) : 10000000;
+
+    // 模拟缓存中的几个文件，文件大小不同，响应头长度也不同
+    off_t sizes[] = { 350, 67313, 1048576, 7 };
+    const int files = sizeof(sizes) / sizeof(sizes[0]);
+    file_entry entries[files];
+    for(int i = 0; i < files; ++i) {
+        memset(&entries[i].st, 0, sizeof(entries[i].st));
+        entries[i].st.st_size = sizes[i];
+        http_conn::prepare_file(&entries[i]);
+    }
+
+    formatter f;
+    double start = now();
+    for(long i = 0; i < total; ++i) {
+        f.format(sizes[i % files], i & 1);
+        sink += f.idx;
+    }
+    double old_rate = total / (now() - start);
+
+    struct iovec iv[2];
+    start = now();
+    for(long i = 0; i < total; ++i) {
+        const file_entry& e = entries[i % files];
+        iv[0].iov_base = (void*)e.header.data();
+        iv[0].iov_len = e.header.size();
+        if(i & 1) {
+            iv[1].iov_base = (void*)connection_keep_alive;
+            iv[1].iov_len = sizeof(connection_keep_alive) - 1;
+        }else{
+            iv[1].iov_base = (void*)connection_close;
+            iv[1].iov_len = sizeof(connection_close) - 1;
+        }
+        sink += iv[0].iov_len + iv[1].iov_len;
+        __asm__ __volatile__("" : : "r"(iv) : "memory");
+    }
+    double new_rate = total / (now() - start);
+
+    printf("%-12s %16s\n", "header", "headers/s");
+    printf("%-12s %16.0f\n", "vsnprintf", old_rate);
+    printf("%-12s %16.0f\n", "prebuilt", new_rate);
+    return 0;
+}
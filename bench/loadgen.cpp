@@ -0,0 +1,786 @@
+// HTTP负载生成器：通过回环地址驱动服务器，支持闭环和恒定速率的开环两种模式
+// 编译：g++ -O2 bench/loadgen.cpp -pthread -o loadgen
+// 运行：./loadgen [-H host] [-p port] [-c 连接数] [-t 线程数] [-d 秒数] [-w 预热秒数] [-P 流水线深度]
+//              [-k 0|1] [-R 每秒请求数] [-s small|image|404|churn|mix|all] [-u 路径:权重,...]
+//              [-o 结果文件] [-n 标签] [-b 基准结果文件] [-x 允许的退化百分比]
+//
+// 闭环模式（默认）：每个连接始终保持P个在途请求，收到一个响应就发下一个，延迟是服务时间。
+// 开环模式（-R）：请求按固定速率产生，不管之前的请求是否完成。延迟从请求按计划应该发出的时刻算起，
+// 服务器停顿时积压的请求也计入等待的时间，这样修正了协调遗漏（coordinated omission）；
+// 同时报告从实际发出时刻算起的未修正延迟，两者的差距就是被闭环测量掩盖的排队时间。
+//
+// 每个场景的结果以一行JSON追加到-o指定的文件，-n给这次运行加上标签（例如构建的版本）。
+// -b指定之前的结果文件时，和其中同一场景、同一模式的最后一次结果比较，吞吐量下降或p99延迟上升
+// 超过-x百分比（默认10）时报告退化并以1退出，可以直接用在回归检查中。
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+#include "../metrics/metrics.h"
+
+#define MAX_PIPELINE_DEPTH 64   // 每个连接最多的在途请求数
+#define HEADER_MAX 8192         // 响应头的最大长度
+#define READ_CHUNK 65536
+#define MAX_EVENTS 256
+
+// 请求组合中的一个路径和它的权重
+struct path_weight {
+    std::string path;
+    int weight;
+};
+
+struct options {
+    const char* host;
+    int port;
+    int conns;
+    int threads;
+    double duration;
+    double warmup;      // 开始后这段时间内完成的请求不计入结果
+    int pipeline;
+    bool keepalive;
+    double rate;        // 开环模式的总速率，0表示闭环
+    std::string scenario;
+    std::vector<path_weight> mix;
+    int total_weight;
+};
+
+// 和服务器的/__stats相同的分桶，单位是纳秒
+struct histogram {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+
+    void clear() { memset(this, 0, sizeof(*this)); }
+    void add(uint64_t v)
+    {
+        ++buckets[metrics::bucket_index(v)];
+        ++count;
+        sum += v;
+        if(v > max) max = v;
+    }
+    void merge(const histogram& o)
+    {
+        for(int i = 0; i < HIST_BUCKETS; ++i) buckets[i] += o.buckets[i];
+        count += o.count;
+        sum += o.sum;
+        if(o.max > max) max = o.max;
+    }
+    uint64_t percentile(double q) const
+    {
+        if(count == 0) return 0;
+        uint64_t rank = (uint64_t)(q * count);
+        if(rank < q * count || rank == 0) ++rank;
+        uint64_t seen = 0;
+        for(int i = 0; i < HIST_BUCKETS; ++i) {
+            seen += buckets[i];
+            if(seen >= rank) {
+                uint64_t v = metrics::bucket_value(i);
+                return v < max ? v : max;
+            }
+        }
+        return max;
+    }
+};
+
+/*
+    客户端连接的状态
+    CONN_CLOSED     :   没有socket
+    CONN_CONNECTING :   非阻塞connect还没有完成，请求先放在发送缓冲中
+    CONN_OPEN       :   可以收发
+    CONN_DRAINING   :   最后一个响应已经收完，等服务器先关闭，TIME_WAIT留在服务器一侧
+*/
+enum CONN_STATE { CONN_CLOSED = 0, CONN_CONNECTING, CONN_OPEN, CONN_DRAINING };
+
+struct client {
+    int fd;
+    CONN_STATE state;
+    bool used;              // 不保持连接时每个连接只发一个请求
+    bool want_out;          // 是否注册了EPOLLOUT
+    std::string out;        // 还没有发出的请求
+    size_t out_off;
+    // 在途请求的计划发送时刻和实际交给连接的时刻，按发送顺序排列的环形队列
+    uint64_t intended[MAX_PIPELINE_DEPTH];
+    uint64_t sent[MAX_PIPELINE_DEPTH];
+    int head;
+    int count;
+    // 响应解析状态
+    char header[HEADER_MAX];
+    int header_len;
+    bool in_body;
+    long long body_left;
+    int status;
+    bool close_after;       // 响应带有Connection: close
+};
+
+// 一个负载线程，有自己的epoll、连接和统计，结束后由主线程汇总
+struct loader {
+    const options* opt;
+    struct sockaddr_in addr;
+    int epollfd;
+    client* clients;
+    int nclients;
+    int next_client;        // 开环模式轮流分配请求的起点
+    uint64_t rng;
+    double rate;            // 本线程的开环速率
+    uint64_t start;
+    uint64_t record_from;
+    uint64_t stop;
+    uint64_t issued;        // 开环模式已经产生的请求数
+    std::deque<uint64_t> backlog; // 已经到了计划时刻、还没有连接可以发送的请求
+
+    histogram corrected;
+    histogram raw;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t connects;
+    uint64_t bytes;
+    uint64_t status[6];     // 下标是状态码的百位，0是无法解析的响应
+    uint64_t unfinished;    // 结束时计划时刻在统计区间内、还没有完成的请求
+    pthread_t tid;
+};
+
+static uint64_t now_ns()
+{
+    return metrics::now();
+}
+
+static uint64_t next_random(loader* l)
+{
+    // xorshift64
+    l->rng ^= l->rng << 13;
+    l->rng ^= l->rng >> 7;
+    l->rng ^= l->rng << 17;
+    return l->rng;
+}
+
+static void set_out_interest(loader* l, client* c, bool want)
+{
+    if(c->want_out == want) return;
+    epoll_event ev;
+    ev.data.ptr = c;
+    ev.events = EPOLLIN | EPOLLRDHUP | (want ? (int)EPOLLOUT : 0);
+    epoll_ctl(l->epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_out = want;
+}
+
+static void close_client(loader* l, client* c)
+{
+    if(c->fd >= 0) {
+        epoll_ctl(l->epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->state = CONN_CLOSED;
+    c->out.clear();
+    c->out_off = 0;
+    c->head = c->count = 0;
+    c->header_len = 0;
+    c->in_body = false;
+}
+
+static bool open_client(loader* l, client* c)
+{
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(c->fd < 0) return false;
+    int on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    c->used = false;
+    c->want_out = true;
+    c->state = CONN_CONNECTING;
+    epoll_event ev;
+    ev.data.ptr = c;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+    epoll_ctl(l->epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+    if(connect(c->fd, (struct sockaddr*)&l->addr, sizeof(l->addr)) < 0 && errno != EINPROGRESS) {
+        close_client(l, c);
+        ++l->errors;
+        return false;
+    }
+    ++l->connects;
+    return true;
+}
+
+// 连接还能不能再接受一个请求
+static bool has_room(loader* l, client* c)
+{
+    if(c->state != CONN_OPEN && c->state != CONN_CONNECTING) return false;
+    if(!l->opt->keepalive) return !c->used;
+    return c->count < l->opt->pipeline;
+}
+
+static void flush(loader* l, client* c)
+{
+    while(c->out_off < c->out.size()) {
+        ssize_t n = send(c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_out_interest(l, c, true);
+                return;
+            }
+            // 发送失败的请求在读端报告错误时统一计数
+            return;
+        }
+        c->out_off += n;
+    }
+    c->out.clear();
+    c->out_off = 0;
+    set_out_interest(l, c, false);
+}
+
+// 按权重随机选一个路径，把请求交给连接
+static void send_request(loader* l, client* c, uint64_t intended)
+{
+    const options* opt = l->opt;
+    int pick = (int)(next_random(l) % opt->total_weight);
+    size_t i = 0;
+    while(pick >= opt->mix[i].weight) {
+        pick -= opt->mix[i].weight;
+        ++i;
+    }
+    char req[512];
+    int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: %s\r\n\r\n",
+                       opt->mix[i].path.c_str(), opt->host, opt->port, opt->keepalive ? "keep-alive" : "close");
+    c->out.append(req, len);
+    int slot = (c->head + c->count) % MAX_PIPELINE_DEPTH;
+    c->intended[slot] = intended;
+    c->sent[slot] = now_ns();
+    ++c->count;
+    c->used = true;
+    if(c->state == CONN_OPEN) flush(l, c);
+}
+
+// 开环模式：把到了计划时刻的请求放进积压队列，再分给有空位的连接
+static void generate(loader* l, uint64_t now)
+{
+    // 第i个请求的计划时刻是i/rate，到now为止应该产生的请求数
+    uint64_t due = (uint64_t)((now - l->start) * l->rate / 1e9) + 1;
+    while(l->issued < due) {
+        l->backlog.push_back(l->start + (uint64_t)(l->issued * 1e9 / l->rate));
+        ++l->issued;
+    }
+}
+
+static void dispatch(loader* l)
+{
+    int tried = 0;
+    while(!l->backlog.empty() && tried < l->nclients) {
+        client* c = &l->clients[l->next_client];
+        l->next_client = (l->next_client + 1) % l->nclients;
+        if(c->state == CONN_CLOSED) {
+            open_client(l, c);
+        }
+        if(!has_room(l, c)) {
+            ++tried;
+            continue;
+        }
+        tried = 0;
+        send_request(l, c, l->backlog.front());
+        l->backlog.pop_front();
+    }
+}
+
+// 闭环模式：把连接的在途请求补满
+static void refill(loader* l, client* c)
+{
+    uint64_t now = now_ns();
+    if(now >= l->stop) return;
+    if(c->state == CONN_CLOSED && !open_client(l, c)) return;
+    while(has_room(l, c)) {
+        send_request(l, c, now);
+    }
+}
+
+// 连接出错或服务器提前关闭，在途请求都算失败，重新连接
+static void fail(loader* l, client* c)
+{
+    l->errors += c->count;
+    if(c->count == 0 && c->state != CONN_DRAINING) ++l->errors;
+    close_client(l, c);
+}
+
+static void parse_header(client* c, int len)
+{
+    c->status = 0;
+    c->body_left = 0;
+    c->close_after = false;
+    c->header[len - 1] = '\0';
+    if(strncmp(c->header, "HTTP/1.", 7) == 0 && len > 12) {
+        c->status = atoi(c->header + 9);
+    }
+    char* line = strstr(c->header, "\r\n");
+    while(line && line[2] != '\r' && line[2] != '\0') {
+        line += 2;
+        if(strncasecmp(line, "Content-Length:", 15) == 0) {
+            c->body_left = atoll(line + 15);
+        }else if(strncasecmp(line, "Connection:", 11) == 0) {
+            const char* v = line + 11;
+            while(*v == ' ') ++v;
+            if(strncasecmp(v, "close", 5) == 0) c->close_after = true;
+        }
+        line = strstr(line, "\r\n");
+    }
+}
+
+// 一个响应收完
+static void complete(loader* l, client* c)
+{
+    uint64_t now = now_ns();
+    uint64_t intended = c->intended[c->head];
+    uint64_t sent = c->sent[c->head];
+    c->head = (c->head + 1) % MAX_PIPELINE_DEPTH;
+    --c->count;
+    c->in_body = false;
+    if(intended >= l->record_from && now <= l->stop) {
+        l->corrected.add(now - intended);
+        l->raw.add(now - sent);
+        ++l->requests;
+        int cls = c->status / 100;
+        ++l->status[cls >= 1 && cls <= 5 ? cls : 0];
+    }
+    if(c->close_after || !l->opt->keepalive) {
+        c->state = CONN_DRAINING;
+    }
+}
+
+static void handle_read(loader* l, client* c)
+{
+    static __thread char buf[READ_CHUNK];
+    while(true) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+            fail(l, c);
+            return;
+        }
+        if(n == 0) {
+            // 服务器关闭连接，收完最后一个响应后是正常的
+            if(c->state == CONN_DRAINING && c->count == 0) {
+                close_client(l, c);
+            }else{
+                fail(l, c);
+            }
+            return;
+        }
+        uint64_t now = now_ns();
+        if(now >= l->record_from && now <= l->stop) l->bytes += n;
+        ssize_t off = 0;
+        while(off < n) {
+            if(c->count == 0) {
+                // 没有在途请求却收到了数据
+                fail(l, c);
+                return;
+            }
+            if(c->in_body) {
+                long long take = n - off < c->body_left ? n - off : c->body_left;
+                off += take;
+                c->body_left -= take;
+                if(c->body_left == 0) complete(l, c);
+                continue;
+            }
+            // 响应头可能分几次到达，先复制进来再找空行
+            int take = n - off < HEADER_MAX - c->header_len ? n - off : HEADER_MAX - c->header_len;
+            if(take == 0) {
+                fail(l, c);
+                return;
+            }
+            int old = c->header_len;
+            memcpy(c->header + old, buf + off, take);
+            c->header_len += take;
+            int from = old > 3 ? old - 3 : 0;
+            char* end = (char*)memmem(c->header + from, c->header_len - from, "\r\n\r\n", 4);
+            if(!end) {
+                off += take;
+                continue;
+            }
+            int header_len = end + 4 - c->header;
+            off += header_len - old;
+            c->header_len = 0;
+            parse_header(c, header_len);
+            c->in_body = true;
+            if(c->body_left == 0) complete(l, c);
+        }
+    }
+}
+
+static void* run_loader(void* arg)
+{
+    loader* l = (loader*)arg;
+    bool open_loop = l->rate > 0;
+    epoll_event events[MAX_EVENTS];
+
+    // 闭环模式一开始就让所有连接发满请求
+    if(!open_loop) {
+        for(int i = 0; i < l->nclients; ++i) refill(l, &l->clients[i]);
+    }
+
+    while(true) {
+        uint64_t now = now_ns();
+        if(now >= l->stop) break;
+        int timeout = (int)((l->stop - now) / 1000000) + 1;
+        if(open_loop) {
+            generate(l, now);
+            dispatch(l);
+            // 睡到下一个请求的计划时刻
+            uint64_t next = l->start + (uint64_t)(l->issued * 1e9 / l->rate);
+            int wait = next > now ? (int)((next - now) / 1000000) : 0;
+            if(wait < timeout) timeout = wait;
+        }
+        int n = epoll_wait(l->epollfd, events, MAX_EVENTS, timeout);
+        for(int i = 0; i < n; ++i) {
+            client* c = (client*)events[i].data.ptr;
+            if(c->fd < 0) continue;
+            if(c->state == CONN_CONNECTING && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if(err != 0) {
+                    fail(l, c);
+                    continue;
+                }
+                c->state = CONN_OPEN;
+            }
+            if((events[i].events & EPOLLOUT) && c->state == CONN_OPEN) {
+                flush(l, c);
+            }
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                handle_read(l, c);
+            }
+            if(!open_loop && c->state != CONN_DRAINING) {
+                refill(l, c);
+            }
+        }
+    }
+    // 服务器跟不上目标速率时，大量请求直到结束都没有完成，它们的延迟无法统计，单独计数
+    l->unfinished = 0;
+    for(size_t i = 0; i < l->backlog.size(); ++i) {
+        if(l->backlog[i] >= l->record_from) ++l->unfinished;
+    }
+    for(int i = 0; i < l->nclients; ++i) {
+        client* c = &l->clients[i];
+        for(int j = 0; j < c->count; ++j) {
+            if(c->intended[(c->head + j) % MAX_PIPELINE_DEPTH] >= l->record_from) ++l->unfinished;
+        }
+        close_client(l, c);
+    }
+    return l;
+}
+
+// 把"路径:权重,..."解析成请求组合
+static bool parse_mix(const char* spec, options* opt)
+{
+    opt->mix.clear();
+    opt->total_weight = 0;
+    std::string s(spec);
+    size_t pos = 0;
+    while(pos < s.size()) {
+        size_t comma = s.find(',', pos);
+        if(comma == std::string::npos) comma = s.size();
+        std::string item = s.substr(pos, comma - pos);
+        pos = comma + 1;
+        if(item.empty()) continue;
+        path_weight pw;
+        size_t colon = item.rfind(':');
+        pw.path = colon == std::string::npos ? item : item.substr(0, colon);
+        pw.weight = colon == std::string::npos ? 1 : atoi(item.c_str() + colon + 1);
+        if(pw.path.empty() || pw.path[0] != '/' || pw.weight <= 0) return false;
+        opt->total_weight += pw.weight;
+        opt->mix.push_back(pw);
+    }
+    return !opt->mix.empty();
+}
+
+// 内置场景：小页面、image1.jpg大小的文件、404、每个请求一个新连接、按比例混合
+static bool apply_scenario(const std::string& name, options* opt, const char* custom_mix)
+{
+    opt->scenario = name;
+    if(name == "small") return parse_mix("/index.html", opt);
+    if(name == "image") return parse_mix("/images/image1.jpg", opt);
+    if(name == "404") return parse_mix("/does-not-exist.html", opt);
+    if(name == "churn") {
+        opt->keepalive = false;
+        opt->pipeline = 1;
+        return parse_mix("/index.html", opt);
+    }
+    if(name == "mix") return parse_mix(custom_mix ? custom_mix : "/index.html:70,/images/image1.jpg:20,/does-not-exist.html:10", opt);
+    return false;
+}
+
+struct result {
+    double elapsed;
+    histogram corrected;
+    histogram raw;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t connects;
+    uint64_t bytes;
+    uint64_t status[6];
+    uint64_t unfinished;
+};
+
+static bool run(const options& opt, result* res)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    if(inet_pton(AF_INET, opt.host, &addr.sin_addr) != 1) return false;
+
+    std::vector<loader*> loaders;
+    uint64_t start = now_ns();
+    for(int t = 0; t < opt.threads; ++t) {
+        loader* l = new loader;
+        l->opt = &opt;
+        l->addr = addr;
+        l->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        l->nclients = opt.conns / opt.threads + (t < opt.conns % opt.threads ? 1 : 0);
+        l->clients = new client[l->nclients];
+        for(int i = 0; i < l->nclients; ++i) {
+            l->clients[i].fd = -1;
+            close_client(l, &l->clients[i]);
+        }
+        l->next_client = 0;
+        l->rng = 0x9e3779b97f4a7c15ULL * (t + 1);
+        l->rate = opt.rate / opt.threads;
+        l->start = start;
+        l->record_from = start + (uint64_t)(opt.warmup * 1e9);
+        l->stop = l->record_from + (uint64_t)(opt.duration * 1e9);
+        l->issued = 0;
+        l->corrected.clear();
+        l->raw.clear();
+        l->requests = l->errors = l->connects = l->bytes = 0;
+        memset(l->status, 0, sizeof(l->status));
+        loaders.push_back(l);
+    }
+    for(size_t t = 0; t < loaders.size(); ++t) {
+        pthread_create(&loaders[t]->tid, NULL, run_loader, loaders[t]);
+    }
+
+    res->corrected.clear();
+    res->raw.clear();
+    res->requests = res->errors = res->connects = res->bytes = res->unfinished = 0;
+    memset(res->status, 0, sizeof(res->status));
+    for(size_t t = 0; t < loaders.size(); ++t) {
+        loader* l = loaders[t];
+        pthread_join(l->tid, NULL);
+        res->corrected.merge(l->corrected);
+        res->raw.merge(l->raw);
+        res->requests += l->requests;
+        res->errors += l->errors;
+        res->connects += l->connects;
+        res->bytes += l->bytes;
+        res->unfinished += l->unfinished;
+        for(int i = 0; i < 6; ++i) res->status[i] += l->status[i];
+        close(l->epollfd);
+        delete [] l->clients;
+        delete l;
+    }
+    res->elapsed = opt.duration;
+    return true;
+}
+
+static void format_latency(char* buf, size_t size, const histogram& h)
+{
+    snprintf(buf, size, "{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f,\"mean\":%.1f}",
+             h.percentile(0.5) / 1e3, h.percentile(0.9) / 1e3, h.percentile(0.99) / 1e3,
+             h.percentile(0.999) / 1e3, h.max / 1e3, h.count ? (double)h.sum / h.count / 1e3 : 0.0);
+}
+
+static void print_result(const options& opt, const result& r)
+{
+    printf("scenario %s: %s, %d threads, %d connections, pipeline %d, %s, %.0f s\n", opt.scenario.c_str(),
+           opt.rate > 0 ? "open loop" : "closed loop", opt.threads, opt.conns, opt.pipeline,
+           opt.keepalive ? "keep-alive" : "close", opt.duration);
+    if(opt.rate > 0) printf("  target rate %.0f req/s\n", opt.rate);
+    printf("  requests %llu (%.1f/s), errors %llu, connects %llu, %.2f MB/s\n",
+           (unsigned long long)r.requests, r.requests / r.elapsed, (unsigned long long)r.errors,
+           (unsigned long long)r.connects, r.bytes / r.elapsed / 1e6);
+    if(r.unfinished > 0) {
+        printf("  %llu requests unfinished at the end%s\n", (unsigned long long)r.unfinished,
+               opt.rate > 0 ? ", the target rate was not sustained" : "");
+    }
+    printf("  status 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n", (unsigned long long)r.status[2],
+           (unsigned long long)r.status[3], (unsigned long long)r.status[4], (unsigned long long)r.status[5],
+           (unsigned long long)(r.status[0] + r.status[1]));
+    printf("  %-14s %10s %10s %10s %10s %10s %10s\n", "latency(us)", "p50", "p90", "p99", "p999", "max", "mean");
+    const histogram* hs[2] = { &r.corrected, &r.raw };
+    const char* names[2] = { opt.rate > 0 ? "corrected" : "service", "uncorrected" };
+    for(int i = 0; i < (opt.rate > 0 ? 2 : 1); ++i) {
+        const histogram& h = *hs[i];
+        printf("  %-14s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", names[i], h.percentile(0.5) / 1e3,
+               h.percentile(0.9) / 1e3, h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.max / 1e3,
+               h.count ? (double)h.sum / h.count / 1e3 : 0.0);
+    }
+}
+
+static std::string result_json(const options& opt, const result& r, const char* label)
+{
+    char corrected[256], raw[256], line[1024];
+    format_latency(corrected, sizeof(corrected), r.corrected);
+    format_latency(raw, sizeof(raw), r.raw);
+    snprintf(line, sizeof(line),
+             "{\"label\":\"%s\",\"time\":%lld,\"scenario\":\"%s\",\"mode\":\"%s\",\"rate\":%.0f,\"threads\":%d,"
+             "\"connections\":%d,\"pipeline\":%d,\"keepalive\":%s,\"duration_s\":%.1f,\"requests\":%llu,"
+             "\"errors\":%llu,\"unfinished\":%llu,\"connects\":%llu,\"rps\":%.1f,\"bytes\":%llu,"
+             "\"status\":{\"2xx\":%llu,\"3xx\":%llu,\"4xx\":%llu,\"5xx\":%llu,\"other\":%llu},"
+             "\"latency_us\":%s,\"latency_uncorrected_us\":%s}\n",
+             label, (long long)time(NULL), opt.scenario.c_str(), opt.rate > 0 ? "open" : "closed", opt.rate,
+             opt.threads, opt.conns, opt.pipeline, opt.keepalive ? "true" : "false", r.elapsed,
+             (unsigned long long)r.requests, (unsigned long long)r.errors, (unsigned long long)r.unfinished,
+             (unsigned long long)r.connects, r.requests / r.elapsed, (unsigned long long)r.bytes, (unsigned long long)r.status[2],
+             (unsigned long long)r.status[3], (unsigned long long)r.status[4], (unsigned long long)r.status[5],
+             (unsigned long long)(r.status[0] + r.status[1]), corrected, raw);
+    return line;
+}
+
+// 在一行结果中，从section（为NULL时从行首）开始找"key":后面的数
+static bool json_number(const std::string& line, const char* section, const char* key, double* value)
+{
+    size_t pos = 0;
+    if(section) {
+        pos = line.find(section);
+        if(pos == std::string::npos) return false;
+    }
+    std::string k = std::string("\"") + key + "\":";
+    pos = line.find(k, pos);
+    if(pos == std::string::npos) return false;
+    *value = atof(line.c_str() + pos + k.size());
+    return true;
+}
+
+// 和基准文件中同一场景、同一模式的最后一次结果比较，有退化时返回false
+static bool compare_baseline(const char* path, const std::string& current, const options& opt, double tolerance)
+{
+    FILE* f = fopen(path, "r");
+    if(!f) {
+        printf("  baseline %s not readable\n", path);
+        return true;
+    }
+    std::string scenario = "\"scenario\":\"" + opt.scenario + "\"";
+    std::string mode = std::string("\"mode\":\"") + (opt.rate > 0 ? "open" : "closed") + "\"";
+    std::string base;
+    char buf[2048];
+    while(fgets(buf, sizeof(buf), f)) {
+        std::string line(buf);
+        if(line.find(scenario) != std::string::npos && line.find(mode) != std::string::npos) base = line;
+    }
+    fclose(f);
+    if(base.empty()) {
+        printf("  no baseline for this scenario\n");
+        return true;
+    }
+    double base_rps, cur_rps, base_p99, cur_p99;
+    if(!json_number(base, NULL, "rps", &base_rps) || !json_number(current, NULL, "rps", &cur_rps) ||
+       !json_number(base, "\"latency_us\"", "p99", &base_p99) || !json_number(current, "\"latency_us\"", "p99", &cur_p99)) {
+        printf("  baseline is malformed\n");
+        return true;
+    }
+    bool ok = true;
+    // 开环模式下吞吐量由目标速率决定，只比较延迟
+    if(opt.rate <= 0 && cur_rps < base_rps * (1 - tolerance / 100)) {
+        printf("  REGRESSION: throughput %.1f/s vs baseline %.1f/s\n", cur_rps, base_rps);
+        ok = false;
+    }
+    if(cur_p99 > base_p99 * (1 + tolerance / 100)) {
+        printf("  REGRESSION: p99 %.1f us vs baseline %.1f us\n", cur_p99, base_p99);
+        ok = false;
+    }
+    if(ok) printf("  within %.0f%% of baseline (%.1f/s, p99 %.1f us)\n", tolerance, base_rps, base_p99);
+    return ok;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s [-H host] [-p port] [-c conns] [-t threads] [-d seconds] [-w warmup_seconds]\n"
+           "    [-P pipeline] [-k 0|1] [-R rate] [-s small|image|404|churn|mix|all] [-u path:weight,...]\n"
+           "    [-o results.jsonl] [-n label] [-b baseline.jsonl] [-x tolerance_percent]\n", name);
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    options base;
+    base.host = "127.0.0.1";
+    base.port = 10000;
+    base.conns = 50;
+    base.threads = 1;
+    base.duration = 10;
+    base.warmup = 1;
+    base.pipeline = 1;
+    base.keepalive = true;
+    base.rate = 0;
+    const char* scenario = "small";
+    const char* custom_mix = NULL;
+    const char* output = NULL;
+    const char* label = "";
+    const char* baseline = NULL;
+    double tolerance = 10;
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:c:t:d:w:P:k:R:s:u:o:n:b:x:")) != -1) {
+        switch(opt) {
+            case 'H': base.host = optarg; break;
+            case 'p': base.port = atoi(optarg); break;
+            case 'c': base.conns = atoi(optarg); break;
+            case 't': base.threads = atoi(optarg); break;
+            case 'd': base.duration = atof(optarg); break;
+            case 'w': base.warmup = atof(optarg); break;
+            case 'P': base.pipeline = atoi(optarg); break;
+            case 'k': base.keepalive = atoi(optarg) != 0; break;
+            case 'R': base.rate = atof(optarg); break;
+            case 's': scenario = optarg; break;
+            case 'u': custom_mix = optarg; scenario = "mix"; break;
+            case 'o': output = optarg; break;
+            case 'n': label = optarg; break;
+            case 'b': baseline = optarg; break;
+            case 'x': tolerance = atof(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if(base.conns <= 0 || base.threads <= 0 || base.threads > base.conns || base.duration <= 0 ||
+       base.warmup < 0 || base.pipeline <= 0 || base.pipeline > MAX_PIPELINE_DEPTH || base.rate < 0) {
+        usage(argv[0]);
+    }
+
+    std::vector<std::string> scenarios;
+    if(strcmp(scenario, "all") == 0) {
+        const char* all[] = { "small", "image", "404", "churn" };
+        scenarios.assign(all, all + 4);
+    }else{
+        scenarios.push_back(scenario);
+    }
+
+    bool ok = true;
+    for(size_t i = 0; i < scenarios.size(); ++i) {
+        options o = base;
+        if(!apply_scenario(scenarios[i], &o, custom_mix)) usage(argv[0]);
+        result r;
+        if(!run(o, &r)) {
+            printf("bad host %s\n", o.host);
+            return 1;
+        }
+        print_result(o, r);
+        std::string line = result_json(o, r, label);
+        if(output) {
+            FILE* f = fopen(output, "a");
+            if(f) {
+                fputs(line.c_str(), f);
+                fclose(f);
+            }
+        }
+        if(baseline && !compare_baseline(baseline, line, o, tolerance)) ok = false;
+    }
+    return ok ? 0 : 1;
+}
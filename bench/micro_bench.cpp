@@ -0,0 +1,469 @@
+// 组件微基准：请求解析、升序链表定时器和时间轮、线程池请求队列、响应头生成，各自单独测量
+// 每个用例报告每次操作的纳秒数、内存分配次数，以及可用时的硬件计数器（周期、指令、缓存未命中、分支预测失败）
+// 编译：g++ -O2 bench/micro_bench.cpp -pthread -o micro_bench
+// 运行：./micro_bench [名字过滤]     只运行名字中包含过滤字符串的用例，例如 ./micro_bench parse/
+// 硬件计数器只统计调用线程，多线程的队列用例不显示；虚拟机或perf_event_paranoid限制时显示n/a
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <atomic>
+
+#include "../http/http_conn.h"
+#include "../noactive/lst_timer.h"
+#include "../timer/timer_wheel.h"
+#include "../threadpool/threadpool.h"
+
+// 统计内存分配：替换malloc一族，operator new也经过这里
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t n, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+extern "C" void __libc_free(void* p);
+
+static std::atomic<long> allocations(0);
+
+extern "C" void* malloc(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t n, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void* realloc(void* p, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+
+extern "C" void free(void* p)
+{
+    __libc_free(p);
+}
+
+// 一个硬件计数器，打不开时valid()为false
+struct counter {
+    int fd;
+
+    counter(uint64_t config)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~counter() { if(fd >= 0) close(fd); }
+    bool valid() const { return fd >= 0; }
+    void start() { if(fd >= 0) { ioctl(fd, PERF_EVENT_IOC_RESET, 0); ioctl(fd, PERF_EVENT_IOC_ENABLE, 0); } }
+    long long stop()
+    {
+        long long value = -1;
+        if(fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if(::read(fd, &value, sizeof(value)) != sizeof(value)) value = -1;
+        }
+        return value;
+    }
+};
+
+#define COUNTER_NUMBER 4
+static const uint64_t counter_configs[COUNTER_NUMBER] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+static counter* counters[COUNTER_NUMBER];
+
+static const char* filter = NULL;
+static FILE* out = stdout; // 结果输出，被测代码的printf重定向到/dev/null
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool selected(const char* name)
+{
+    return !filter || strstr(name, filter);
+}
+
+// 运行body(ops)并报告每次操作的耗时、分配次数和硬件计数，hw为false时不读计数器（多线程用例）
+template<typename F>
+static void measure(const char* name, long ops, bool hw, F body)
+{
+    long long values[COUNTER_NUMBER];
+    long alloc_start = allocations.load();
+    if(hw) {
+        for(int i = 0; i < COUNTER_NUMBER; ++i) counters[i]->start();
+    }
+    double start = now();
+    body(ops);
+    double elapsed = now() - start;
+    for(int i = 0; i < COUNTER_NUMBER; ++i) {
+        values[i] = hw ? counters[i]->stop() : -1;
+    }
+    long allocs = allocations.load() - alloc_start;
+
+    fprintf(out, "%-32s %10ld %10.1f %10.3f", name, ops, elapsed * 1e9 / ops, (double)allocs / ops);
+    for(int i = 0; i < COUNTER_NUMBER; ++i) {
+        if(values[i] >= 0) fprintf(out, " %10.1f", (double)values[i] / ops);
+        else fprintf(out, " %10s", "n/a");
+    }
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+// 请求解析：每次操作把一个预先准备好的缓冲复制进读缓冲，解析出其中所有完整的请求
+static const char* curl_request =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:10000\r\n"
+    "User-Agent: curl/8.4.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char* browser_request =
+    "GET /images/image1.jpg HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "\r\n";
+
+static const char* conditional_request =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Accept-Encoding: gzip, br\r\n"
+    "If-None-Match: \"1a2b3c-15e-17a0b1c2d3e4f5\"\r\n"
+    "If-Modified-Since: Sun, 21 May 2023 10:00:00 GMT\r\n"
+    "Range: bytes=0-99\r\n"
+    "\r\n";
+
+static const char* pipelined_request =
+    "GET /index.html HTTP/1.1\r\nHost: a\r\nConnection: keep-alive\r\n\r\n"
+    "GET /index.html HTTP/1.1\r\nHost: a\r\nConnection: keep-alive\r\n\r\n"
+    "GET /index.html HTTP/1.1\r\nHost: a\r\nConnection: keep-alive\r\n\r\n"
+    "GET /index.html HTTP/1.1\r\nHost: a\r\nConnection: keep-alive\r\n\r\n";
+
+static long expired = 0;
+static void list_cb(client_data*) { ++expired; }
+static void wheel_cb(client_data*) { ++expired; }
+
+// 空任务，只统计被处理的次数
+struct task {
+    static std::atomic<long> done;
+    void process() { done.fetch_add(1, std::memory_order_relaxed); }
+};
+std::atomic<long> task::done(0);
+
+#define TASK_NUMBER 64
+
+struct producer_arg {
+    threadpool<task>* pool;
+    task* tasks;
+    long count;
+};
+
+static void* producer(void* arg)
+{
+    producer_arg* p = (producer_arg*)arg;
+    for(long i = 0; i < p->count; ++i) {
+        // 队列满时让出CPU后重试
+        while(!p->pool->append(p->tasks + i % TASK_NUMBER)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// http_conn的友元，可以直接调用解析和响应生成的私有函数
+struct micro_bench {
+    static http_conn* make_conn()
+    {
+        http_conn* c = new http_conn;
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        c->init(-1, addr, -1, NULL);
+        c->grow_read_buf();
+        c->m_linger = true;
+        return c;
+    }
+
+    static void parse(const char* name, const char* request, long ops)
+    {
+        if(!selected(name)) return;
+        http_conn* c = make_conn();
+        int len = strlen(request);
+        measure(name, ops, true, [&](long n) {
+            for(long i = 0; i < n; ++i) {
+                c->init();
+                memcpy(c->m_read_buf, request, len);
+                c->m_read_idx = len;
+                while(c->process_read() == http_conn::GET_REQUEST) c->finish_request();
+            }
+        });
+        delete c;
+    }
+
+    // 生成一个响应并放进队列，再把队列清空，文件交回给连接，下一次操作生成同样的响应
+    static void write(const char* name, http_conn* c, http_conn::HTTP_CODE code, const char* range,
+                      const char* if_none_match, long ops)
+    {
+        if(!selected(name)) return;
+        static char range_buf[64], etag_buf[128];
+        file_entry* file = c->m_file;
+        int file_fd = c->m_file_fd;
+        measure(name, ops, true, [&](long n) {
+            for(long i = 0; i < n; ++i) {
+                c->m_write_idx = 0;
+                c->m_resp_head = c->m_resp_count = 0;
+                c->m_range = NULL;
+                c->m_if_none_match = NULL;
+                if(range) {
+                    strcpy(range_buf, range);
+                    c->m_range = range_buf;
+                }
+                if(if_none_match) {
+                    strcpy(etag_buf, if_none_match);
+                    c->m_if_none_match = etag_buf;
+                }
+                c->m_file = file;
+                c->m_file_fd = file_fd;
+                c->process_write(code);
+                for(int j = 0; j < c->m_resp_count; ++j) {
+                    c->m_responses[j].file = NULL;
+                    c->m_responses[j].file_fd = -1;
+                }
+            }
+        });
+        c->m_resp_head = c->m_resp_count = 0;
+        c->m_file = NULL;
+        c->m_file_fd = -1;
+    }
+
+    static void write_all(long ops)
+    {
+        http_conn* c = make_conn();
+        c->reserve_write_buf();
+        c->init_request();
+        c->m_linger = true;
+        static char url[] = "/index.html";
+        c->m_url = url;
+        c->m_file = NULL;
+        c->m_file_fd = -1;
+
+        // 未缓存的文件：每个请求格式化响应头
+        char path[http_conn::FILENAME_LEN];
+        snprintf(path, sizeof(path), "%s%s", doc_root, url);
+        if(stat(path, &c->m_file_stat) < 0) {
+            memset(&c->m_file_stat, 0, sizeof(c->m_file_stat));
+            c->m_file_stat.st_size = 350;
+            c->m_file_stat.st_mode = S_IFREG | 0644;
+        }
+        write("write/uncached-200", c, http_conn::FILE_REQUEST, NULL, NULL, ops);
+        write("write/uncached-range", c, http_conn::FILE_REQUEST, "bytes=0-99", NULL, ops);
+        write("write/error-404", c, http_conn::NO_RESOURCE, NULL, NULL, ops);
+
+        // 缓存中的文件：引用预先生成的响应头
+        file_entry* entry = NULL;
+        if(http_conn::m_file_cache && http_conn::m_file_cache->acquire(url, &entry) == FILE_OK) {
+            c->m_file_stat = entry->st;
+            c->m_file = entry;
+            c->m_file_fd = entry->fd;
+            write("write/cached-200", c, http_conn::FILE_REQUEST, NULL, NULL, ops);
+            write("write/cached-304", c, http_conn::FILE_REQUEST, NULL, entry->etag.c_str(), ops);
+            c->m_file = entry;
+            c->m_file_fd = entry->fd;
+            write("write/cached-range", c, http_conn::FILE_REQUEST, "bytes=0-99,200-299", NULL, ops);
+            http_conn::m_file_cache->release(entry);
+        }else if(selected("write/cached")) {
+            fprintf(out, "%-32s %s not found, cached cases skipped\n", "write/cached-*", path);
+        }
+        delete c;
+    }
+};
+
+// 升序链表：先放入n个定时器，再计时添加、刷新、全部到期
+static void timers_list(int n, long ops)
+{
+    char name[64];
+    // sort_timer_lst::tick()使用真实时间，所以让所有定时器的超时时间都落在过去
+    time_t base = time(NULL) - 100;
+    sort_timer_lst* lst = new sort_timer_lst;
+    util_timer** timers = new util_timer*[n + ops];
+    for(int i = 0; i < n; ++i) {
+        // 按超时时间降序插入，每次都成为新的头节点，准备阶段不计时
+        timers[i] = new util_timer;
+        timers[i]->expire = base + 15 - (time_t)i * 15 / n;
+        timers[i]->cb_func = list_cb;
+        timers[i]->user_data = NULL;
+        lst->add_timer(timers[i]);
+    }
+    srand(n);
+    snprintf(name, sizeof(name), "timer/list-add/%d", n);
+    if(selected(name)) {
+        measure(name, ops, true, [&](long k) {
+            for(long i = 0; i < k; ++i) {
+                util_timer* t = new util_timer;
+                t->expire = base + rand() % 15;
+                t->cb_func = list_cb;
+                t->user_data = NULL;
+                timers[n + i] = t;
+                lst->add_timer(t);
+            }
+        });
+    }else{
+        ops = 0;
+    }
+    snprintf(name, sizeof(name), "timer/list-adjust/%d", n);
+    if(selected(name)) {
+        // 连接有活动时超时时间被推迟到最后，定时器向链表尾部移动
+        measure(name, n, true, [&](long k) {
+            for(long i = 0; i < k; ++i) {
+                util_timer* t = timers[rand() % n];
+                t->expire = base + 15;
+                lst->adjust_timer(t);
+            }
+        });
+    }
+    snprintf(name, sizeof(name), "timer/list-tick/%d", n);
+    if(selected(name)) {
+        expired = 0;
+        measure(name, n + ops, true, [&](long) { lst->tick(); });
+    }
+    delete lst;
+    delete [] timers;
+}
+
+// 时间轮：同样的三种操作，作为对照
+static void timers_wheel(int n, long ops)
+{
+    char name[64];
+    timer_wheel<client_data>* wheel = new timer_wheel<client_data>(n + ops, 0);
+    wheel_timer<client_data>** timers = new wheel_timer<client_data>*[n + ops];
+    for(int i = 0; i < n; ++i) {
+        timers[i] = wheel->add_timer(15 - (time_t)i * 15 / n, wheel_cb, NULL);
+    }
+    srand(n);
+    snprintf(name, sizeof(name), "timer/wheel-add/%d", n);
+    if(selected(name)) {
+        measure(name, ops, true, [&](long k) {
+            for(long i = 0; i < k; ++i) timers[n + i] = wheel->add_timer(rand() % 15, wheel_cb, NULL);
+        });
+    }else{
+        ops = 0;
+    }
+    snprintf(name, sizeof(name), "timer/wheel-adjust/%d", n);
+    if(selected(name)) {
+        measure(name, n, true, [&](long k) {
+            for(long i = 0; i < k; ++i) wheel->adjust_timer(timers[rand() % n], 15);
+        });
+    }
+    snprintf(name, sizeof(name), "timer/wheel-tick/%d", n);
+    if(selected(name)) {
+        expired = 0;
+        measure(name, n + ops, true, [&](long) { wheel->tick(15); });
+    }
+    delete wheel;
+    delete [] timers;
+}
+
+// threads个生产者向threads个工作线程的线程池投递total个任务，每次操作是一个任务从append到被处理
+static void queue(threadpool<task>::QUEUE_MODE mode, const char* mode_name, int threads, long total)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "queue/%s/%d", mode_name, threads);
+    if(!selected(name)) return;
+    threadpool<task>* pool = new threadpool<task>(threads, 10000, mode);
+    static task tasks[TASK_NUMBER];
+    long per = total / threads;
+    measure(name, per * threads, false, [&](long n) {
+        task::done.store(0);
+        pthread_t* tids = new pthread_t[threads];
+        producer_arg* args = new producer_arg[threads];
+        for(int i = 0; i < threads; ++i) {
+            args[i].pool = pool;
+            args[i].tasks = tasks;
+            args[i].count = per;
+            pthread_create(tids + i, NULL, producer, args + i);
+        }
+        for(int i = 0; i < threads; ++i) pthread_join(tids[i], NULL);
+        while(task::done.load() < n) sched_yield();
+        delete [] tids;
+        delete [] args;
+    });
+    // 工作线程是脱离线程且没有退出机制，这里不销毁线程池，避免它们访问已释放的内存
+}
+
+int main(int argc, char* argv[])
+{
+    filter = argc > 1 ? argv[1] : NULL;
+
+    // 被测代码中的调试输出不计入结果，也不能混进表格
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    for(int i = 0; i < COUNTER_NUMBER; ++i) counters[i] = new counter(counter_configs[i]);
+
+    http_conn::m_buffer_pool = new buffer_pool(4096, 2, 16);
+    http_conn::init_responses();
+    try {
+        http_conn::m_file_cache = new file_cache(doc_root, 16 << 20, 64, http_conn::prepare_file);
+    }catch(...) {
+        http_conn::m_file_cache = NULL;
+    }
+
+    fprintf(out, "%-32s %10s %10s %10s %10s %10s %10s %10s\n", "case", "ops", "ns/op", "allocs/op",
+            "cycles/op", "instr/op", "llc-miss", "br-miss");
+
+    micro_bench::parse("parse/curl", curl_request, 1000000);
+    micro_bench::parse("parse/browser", browser_request, 300000);
+    micro_bench::parse("parse/conditional", conditional_request, 1000000);
+    micro_bench::parse("parse/pipelined-x4", pipelined_request, 300000);
+
+    micro_bench::write_all(1000000);
+
+    int sizes[] = { 1000, 10000 };
+    for(int n : sizes) {
+        // 链表的添加和刷新是O(n)的，操作数随规模减少
+        timers_list(n, 10000000 / n);
+        timers_wheel(n, 10000000 / n);
+    }
+
+    int threads[] = { 1, 2, 4, 8, 16, 32, 64 };
+    for(int t : threads) {
+        queue(threadpool<task>::LIST_QUEUE, "list", t, 200000);
+        queue(threadpool<task>::LOCKFREE_QUEUE, "lockfree", t, 200000);
+        queue(threadpool<task>::WORK_STEALING, "stealing", t, 200000);
+    }
+    return 0;
+}
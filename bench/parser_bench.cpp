@@ -0,0 +1,249 @@
+// 请求解析吞吐量对比：逐字节查找行尾加strpbrk/strncasecmp 与 http_scan的向量化扫描（标量、SSE4.2、AVX2）
+// 编译：g++ -O2 bench/parser_bench.cpp -o parser_bench
+// 运行：./parser_bench [每种实现解析的请求数]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "../http/http_scan.h"
+
+// 浏览器、命令行工具和负载均衡器发出的典型请求
+static const char* corpus[] = {
+    // Chrome
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,zh-CN;q=0.8,zh;q=0.7\r\n"
+    "\r\n",
+    // Firefox请求图片
+    "GET /images/image1.jpg HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/119.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-Modified-Since: Tue, 10 Oct 2023 08:12:31 GMT\r\n"
+    "If-None-Match: \"6524f6bf-106f1\"\r\n"
+    "\r\n",
+    // curl
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:10000\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+    // 负载均衡器的健康检查
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 10.0.3.17\r\n"
+    "Connection: close\r\n"
+    "User-Agent: ELB-HealthChecker/2.0\r\n"
+    "Accept-Encoding: gzip, compressed\r\n"
+    "\r\n",
+    // 负载均衡器转发的请求
+    "GET /images/image1.jpg HTTP/1.1\r\n"
+    "X-Forwarded-For: 203.0.113.195, 70.41.3.18, 150.172.238.178\r\n"
+    "X-Forwarded-Proto: https\r\n"
+    "X-Forwarded-Port: 443\r\n"
+    "Host: www.example.com\r\n"
+    "X-Amzn-Trace-Id: Root=1-652d8a1f-3c1e5a0b6d7f2e4a9b8c1d0e\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (iPhone; CPU iPhone OS 17_0 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.0 Mobile/15E148 Safari/604.1\r\n"
+    "Accept: image/webp,image/png,image/svg+xml,image/*;q=0.8,video/*;q=0.8,*/*;q=0.5\r\n"
+    "Accept-Language: en-GB,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n",
+};
+#define CORPUS_SIZE (int)(sizeof(corpus) / sizeof(corpus[0]))
+#define BUFFER_SIZE 2048
+
+// 解析结果，两种实现必须一致
+struct request {
+    char* url;
+    char* host;
+    bool linger;
+    long content_length;
+    int headers;
+};
+
+// 原来的做法：逐字节找\r\n，用strpbrk切分请求行，用strncasecmp逐个尝试请求头名称
+static bool parse_bytewise(char* buf, int n, request* r)
+{
+    int checked = 0, start = 0;
+    bool first = true;
+    while(true) {
+        for(; checked < n; ++checked) {
+            if(buf[checked] == '\r' || buf[checked] == '\n') break;
+        }
+        if(checked + 1 >= n || buf[checked] != '\r' || buf[checked + 1] != '\n') return false;
+        buf[checked++] = '\0';
+        buf[checked++] = '\0';
+        char* text = buf + start;
+        start = checked;
+
+        if(first) {
+            first = false;
+            r->url = strpbrk(text, " \t");
+            if(!r->url) return false;
+            *r->url++ = '\0';
+            if(strcasecmp(text, "GET") != 0) return false;
+            char* version = strpbrk(r->url, " \t");
+            if(!version) return false;
+            *version++ = '\0';
+            if(strcasecmp(version, "HTTP/1.1") != 0) return false;
+        }else if(text[0] == '\0') {
+            return true;
+        }else{
+            ++r->headers;
+            if(strncasecmp(text, "Connection:", 11) == 0) {
+                text += 11;
+                text += strspn(text, " \t");
+                if(strcasecmp(text, "keep-alive") == 0) r->linger = true;
+            }else if(strncasecmp(text, "Content-Length:", 15) == 0) {
+                text += 15;
+                text += strspn(text, " \t");
+                r->content_length = atol(text);
+            }else if(strncasecmp(text, "Host:", 5) == 0) {
+                text += 5;
+                text += strspn(text, " \t");
+                r->host = text;
+            }
+        }
+    }
+}
+
+// http_conn现在的做法：扫描器找行尾和冒号，按长度识别请求头名称
+static bool parse_scan(char* buf, int n, request* r)
+{
+    char* p = buf;
+    char* end = buf + n;
+    bool first = true;
+    while(true) {
+        char* eol = (char*)http_scan::find_eol(p, end);
+        if(eol + 1 >= end || *eol != '\r' || eol[1] != '\n') return false;
+        eol[0] = eol[1] = '\0';
+        char* text = p;
+        int len = eol - p;
+        p = eol + 2;
+
+        if(first) {
+            first = false;
+            char* line_end = text + len;
+            r->url = (char*)http_scan::find_char(text, line_end, ' ');
+            if(r->url == line_end) return false;
+            *r->url++ = '\0';
+            if(r->url - text != 4 || strncasecmp(text, "GET", 3) != 0) return false;
+            char* version = (char*)http_scan::find_char(r->url, line_end, ' ');
+            if(version == line_end) return false;
+            *version++ = '\0';
+            if(line_end - version != 8 || strncasecmp(version, "HTTP/1.1", 8) != 0) return false;
+        }else if(len == 0) {
+            return true;
+        }else{
+            ++r->headers;
+            char* line_end = text + len;
+            char* colon = (char*)http_scan::find_char(text, line_end, ':');
+            if(colon == line_end) return false;
+            HEADER_NAME name = http_scan::lookup(text, colon - text);
+            if(name == HEADER_OTHER) continue;
+            char* value = colon + 1;
+            while(value < line_end && (*value == ' ' || *value == '\t')) ++value;
+            switch(name) {
+                case HEADER_CONNECTION:
+                    if(line_end - value == 10 && strncasecmp(value, "keep-alive", 10) == 0) r->linger = true;
+                    break;
+                case HEADER_CONTENT_LENGTH: r->content_length = atol(value); break;
+                case HEADER_HOST: r->host = value; break;
+                default: break;
+            }
+        }
+    }
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile long sink;
+
+// 解析total个请求，返回每秒解析的请求数。解析会修改缓冲，每次都先复制一份，两种实现的复制开销相同
+static double run(bool (*parse)(char*, int, request*), long total, int* lengths)
+{
+    char buf[BUFFER_SIZE];
+    double start = now();
+    for(long i = 0; i < total; ++i) {
+        int k = i % CORPUS_SIZE;
+        memcpy(buf, corpus[k], lengths[k]);
+        request r;
+        memset(&r, 0, sizeof(r));
+        if(!parse(buf, lengths[k], &r)) {
+            printf("parse failed: request %d\n", k);
+            exit(1);
+        }
+        sink += r.headers + r.linger;
+    }
+    return total / (now() - start);
+}
+
+int main(int argc, char* argv[])
+{
+    long total = argc > 1 ? atol(argv[1]) : 2000000;
+    int lengths[CORPUS_SIZE];
+    long bytes = 0;
+    for(int i = 0; i < CORPUS_SIZE; ++i) {
+        lengths[i] = strlen(corpus[i]);
+        bytes += lengths[i];
+    }
+
+    // 先检查两种实现的解析结果一致
+    for(int i = 0; i < CORPUS_SIZE; ++i) {
+        char a[BUFFER_SIZE], b[BUFFER_SIZE];
+        memcpy(a, corpus[i], lengths[i]);
+        memcpy(b, corpus[i], lengths[i]);
+        request ra, rb;
+        memset(&ra, 0, sizeof(ra));
+        memset(&rb, 0, sizeof(rb));
+        if(!parse_bytewise(a, lengths[i], &ra) || !parse_scan(b, lengths[i], &rb) ||
+           strcmp(ra.url, rb.url) != 0 || ra.linger != rb.linger || ra.content_length != rb.content_length ||
+           ra.headers != rb.headers || (ra.host == NULL) != (rb.host == NULL) || (ra.host && strcmp(ra.host, rb.host) != 0)) {
+            printf("mismatch: request %d\n", i);
+            return 1;
+        }
+    }
+
+    double avg = (double)bytes / CORPUS_SIZE;
+    printf("%-10s %14s %12s\n", "parser", "requests/s", "MB/s");
+    double rate = run(parse_bytewise, total, lengths);
+    printf("%-10s %14.0f %12.1f\n", "bytewise", rate, rate * avg / 1e6);
+    http_scan::ISA isas[] = { http_scan::SCALAR, http_scan::SSE42, http_scan::AVX2 };
+    for(http_scan::ISA isa : isas) {
+        if(http_scan::select(isa) != isa) {
+            printf("%-10s %14s\n", http_scan::name(isa), "unsupported");
+            continue;
+        }
+        rate = run(parse_scan, total, lengths);
+        printf("%-10s %14.0f %12.1f\n", http_scan::name(isa), rate, rate * avg / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+// 线程池请求队列吞吐量对比：加锁list、无锁环形队列与工作窃取
+// 编译：g++ -O2 bench/threadpool_bench.cpp -pthread -o threadpool_bench
+// 运行：./threadpool_bench [任务总数]
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "../threadpool/threadpool.h"
+
+// 空任务，只统计被处理的次数
+struct task {
+    static std::atomic<long> done;
+    void process() { done.fetch_add(1, std::memory_order_relaxed); }
+};
+std::atomic<long> task::done(0);
+
+// 模拟不同的连接，工作窃取模式按请求对象的位置分配线程
+#define TASK_NUMBER 64
+
+struct producer_arg {
+    threadpool<task>* pool;
+    task* tasks;
+    long count;
+};
+
+static void* producer(void* arg)
+{
+    producer_arg* p = (producer_arg*)arg;
+    for(long i = 0; i < p->count; ++i) {
+        // 队列满时让出CPU后重试
+        while(!p->pool->append(p->tasks + i % TASK_NUMBER)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 用producers个生产者线程向workers个工作线程的线程池投递total个任务，返回每秒处理的任务数
+static double run(threadpool<task>::QUEUE_MODE mode, int producers, int workers, long total)
+{
+    threadpool<task>* pool = new threadpool<task>(workers, 10000, mode);
+    static task tasks[TASK_NUMBER];
+    task::done.store(0);
+
+    pthread_t* tids = new pthread_t[producers];
+    producer_arg* args = new producer_arg[producers];
+    double start = now();
+    for(int i = 0; i < producers; ++i) {
+        args[i].pool = pool;
+        args[i].tasks = tasks;
+        args[i].count = total / producers;
+        pthread_create(tids + i, NULL, producer, args + i);
+    }
+    for(int i = 0; i < producers; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    long expect = (total / producers) * producers;
+    while(task::done.load() < expect) {
+        sched_yield();
+    }
+    double elapsed = now() - start;
+
+    // 工作线程是脱离线程且没有退出机制，这里不销毁线程池，避免它们访问已释放的内存
+    delete [] tids;
+    delete [] args;
+    return expect / elapsed;
+}
+
+int main(int argc, char* argv[])
+{
+    long total = argc > 1 ? atol(argv[1]) : 1000000;
+    int producer_numbers[] = {1, 2, 4};
+    int worker_numbers[] = {1, 4, 8};
+
+    printf("%-10s %10s %8s %16s\n", "queue", "producers", "workers", "tasks/s");
+    for(int p : producer_numbers) {
+        for(int w : worker_numbers) {
+            double list_rate = run(threadpool<task>::LIST_QUEUE, p, w, total);
+            double lockfree_rate = run(threadpool<task>::LOCKFREE_QUEUE, p, w, total);
+            double stealing_rate = run(threadpool<task>::WORK_STEALING, p, w, total);
+            printf("%-10s %10d %8d %16.0f\n", "list", p, w, list_rate);
+            printf("%-10s %10d %8d %16.0f\n", "lockfree", p, w, lockfree_rate);
+            printf("%-10s %10d %8d %16.0f\n", "stealing", p, w, stealing_rate);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+// 定时器性能对比：升序链表sort_timer_lst 与 分层时间轮timer_wheel
+// 编译：g++ -O2 bench/timer_bench.cpp -o timer_bench
+// 运行：./timer_bench
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../noactive/lst_timer.h"
+#include "../timer/timer_wheel.h"
+
+#define TIMEOUT_RANGE 15    // 定时器超时时间分布的范围，模拟3*TIMESLOT的空闲超时
+#define MAX_OPS 10000       // 链表的添加和调整都是O(n)的，定时器很多时只计时其中一部分操作，否则跑不完
+
+static long expired = 0;
+
+static void list_cb( client_data* ) { ++expired; }
+static void wheel_cb( client_data* ) { ++expired; }
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+    先放入n-ops个定时器，再依次测量随机添加ops个定时器、随机刷新ops个定时器、n个定时器全部到期处理的每次操作耗时(ns)
+    链表的预先填充按超时时间降序插入，每次都成为新的头节点，不计时
+*/
+static void bench_list( int n, int ops, int* order )
+{
+    util_timer** timers = new util_timer*[n];
+    // sort_timer_lst::tick()使用真实时间，所以让所有定时器的超时时间都落在过去
+    time_t base = time( NULL ) - TIMEOUT_RANGE - 1;
+    sort_timer_lst lst;
+
+    for( int i = 0; i < n - ops; ++i ) {
+        util_timer* timer = new util_timer;
+        timer->expire = base + TIMEOUT_RANGE - 1 - (time_t)i * TIMEOUT_RANGE / ( n - ops );
+        timer->cb_func = list_cb;
+        timer->user_data = NULL;
+        timers[i] = timer;
+        lst.add_timer( timer );
+    }
+
+    double start = now();
+    for( int i = n - ops; i < n; ++i ) {
+        util_timer* timer = new util_timer;
+        timer->expire = base + order[i] % TIMEOUT_RANGE;
+        timer->cb_func = list_cb;
+        timer->user_data = NULL;
+        timers[i] = timer;
+        lst.add_timer( timer );
+    }
+    double add = now() - start;
+
+    start = now();
+    for( int i = 0; i < ops; ++i ) {
+        // 连接有活动时超时时间被推迟到最后，定时器向链表尾部移动
+        util_timer* timer = timers[order[i] % n];
+        timer->expire = base + TIMEOUT_RANGE;
+        lst.adjust_timer( timer );
+    }
+    double adj = now() - start;
+
+    expired = 0;
+    start = now();
+    lst.tick();
+    double expire = now() - start;
+
+    printf( "%-6s %8d %12.1f %12.1f %12.1f %10ld\n", "list", n, add * 1e9 / ops, adj * 1e9 / ops, expire * 1e9 / n, expired );
+    delete [] timers;
+}
+
+static void bench_wheel( int n, int ops, int* order )
+{
+    wheel_timer<client_data>** timers = new wheel_timer<client_data>*[n];
+    timer_wheel<client_data> wheel( n, 0 );
+
+    for( int i = 0; i < n - ops; ++i ) {
+        timers[i] = wheel.add_timer( TIMEOUT_RANGE - 1 - (time_t)i * TIMEOUT_RANGE / ( n - ops ), wheel_cb, NULL );
+    }
+
+    double start = now();
+    for( int i = n - ops; i < n; ++i ) {
+        timers[i] = wheel.add_timer( order[i] % TIMEOUT_RANGE, wheel_cb, NULL );
+    }
+    double add = now() - start;
+
+    start = now();
+    for( int i = 0; i < ops; ++i ) {
+        wheel.adjust_timer( timers[order[i] % n], TIMEOUT_RANGE );
+    }
+    double adj = now() - start;
+
+    expired = 0;
+    start = now();
+    wheel.tick( TIMEOUT_RANGE );
+    double expire = now() - start;
+
+    printf( "%-6s %8d %12.1f %12.1f %12.1f %10ld\n", "wheel", n, add * 1e9 / ops, adj * 1e9 / ops, expire * 1e9 / n, expired );
+    delete [] timers;
+}
+
+int main()
+{
+    int sizes[] = { 1000, 10000, 100000 };
+    printf( "%-6s %8s %12s %12s %12s %10s\n", "timer", "n", "add(ns)", "adjust(ns)", "expire(ns)", "expired" );
+    for( int n : sizes ) {
+        int* order = new int[n];
+        srand( n );
+        for( int i = 0; i < n; ++i ) {
+            order[i] = rand();
+        }
+        int ops = n < MAX_OPS ? n / 2 : MAX_OPS;
+        bench_list( n, ops, order );
+        bench_wheel( n, ops, order );
+        delete [] order;
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <exception>
+#include <vector>
+#include <atomic>
+#include <sys/mman.h>
+
+#include "../locker/locker.h"
+
+#define BUFFER_POOL_MAX_CLASSES 8     // 最多的大小等级数
+#define BUFFER_SLAB_BUFFERS 16        // 每次向系统申请的一块内存中包含的缓冲数
+
+/*
+    连接I/O缓冲池。缓冲按大小分为若干等级，最小一级是min_size，每一级是上一级的两倍。
+    每个等级从mmap得到的大块内存（slab）中切出缓冲，用空闲栈管理，获取和归还都是O(1)的，由一把锁保护。
+    空闲缓冲超过keep个时，归还的缓冲用MADV_DONTNEED交还物理内存，虚拟地址仍然留在池中，
+    再次使用时由内核重新分配零页。这样进程的RSS跟随正在使用缓冲的连接数，而不是历史峰值或fd上限。
+*/
+class buffer_pool {
+public:
+    /*min_size是最小的缓冲大小，会向上取整为页大小的整数倍，classes是大小等级数，keep是每个等级保留物理内存的空闲缓冲数*/
+    buffer_pool(size_t min_size, int classes, int keep);
+    ~buffer_pool();
+
+    // 获取一个不小于size的缓冲，超过最大等级或内存不足时返回NULL，capacity返回缓冲的实际大小
+    char* acquire(size_t size, size_t* capacity);
+    // 归还缓冲，capacity必须是acquire返回的大小
+    void release(char* buf, size_t capacity);
+
+    size_t min_size() const { return m_min_size; }
+    size_t max_size() const { return m_min_size << (m_classes - 1); }
+    // 正在使用的缓冲的总字节数
+    size_t in_use() const;
+
+private:
+    struct size_class {
+        locker lock;
+        size_t size;                // 本等级的缓冲大小
+        std::vector<char*> free;    // 空闲缓冲，栈顶是最近归还的，物理内存最可能还在
+        std::vector<char*> slabs;   // 所有slab，析构时释放
+        std::atomic<size_t> used;   // 正在使用的缓冲数，只用于统计
+    };
+
+    int class_of(size_t size) const; // size对应的最小等级，超过最大等级时返回-1
+    bool grow(size_class* c); // 为一个等级再申请一个slab，调用时持有该等级的锁
+
+private:
+    size_t m_min_size;
+    int m_classes;
+    size_t m_keep;
+    size_class m_class[BUFFER_POOL_MAX_CLASSES];
+};
+
+buffer_pool::buffer_pool(size_t min_size, int classes, int keep) : m_classes(classes), m_keep(keep)
+{
+    if(classes <= 0 || classes > BUFFER_POOL_MAX_CLASSES || keep < 0) {
+        throw std::exception();
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    m_min_size = (min_size + page - 1) / page * page;
+    if(m_min_size == 0) {
+        m_min_size = page;
+    }
+    for(int i = 0; i < m_classes; ++i) {
+        m_class[i].size = m_min_size << i;
+        m_class[i].used = 0;
+    }
+}
+
+buffer_pool::~buffer_pool()
+{
+    for(int i = 0; i < m_classes; ++i) {
+        for(size_t j = 0; j < m_class[i].slabs.size(); ++j) {
+            munmap(m_class[i].slabs[j], m_class[i].size * BUFFER_SLAB_BUFFERS);
+        }
+    }
+}
+
+int buffer_pool::class_of(size_t size) const
+{
+    for(int i = 0; i < m_classes; ++i) {
+        if(size <= m_class[i].size) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool buffer_pool::grow(size_class* c)
+{
+    // mmap得到的内存在第一次写入前不占用物理内存
+    char* slab = (char*)mmap(NULL, c->size * BUFFER_SLAB_BUFFERS, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(slab == MAP_FAILED) {
+        return false;
+    }
+    c->slabs.push_back(slab);
+    // 倒序入栈，先用低地址的缓冲
+    for(int i = BUFFER_SLAB_BUFFERS - 1; i >= 0; --i) {
+        c->free.push_back(slab + c->size * i);
+    }
+    return true;
+}
+
+char* buffer_pool::acquire(size_t size, size_t* capacity)
+{
+    int i = class_of(size);
+    if(i < 0) {
+        return NULL;
+    }
+    size_class* c = &m_class[i];
+    c->lock.lock();
+    if(c->free.empty() && !grow(c)) {
+        c->lock.unlock();
+        return NULL;
+    }
+    char* buf = c->free.back();
+    c->free.pop_back();
+    ++c->used;
+    c->lock.unlock();
+    *capacity = c->size;
+    return buf;
+}
+
+void buffer_pool::release(char* buf, size_t capacity)
+{
+    if(!buf) {
+        return;
+    }
+    int i = class_of(capacity);
+    if(i < 0) {
+        return;
+    }
+    size_class* c = &m_class[i];
+    c->lock.lock();
+    // 保留的空闲缓冲够多了，交还这个缓冲的物理内存
+    if(c->free.size() >= m_keep) {
+        madvise(buf, c->size, MADV_DONTNEED);
+    }
+    c->free.push_back(buf);
+    --c->used;
+    c->lock.unlock();
+}
+
+size_t buffer_pool::in_use() const
+{
+    size_t bytes = 0;
+    for(int i = 0; i < m_classes; ++i) {
+        bytes += m_class[i].used * m_class[i].size;
+    }
+    return bytes;
+}
+
+#endif
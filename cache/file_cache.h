@@ -0,0 +1,422 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <atomic>
+#include <exception>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "../locker/locker.h"
+
+#define FILE_CACHE_SHARDS 16 // 分片数量，每个分片一把读写锁
+#define FILE_CACHE_VARIANTS 2 // 每个缓存项最多的编码变体数，下标的含义由prepare回调决定
+
+// 需要监听的目录事件，目录中的文件被创建、删除、修改、改名或改权限时，对应的缓存项失效
+#define FILE_CACHE_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                               IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/*
+    文件状态，即do_request对一个URL的判定结果
+    FILE_OK         :   文件存在且可读，缓存项中有打开的文件描述符
+    FILE_NOT_FOUND  :   文件不存在，这种结果不缓存
+    FILE_FORBIDDEN  :   没有读权限
+    FILE_IS_DIR     :   请求的是目录
+    FILE_ERROR      :   打开文件失败，这种结果不缓存
+    FILE_MISS       :   只查缓存时没有命中，需要访问磁盘才能判定
+*/
+enum FILE_STATUS { FILE_OK = 0, FILE_NOT_FOUND, FILE_FORBIDDEN, FILE_IS_DIR, FILE_ERROR, FILE_MISS };
+
+// 文件的一个编码变体（例如压缩后的内容），由prepare回调生成，之后只读
+struct file_variant {
+    std::string header;             // 变体的响应头
+    std::string etag;               // 变体的实体标签，和原始内容的不同
+    std::string header_304;         // 变体的304响应头
+    std::string body;               // 在内存中的内容
+    int fd;                         // 内容较大时放在这个文件中，用sendfile发送，-1表示内容在body中
+    off_t size;                     // 内容的长度，0表示没有这个变体
+
+    file_variant() : fd(-1), size(0) {}
+    ~file_variant() { if(fd != -1) close(fd); }
+};
+
+// 缓存项
+struct file_entry {
+    std::string url;                // 请求的URL，也是缓存的键
+    FILE_STATUS status;
+    int fd;                         // FILE_OK时打开的文件，用sendfile发送时传入偏移量，多个连接可以同时使用
+    struct stat st;
+    std::string header;             // 加载时由prepare回调生成的响应头等派生数据，之后只读
+    std::string etag;               // 由文件的inode、大小和修改时间生成的实体标签
+    std::string header_304;         // 条件请求命中时的304响应头
+    std::string body;               // prepare回调读入内存的小文件内容，为空时用fd发送，之后只读
+    file_variant variants[FILE_CACHE_VARIANTS];
+    size_t extra_bytes;             // 变体占用的空间，和文件大小一起计入缓存的内存上限
+    std::atomic<int> refs;          // 缓存持有一个引用，每个正在使用它的连接各持有一个，减到0时关闭文件并释放
+    std::atomic<bool> referenced;   // CLOCK淘汰算法的访问位
+    int slot;                       // 在所属分片CLOCK环中的下标，-1表示不在缓存中
+};
+
+/*
+    打开文件与元数据缓存，以URL为键，保存打开的文件描述符、stat结果和访问权限判定。
+    按URL的哈希分成多个分片，命中时只加读锁。超过内存上限（按缓存文件的总大小计算）或数量上限时按CLOCK算法淘汰。
+    后台线程通过inotify监听缓存项所在的目录，文件变化时让对应的缓存项失效。
+    被淘汰或失效的缓存项在最后一个使用它的连接释放之后才真正关闭。
+*/
+class file_cache {
+public:
+    /*root是网站根目录，max_bytes是缓存文件总大小的上限，max_entries是缓存项数量的上限，
+      prepare在文件成功打开后调用，用于生成与文件对应的派生数据，可以为NULL*/
+    file_cache(const char* root, size_t max_bytes, int max_entries, void (*prepare)(file_entry*));
+    ~file_cache();
+
+    // 查找url对应的文件，返回FILE_OK时entry为持有一个引用的缓存项，用完后必须调用release。
+    // cached_only为true时不访问磁盘，没有命中返回FILE_MISS，供不能阻塞的Reactor线程使用
+    FILE_STATUS acquire(const char* url, file_entry** entry, bool cached_only = false);
+    void release(file_entry* entry);
+
+    // 缓存中所有缓存项的URL，平滑升级时交给新进程
+    void snapshot(std::vector<std::string>* urls);
+    // 按URL依次加载，新进程用旧进程的快照预热缓存
+    void preload(const std::vector<std::string>& urls);
+
+private:
+    struct shard {
+        rwlocker lock;
+        std::unordered_map<std::string, file_entry*> map;
+        std::vector<file_entry*> clock;     // CLOCK环
+        size_t hand;                        // CLOCK指针
+        size_t bytes;                       // 本分片缓存文件的总大小
+        unsigned long generation;           // 每次失效加一，用于发现加载期间发生的变化
+    };
+
+    shard& shard_of(const std::string& url);
+    file_entry* load(const std::string& url); // 未命中时读取文件状态并打开文件
+    bool cacheable(const std::string& url); // 只缓存规范的URL，保证inotify事件能对应回缓存项
+    bool watch(const std::string& url); // 监听url所在的目录
+    void insert(shard& sh, file_entry* entry); // 调用者持有写锁
+    void remove(shard& sh, file_entry* entry); // 调用者持有写锁
+    void invalidate(const std::string& url);
+    void clear(); // 清空所有缓存项，inotify事件丢失或目录本身被移走时使用
+    static void unref(file_entry* entry);
+
+    /*监听inotify事件的后台线程*/
+    static void* worker(void* arg);
+    void run();
+
+private:
+    std::string m_root;
+    void (*m_prepare)(file_entry*);
+    size_t m_max_bytes;     // 每个分片的上限
+    size_t m_max_entries;   // 每个分片的上限
+    shard m_shards[FILE_CACHE_SHARDS];
+
+    int m_inotifyfd;
+    locker m_watch_lock;    // 保护下面两个表
+    std::unordered_map<int, std::string> m_watch_dirs;  // inotify监听描述符 -> 目录的URL
+    std::unordered_map<std::string, int> m_watched;     // 目录的URL -> inotify监听描述符
+    pthread_t m_thread;
+};
+
+file_cache::file_cache(const char* root, size_t max_bytes, int max_entries, void (*prepare)(file_entry*)) :
+        m_root(root), m_prepare(prepare), m_max_bytes(max_bytes / FILE_CACHE_SHARDS),
+        m_max_entries((max_entries + FILE_CACHE_SHARDS - 1) / FILE_CACHE_SHARDS), m_inotifyfd(-1)
+{
+    if(max_entries <= 0) {
+        throw std::exception();
+    }
+    for(int i = 0; i < FILE_CACHE_SHARDS; ++i) {
+        m_shards[i].hand = 0;
+        m_shards[i].bytes = 0;
+        m_shards[i].generation = 0;
+    }
+
+    m_inotifyfd = inotify_init1(IN_CLOEXEC);
+    if(m_inotifyfd < 0) {
+        throw std::exception();
+    }
+    if(pthread_create(&m_thread, NULL, worker, this) != 0) {
+        close(m_inotifyfd);
+        throw std::exception();
+    }
+    if(pthread_detach(m_thread)) {
+        close(m_inotifyfd);
+        throw std::exception();
+    }
+}
+
+file_cache::~file_cache()
+{
+    clear();
+    close(m_inotifyfd);
+}
+
+FILE_STATUS file_cache::acquire(const char* url, file_entry** entry, bool cached_only)
+{
+    std::string key(url);
+    shard& sh = shard_of(key);
+
+    // 命中时只加读锁，引用计数和访问位都是原子变量
+    sh.lock.rdlock();
+    std::unordered_map<std::string, file_entry*>::iterator it = sh.map.find(key);
+    if(it != sh.map.end()) {
+        file_entry* e = it->second;
+        e->refs.fetch_add(1);
+        e->referenced.store(true, std::memory_order_relaxed);
+        sh.lock.unlock();
+        if(e->status == FILE_OK) {
+            *entry = e;
+            return FILE_OK;
+        }
+        FILE_STATUS status = e->status;
+        unref(e);
+        return status;
+    }
+    unsigned long generation = sh.generation;
+    sh.lock.unlock();
+    if(cached_only) {
+        return FILE_MISS;
+    }
+
+    // 未命中，先监听目录再读取文件状态，这样读取之后发生的变化一定会产生inotify事件
+    bool cache = cacheable(key) && watch(key);
+    file_entry* e = load(key);
+    FILE_STATUS status = e->status;
+
+    if(cache && status != FILE_NOT_FOUND && status != FILE_ERROR &&
+       (status != FILE_OK || (size_t)e->st.st_size + e->extra_bytes <= m_max_bytes)) {
+        sh.lock.wrlock();
+        // 加载期间有缓存项失效过，读到的状态可能已经过时，这次不放入缓存；其他线程已经放入的也不重复放入
+        if(sh.generation == generation && sh.map.find(key) == sh.map.end()) {
+            insert(sh, e);
+        }
+        sh.lock.unlock();
+    }
+
+    if(status == FILE_OK) {
+        *entry = e;
+        return FILE_OK;
+    }
+    unref(e);
+    return status;
+}
+
+void file_cache::release(file_entry* entry)
+{
+    unref(entry);
+}
+
+void file_cache::snapshot(std::vector<std::string>* urls)
+{
+    for(int i = 0; i < FILE_CACHE_SHARDS; ++i) {
+        shard& sh = m_shards[i];
+        sh.lock.rdlock();
+        for(size_t j = 0; j < sh.clock.size(); ++j) {
+            urls->push_back(sh.clock[j]->url);
+        }
+        sh.lock.unlock();
+    }
+}
+
+void file_cache::preload(const std::vector<std::string>& urls)
+{
+    for(size_t i = 0; i < urls.size(); ++i) {
+        file_entry* e;
+        if(acquire(urls[i].c_str(), &e) == FILE_OK) {
+            release(e);
+        }
+    }
+}
+
+file_cache::shard& file_cache::shard_of(const std::string& url)
+{
+    return m_shards[std::hash<std::string>()(url) % FILE_CACHE_SHARDS];
+}
+
+file_entry* file_cache::load(const std::string& url)
+{
+    file_entry* e = new file_entry;
+    e->url = url;
+    e->fd = -1;
+    e->refs.store(1);
+    e->referenced.store(true);
+    e->slot = -1;
+    e->extra_bytes = 0;
+
+    std::string path = m_root + url;
+    if(stat(path.c_str(), &e->st) < 0) {
+        e->status = FILE_NOT_FOUND;
+    }else if(!(e->st.st_mode & S_IROTH)) {
+        e->status = FILE_FORBIDDEN;
+    }else if(S_ISDIR(e->st.st_mode)) {
+        e->status = FILE_IS_DIR;
+    }else{
+        e->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        e->status = (e->fd < 0) ? FILE_ERROR : FILE_OK;
+        if(e->status == FILE_OK && m_prepare) {
+            m_prepare(e);
+        }
+    }
+    return e;
+}
+
+bool file_cache::cacheable(const std::string& url)
+{
+    return url.size() > 1 && url[0] == '/' && url.find("//") == std::string::npos &&
+           url.find("/.") == std::string::npos && url.find('?') == std::string::npos;
+}
+
+bool file_cache::watch(const std::string& url)
+{
+    std::string dir = url.substr(0, url.rfind('/'));
+    m_watch_lock.lock();
+    if(m_watched.find(dir) != m_watched.end()) {
+        m_watch_lock.unlock();
+        return true;
+    }
+    int wd = inotify_add_watch(m_inotifyfd, (m_root + dir).c_str(), FILE_CACHE_WATCH_MASK);
+    if(wd >= 0) {
+        m_watch_dirs[wd] = dir;
+        m_watched[dir] = wd;
+    }
+    m_watch_lock.unlock();
+    return wd >= 0;
+}
+
+void file_cache::insert(shard& sh, file_entry* entry)
+{
+    entry->refs.fetch_add(1); // 缓存持有的引用
+    entry->slot = sh.clock.size();
+    sh.clock.push_back(entry);
+    sh.map[entry->url] = entry;
+    if(entry->status == FILE_OK) {
+        sh.bytes += entry->st.st_size + entry->extra_bytes;
+    }
+
+    // 超过上限时转动CLOCK指针，跳过并清除最近访问过的缓存项，淘汰第一个没有被访问过的
+    while((sh.bytes > m_max_bytes || sh.map.size() > m_max_entries) && !sh.clock.empty()) {
+        if(sh.hand >= sh.clock.size()) {
+            sh.hand = 0;
+        }
+        file_entry* e = sh.clock[sh.hand];
+        if(e->referenced.load(std::memory_order_relaxed)) {
+            e->referenced.store(false, std::memory_order_relaxed);
+            ++sh.hand;
+        }else{
+            remove(sh, e);
+        }
+    }
+}
+
+void file_cache::remove(shard& sh, file_entry* entry)
+{
+    sh.map.erase(entry->url);
+    // 用最后一个缓存项填补它在CLOCK环中的位置
+    file_entry* last = sh.clock.back();
+    sh.clock[entry->slot] = last;
+    last->slot = entry->slot;
+    sh.clock.pop_back();
+    entry->slot = -1;
+    if(entry->status == FILE_OK) {
+        sh.bytes -= entry->st.st_size + entry->extra_bytes;
+    }
+    unref(entry);
+}
+
+void file_cache::invalidate(const std::string& url)
+{
+    shard& sh = shard_of(url);
+    sh.lock.wrlock();
+    ++sh.generation;
+    std::unordered_map<std::string, file_entry*>::iterator it = sh.map.find(url);
+    if(it != sh.map.end()) {
+        remove(sh, it->second);
+    }
+    sh.lock.unlock();
+}
+
+void file_cache::clear()
+{
+    for(int i = 0; i < FILE_CACHE_SHARDS; ++i) {
+        shard& sh = m_shards[i];
+        sh.lock.wrlock();
+        ++sh.generation;
+        while(!sh.clock.empty()) {
+            remove(sh, sh.clock.back());
+        }
+        sh.hand = 0;
+        sh.lock.unlock();
+    }
+}
+
+void file_cache::unref(file_entry* entry)
+{
+    if(entry->refs.fetch_sub(1) == 1) {
+        if(entry->fd != -1) {
+            close(entry->fd);
+        }
+        delete entry;
+    }
+}
+
+void* file_cache::worker(void* arg)
+{
+    file_cache* cache = (file_cache*)arg;
+    cache->run();
+    return cache;
+}
+
+void file_cache::run()
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while(true) {
+        ssize_t len = ::read(m_inotifyfd, buf, sizeof(buf));
+        if(len <= 0) {
+            if(len < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for(char* p = buf; p < buf + len; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            // 事件队列溢出，不知道丢了哪些事件，只能全部失效
+            if(ev->mask & IN_Q_OVERFLOW) {
+                clear();
+                continue;
+            }
+
+            m_watch_lock.lock();
+            std::unordered_map<int, std::string>::iterator it = m_watch_dirs.find(ev->wd);
+            if(it == m_watch_dirs.end()) {
+                m_watch_lock.unlock();
+                continue;
+            }
+            std::string dir = it->second;
+            // 目录被删除或移走，监听自动解除
+            if(ev->mask & IN_IGNORED) {
+                m_watched.erase(dir);
+                m_watch_dirs.erase(it);
+            }
+            m_watch_lock.unlock();
+
+            if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                clear();
+            }else if(ev->len > 0) {
+                invalidate(dir + "/" + ev->name);
+            }
+        }
+    }
+}
+
+#endif
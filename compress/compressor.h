@@ -0,0 +1,111 @@
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#include <stddef.h>
+#include <string>
+
+/*
+    静态文件的预压缩。压缩库是可选的，编译时分别用宏打开：
+        gzip：  -DUSE_GZIP -lz
+        brotli：-DUSE_BROTLI -lbrotlienc
+    没有打开的编码compress返回false，服务器只发送原始内容。
+    每个文件只在加载进文件缓存时压缩一次，所以都用最高的压缩级别，大文件的brotli降一级以限制加载时间。
+*/
+
+#ifdef USE_GZIP
+#include <zlib.h>
+#endif
+#ifdef USE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#define COMPRESS_BROTLI_MAX_QUALITY_SIZE (1 << 20) // 超过这个大小的文件brotli不用最高级别
+
+// 支持的内容编码，同时是文件缓存中变体的下标
+enum CONTENT_ENCODING { ENCODING_GZIP = 0, ENCODING_BR, ENCODING_COUNT };
+
+// Content-Encoding中的名字
+static const char* const encoding_names[ENCODING_COUNT] = { "gzip", "br" };
+
+class compressor {
+public:
+    // 编译时是否打开了这种编码
+    static bool available(CONTENT_ENCODING encoding);
+    // 压缩data，成功时结果放在out中
+    static bool compress(CONTENT_ENCODING encoding, const char* data, size_t len, std::string* out);
+
+private:
+    static bool gzip(const char* data, size_t len, std::string* out);
+    static bool brotli(const char* data, size_t len, std::string* out);
+};
+
+bool compressor::available(CONTENT_ENCODING encoding)
+{
+    switch(encoding) {
+#ifdef USE_GZIP
+        case ENCODING_GZIP: return true;
+#endif
+#ifdef USE_BROTLI
+        case ENCODING_BR: return true;
+#endif
+        default: return false;
+    }
+}
+
+bool compressor::compress(CONTENT_ENCODING encoding, const char* data, size_t len, std::string* out)
+{
+    switch(encoding) {
+        case ENCODING_GZIP: return gzip(data, len, out);
+        case ENCODING_BR: return brotli(data, len, out);
+        default: return false;
+    }
+}
+
+bool compressor::gzip(const char* data, size_t len, std::string* out)
+{
+#ifdef USE_GZIP
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    // windowBits加16生成gzip格式，而不是zlib格式
+    if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    out->resize(deflateBound(&zs, len));
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef*)&(*out)[0];
+    zs.avail_out = out->size();
+    int ret = deflate(&zs, Z_FINISH);
+    out->resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+#else
+    (void)data; (void)len; (void)out;
+    return false;
+#endif
+}
+
+bool compressor::brotli(const char* data, size_t len, std::string* out)
+{
+#ifdef USE_BROTLI
+    size_t size = BrotliEncoderMaxCompressedSize(len);
+    if(size == 0) {
+        return false;
+    }
+    out->resize(size);
+    int quality = len <= COMPRESS_BROTLI_MAX_QUALITY_SIZE ? BROTLI_MAX_QUALITY : BROTLI_MAX_QUALITY - 2;
+    if(!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len, (const uint8_t*)data,
+                              &size, (uint8_t*)&(*out)[0])) {
+        return false;
+    }
+    out->resize(size);
+    return true;
+#else
+    (void)data; (void)len; (void)out;
+    return false;
+#endif
+}
+
+#endif
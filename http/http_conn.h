@@ -11,19 +11,42 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <sys/mman.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <sys/uio.h>
 #include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <string>
+#include <atomic>
 
 #include "../locker/locker.h"
+#include "../timer/timer_wheel.h"
+#include "../cache/file_cache.h"
+#include "../buffer/buffer_pool.h"
+#include "http_scan.h"
+#include "mime_types.h"
+#include "../compress/compressor.h"
+#include "../metrics/metrics.h"
+#include "../log/log.h"
+#include "../log/access_log.h"
+#include "../threadpool/admission.h"
+#include "../upgrade/upgrade.h"
+
+#ifndef CACHELINE_SIZE
+#define CACHELINE_SIZE 64
+#endif
 
 // 网站的根目录
 const char* doc_root = "/home/wljszj/webserver/resources";
 
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
+const char* not_modified_304_title = "Not Modified";
+const char* partial_206_title = "Partial Content";
+const char* error_416_title = "Range Not Satisfiable";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char* error_403_title = "Forbidden";
@@ -32,15 +55,57 @@ const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_503_title = "Service Unavailable";
+const char* error_503_form = "The server is temporarily busy, please try again later.\n";
+
+// 响应头中唯一与连接相关的部分，作为单独的一块放进iovec，不需要格式化
+const char connection_keep_alive[] = "Connection: keep-alive\r\n\r\n";
+const char connection_close[] = "Connection: close\r\n\r\n";
+
+// 内部统计页面，只对本机的客户端开放，加上?format=json时返回JSON
+const char stats_url[] = "/__stats";
+
+// 一个待发送的响应。iv中依次是响应头、Connection头部和内存中的小文件内容，
+// 指向预先生成的响应、缓存项或写缓冲；其余的文件内容在这些块发完后用sendfile发送
+struct http_response {
+    struct iovec iv[3];
+    int iv_count;
+    int iv_idx;             // 第一个还没有发完的块
+    int file_fd;            // 用sendfile发送的文件，-1表示没有
+    file_entry* file;       // 文件来自缓存时持有的缓存项，iv可能引用它的内容，响应发完后才归还
+    off_t file_offset;      // 文件中下一个要发送的字节的位置
+    off_t file_left;        // 文件中还没有发送的字节数
+    bool borrowed;          // 多段范围响应中除最后一项以外的各段：file_fd属于最后一项，这一项发完时不关闭
+    std::string* owned;     // 现场生成的响应（统计页面），iv引用它的内容，发完后释放
+    bool linger;            // 响应发完后是否保持连接
+    int log_off;            // 请求的最后一项：访问日志记录在m_access中的位置，其余各项为-1
+};
+
+// Range请求中的一个字节范围，两端都包含
+struct byte_range {
+    off_t first;
+    off_t last;
+};
 
-class http_conn
+/*
+    一个HTTP连接。对象按缓存行对齐，成员按访问频率排列：每个事件都要访问的fd、缓冲和响应队列计数在第一个缓存行，
+    解析状态紧随其后，响应队列再后，只在接受连接和打开未缓存文件时使用的地址和stat放在最后。
+*/
+class alignas(CACHELINE_SIZE) http_conn
 {
 public:
-    static int m_epollfd; // 所有的socket上的事件都被注册到同一个epoll事件中
-    static int m_user_cnt; // 统计用户数量
-    static const int READ_BUFFER_SIZE = 2048; // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024; // 写缓冲区的大小
+    static std::atomic<int> m_user_cnt; // 统计用户数量，多个Reactor线程并发修改
+    static file_cache* m_file_cache; // 所有连接共享的打开文件缓存，为NULL时每个请求都自己stat和open
+    static buffer_pool* m_buffer_pool; // 所有连接共享的读写缓冲池，最大一级的大小就是请求头的长度上限
+    static bool m_edge_triggered; // 连接socket是否以边沿触发方式注册到epoll，启动时设置
+    static admission* m_admission; // 线程池的准入控制，为NULL时只在队列满时拒绝
+    static const int WRITE_BUFFER_SIZE = 1024; // 一个现场生成的响应头的最大长度，写缓冲剩余空间少于它时不再处理下一个请求
     static const int FILENAME_LEN = 200; // 文件名的最大长度
+    static const int MAX_PIPELINE = 16; // 一次最多处理的流水线请求数，它们的响应合并发送
+    static const int INLINE_FILE_SIZE = 8192; // 不超过这个大小的缓存文件把内容读进内存，和响应头一起发送
+    static const int COMPRESS_MIN_SIZE = 256; // 小于这个大小的文件压缩后省不了几个报文，不压缩
+    static const int COMPRESS_MAX_SIZE = 8 << 20; // 超过这个大小的文件不压缩，避免加载时长时间占用工作线程
+    static const int MAX_RANGES = 8; // 一个Range请求最多的范围数，更多时忽略Range，发送整个文件
     
 
     // HTTP请求方法，这里只支持GET
@@ -62,10 +127,13 @@ public:
         NO_RESOURCE         :   表示服务器没有资源
         FORBIDDEN_REQUEST   :   表示客户对资源没有足够的访问权限
         FILE_REQUEST        :   文件请求,获取文件成功
+        NOT_MODIFIED        :   条件请求，客户端缓存的文件没有变化
+        STATS_REQUEST       :   请求内部统计页面
         INTERNAL_ERROR      :   表示服务器内部错误
+        SERVICE_UNAVAILABLE :   表示服务器过载，暂时不能处理请求
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, NOT_MODIFIED, STATS_REQUEST, INTERNAL_ERROR, SERVICE_UNAVAILABLE, CLOSED_CONNECTION };
     
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
@@ -76,60 +144,142 @@ public:
     ~http_conn(){}
 
     void process(); // 处理客户端请求
-    void init(int sockfd, const sockaddr_in& addr); // 初始化新接受的连接
+    // 交给线程池之前调用，记录请求开始排队的时间和计入的监听socket，load为NULL表示没有经过准入控制
+    void queued(listener_load* load) { m_queued_at = metrics::now(); m_load = load; }
+    // 过载时丢掉读缓冲中的请求，回复503，发完后关闭连接。由拥有连接的线程调用，之后用write()发送
+    void shed();
+    // 初始化新接受的连接，epollfd为-1时连接由io_uring后端管理，不注册到epoll
+    void init(int sockfd, const sockaddr_in& addr, int epollfd, timer_wheel<http_conn>* timers);
     void close_conn(); // 关闭连接
     bool read(); //非阻塞读
     bool write(); //非阻塞写
-    void unmap();
-    
+    void close_file(); // 关闭所有没有发完的响应的文件
+    int fd() const { return m_sockfd; }
+
+    // 以下函数由read()/write()/process()使用，io_uring后端自己收发数据，也直接调用它们
+    int feed(const char* data, int len); // 把收到的数据追加到读缓冲，返回复制的字节数，缓冲暂时满了返回0，请求过大返回-1
+    // 解析所有完整的请求并生成响应，失败时返回false。nonblocking为true时由Reactor线程调用，
+    // 只处理不需要访问磁盘的请求，遇到需要的请求时停下，deferred()为true，之后由process()从这个请求继续
+    bool process_requests(bool nonblocking = false);
+    bool deferred() const { return m_deferred; } // 读缓冲中第一个请求已经解析完，等待工作线程执行do_request
+    bool has_output() const { return m_resp_head < m_resp_count; } // 还有没发完的响应
+    int gather(struct iovec* iv, bool* more); // 收集队首开始的连续内存块，最多MAX_PIPELINE * 3个
+    void advance(ssize_t n); // 跳过已经发出的字节
+    ssize_t send_file(); // 队首响应的内存块已经发完，用sendfile发送它的文件内容
+    bool finish_output(); // 响应全部发完后清空队列，返回是否保持连接
+    bool output_linger() const { return m_resp_count == 0 || m_responses[m_resp_count - 1].linger; } // 最后一个响应之后是否保持连接
+
+    // 以下定时器相关的函数只能由连接所属的Reactor线程调用
+    void set_deadline(time_t expire); // 设置连接的超时时间，单位是时间轮的滴答
+    void clear_deadline(); // 取消超时定时器，连接正在关闭时使用
+    bool waiting_request() const { return m_read_idx == 0; } // 还没有收到下一个请求的任何数据
+    // 连接在Reactor手中等待下一个请求。只由Reactor线程读写，连接交给工作线程期间一定为false，
+    // 所以Reactor可以在不访问其他状态的情况下判断能否关闭它
+    bool idle() const { return m_idle; }
+    void set_idle(bool idle) { m_idle = idle; }
+    // 响应都已发完，读缓冲中还留有流水线上后续请求的数据，需要再交给线程池处理
+    bool has_buffered_request() const { return m_resp_count == 0 && m_read_idx > 0; }
+    static void timeout(http_conn* conn); // 定时器到期的回调函数
+
+    // 启动时预先生成所有错误响应，必须在处理请求之前调用一次
+    static void init_responses();
+    // 拒绝一个刚接受的连接：发送预先生成的503响应后关闭，不为它分配连接对象
+    static void reject(int sockfd);
+    // 文件缓存加载文件后调用，预先生成该文件的200响应头，小文件同时读入内容，之后每次命中直接引用
+    static void prepare_file(file_entry* entry);
+    // 生成文件的200响应头，不含Connection和空行，返回长度，空间不够时返回-1。
+    // length是内容的长度，encoding为NULL时是原始内容，vary表示这个文件有压缩变体，响应随Accept-Encoding变化
+    static int format_file_header(char* buf, int size, const struct stat& st, off_t length, const char* type,
+                                  const char* encoding, bool vary);
+    // 生成文件的304响应头，不含Connection和空行，参数和format_file_header相同
+    static int format_not_modified(char* buf, int size, const struct stat& st, const char* encoding, bool vary);
+    // 由文件的inode、大小和修改时间生成带引号的实体标签，压缩变体加上编码的名字
+    static int format_etag(char* buf, int size, const struct stat& st, const char* encoding);
+
+    friend struct micro_bench; // bench/micro_bench.cpp单独测量解析和响应生成的内部函数
 
 
 private:
+    // 热数据：Reactor处理每个事件都会访问
     int m_sockfd; // 该HTTP连接的socket
-    sockaddr_in m_address; // 通信的socket地址
-
-    char m_read_buf[READ_BUFFER_SIZE]; // 读缓冲区
+    int m_epollfd; // 接受该连接的Reactor的epoll，连接的所有事件都注册在这里
+    // 读写缓冲在有数据时从缓冲池获取，连接空闲时归还，空闲连接只占用这个对象本身
+    char* m_read_buf; // 读缓冲区，NULL表示还没有获取
+    int m_read_size; // 读缓冲区的大小，一个请求放不下时换成大一级的缓冲，直到缓冲池的上限
     int m_read_idx; // 标识读缓冲区中已经读入的客户端数据的最后一个字符的下一个字节位置
-
-    char m_write_buf[WRITE_BUFFER_SIZE]; // 写缓冲区
-    int m_write_idx; // 写缓冲区中待发送的字节数
-
-    struct iovec m_iv[2]; // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
-    int m_iv_count;
-
+    int m_resp_head; // 第一个还没有发完的响应
+    int m_resp_count; // 待发送的响应数
+    wheel_timer<http_conn>* m_timer; // 连接的超时定时器，等待请求头时是请求头期限，响应发出后是空闲期限
+    bool m_idle; // 在Reactor手中等待下一个请求，只由Reactor线程访问
+    timer_wheel<http_conn>* m_timers; // 所属Reactor的时间轮
+    char* m_write_buf; // 写缓冲区，存放不在缓存中的文件的响应头，第一次需要时获取
+    int m_write_size;
+    int m_write_idx; // 写缓冲区中已经使用的字节数
+
+    // 解析状态：线程池处理请求时访问
+    CHECK_STATE m_check_state; // 主状态机当前所处状态
+    int m_request_start; // 当前请求在读缓冲区中的起始位置，之前是已经处理完的请求
     int m_checked_idx; // 当前正在分析的字符所在读缓冲区的位置
     int m_start_line; // 当前正在解析的行的起始位置
+    int m_line_len; // parse_line找到的完整行的长度，不含行尾的\r\n
+    int m_content_length; // HTTP请求的消息总长度
+    bool m_linger; // 判断HTTP请求是否要保持连接
+    bool m_deferred; // 当前请求已经在Reactor线程中解析完，do_request留给工作线程
+    unsigned char m_accept_encoding; // 客户端接受的内容编码，第i位对应CONTENT_ENCODING中的i
+    time_t m_if_modified_since; // If-Modified-Since的时间，-1表示没有
+    METHOD m_method; // 请求方法 GET POST等
+    uint64_t m_queued_at; // 交给线程池的时间
+    listener_load* m_load; // 排队时计入的监听socket
+    uint64_t m_output_start; // 这一批响应进入发送队列的时间
 
     // 请求得到的内容
     char* m_url; // 请求目标文件的文件名
     char* m_version; // 协议版本，只支持HTTP1.1
-    METHOD m_method; // 请求方法 GET POST等
     char* m_host; // 主机名
-    bool m_linger; // 判断HTTP请求是否要保持连接
-    int m_content_length; // HTTP请求的消息总长度
-
-    CHECK_STATE m_check_state; // 主状态机当前所处状态
+    char* m_if_none_match; // If-None-Match的值，NULL表示没有
+    char* m_range; // Range的值，NULL表示没有
+    char* m_if_range; // If-Range的值，NULL表示没有
+    int m_file_fd; // 当前请求的目标文件，-1表示没有，生成响应时交给响应
+    file_entry* m_file; // m_file_fd来自文件缓存时持有的缓存项
 
-    char m_real_file[FILENAME_LEN]; // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
+    // 按请求顺序排列的待发送响应，m_resp_head之前的已经发完。全部发完后才会处理新的请求
+    http_response m_responses[MAX_PIPELINE];
 
+    // 冷数据
+    sockaddr_in m_address; // 通信的socket地址
+    std::string m_access; // 还没有发完的响应的访问日志记录，全部发完后清空，容量保留给下一批
     struct stat m_file_stat; // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    char* m_file_address; // 客户请求的目标文件被mmap到内存中的起始位置
-
-    int bytes_to_send; // 将要发送的数据的字节数
-    int bytes_have_send; // 已经发送的字节数
 
     
     void init(); // 初始化其他信息
+    void init_request(); // 重置解析状态，准备解析下一个请求
+    void finish_request(); // 跳过已经处理完的请求的字节
+    void compact_read_buf(); // 把没有处理完的数据移到读缓冲区开头
+    void move_pointers(ptrdiff_t delta); // 读缓冲中的数据移动了delta字节，指向它的指针跟着移动
+    bool grow_read_buf(); // 获取读缓冲，已经有了就换成大一级的缓冲
+    bool reserve_write_buf(); // 写缓冲至少还有WRITE_BUFFER_SIZE字节的空间
+    void release_buffers(); // 连接空闲时归还读写缓冲
+    void release_file(int& fd, file_entry*& file); // 关闭文件或归还缓存项
+    static unsigned char parse_accept_encoding(const char* value, const char* end); // 解析Accept-Encoding的值
+    static void prepare_variants(file_entry* entry, const mime_type* type); // 生成文件的压缩变体
+    bool not_modified(const char* etag, int etag_len, time_t mtime) const; // 条件请求的条件成立，客户端的缓存仍然有效
+    bool if_range_matches(const char* etag, int etag_len, time_t mtime) const; // If-Range的验证器和文件当前的一致
+    // 解析Range的值，可以满足的范围按请求的顺序放进ranges，返回范围数，语法错误或范围太多时返回-1表示忽略Range
+    static int parse_range(const char* value, off_t size, byte_range* ranges);
+    int add_ranges(); // 按Range生成206或416响应，返回1表示已经加入队列，0表示忽略Range，-1表示失败
+    void release_response(http_response* r); // 响应发完后关闭文件或归还缓存项
+    static int format_validators(char* buf, int size, const struct stat& st, const char* encoding); // ETag和Last-Modified
     HTTP_CODE process_read(); // 解析HTTP请求
-    HTTP_CODE parse_request_line(char* text); // 解析请求首行
-    HTTP_CODE parse_headers(char* text); // 解析请求头
-    HTTP_CODE parse_content(char* text); // 解析请求体
+    HTTP_CODE parse_request_line(char* text, int len); // 解析请求首行
+    HTTP_CODE parse_headers(char* text, int len); // 解析请求头
+    HTTP_CODE parse_content(); // 解析请求体
     LINE_STATUS parse_line();
     char* get_line(){return m_read_buf + m_start_line;}
-    HTTP_CODE do_request(); // 具体解析
+    HTTP_CODE do_request(bool nonblocking); // 具体解析，nonblocking时需要访问磁盘就返回GET_REQUEST
 
-    bool process_write(HTTP_CODE ret);
-    // 这一组函数被process_write调用以填充HTTP应答。
+    bool process_write(HTTP_CODE ret); // 把请求的响应加入待发送队列
+    bool format_error(HTTP_CODE ret); // 在写缓冲中生成完整的错误响应，只在init_responses中使用
+    // 这一组函数被format_error调用以填充HTTP应答。
     bool add_status_line(int status, const char* title); // 添加响应首行
     bool add_headers(int content_len); // 添加响应头
     bool add_content(const char* content); // 添加响应体
@@ -138,36 +288,40 @@ private:
     bool add_linger();
     bool add_blank_line();
     bool add_content_type();
+    bool add_stats(http_response* r); // 生成统计页面的响应
+    bool stats_allowed() const; // 统计页面只对本机的客户端开放
+    // 请求的响应项[first, m_resp_count)已经加入队列，在m_access中暂存它的访问日志记录，start是开始解析的时间
+    void stage_access(int first, uint64_t start);
+    void commit_access(http_response* r, uint64_t unsent); // 请求的最后一项发完或连接关闭，写出访问日志记录
 
 
 };
 
-int http_conn::m_epollfd = -1; // 所有的socket上的事件都被注册到同一个epoll事件中
-int http_conn::m_user_cnt = 0; // 统计用户数量
+std::atomic<int> http_conn::m_user_cnt(0); // 统计用户数量
+file_cache* http_conn::m_file_cache = NULL;
+buffer_pool* http_conn::m_buffer_pool = NULL;
+bool http_conn::m_edge_triggered = false;
+admission* http_conn::m_admission = NULL;
 
-// 设置文件描述符非阻塞
-void setnonblocking(int fd)
-{
-    int old_flag = fcntl(fd, F_GETFL);
-    int new_flag = old_flag | O_NONBLOCK;
-    fcntl(fd, F_SETFL ,new_flag);
-}
+// 预先生成的完整错误响应，第一维下标是HTTP_CODE，第二维下标是m_linger
+static std::string error_responses[http_conn::CLOSED_CONNECTION + 1][2];
 
-// 向epoll中添加需要监听的文件描述符
-void addfd(int epollfd, int fd, bool one_shot)
+// 向epoll中添加需要监听的文件描述符，fd必须已经是非阻塞的（由accept4、socket或timerfd_create的标志设置）
+// 连接socket必须注册EPOLLONESHOT：事件触发后epoll不再报告这个fd，直到处理它的线程用modfd重新注册，
+// 这样同一时刻只有一个线程（Reactor或某个工作线程）在处理这个连接
+void addfd(int epollfd, int fd, bool one_shot, bool edge_triggered)
 {
     epoll_event event;
     event.data.fd = fd;
     event.events = EPOLLIN | EPOLLRDHUP;
-    // event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-
-
+    if(edge_triggered){
+        event.events |= EPOLLET;
+    }
     if(one_shot){
-        event.events | EPOLLONESHOT;
+        event.events |= EPOLLONESHOT;
     }
 
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    setnonblocking(fd);
 }
 
 // 从epoll中删除监听的文件描述符
@@ -177,78 +331,176 @@ void removefd(int epollfd, int fd)
     close(fd);
 }
 
-// 修改epoll中的文件描述符，重置socket上的EPOLLONESHOT事件，确保下一次可读时，EPOLLIN事件被触发
-void modfd(int epollfd, int fd, int ev)
+// 修改epoll中的文件描述符，重置socket上的EPOLLONESHOT事件，确保下一次可读时，EPOLLIN事件被触发。
+// EPOLL_CTL_MOD会立即重新检查fd的状态，边沿触发时重新注册之前已经就绪的数据也会产生一次事件，不会丢失
+void modfd(int epollfd, int fd, int ev, bool edge_triggered)
 {
     epoll_event event;
     event.data.fd = fd;
     event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
+    if(edge_triggered){
+        event.events |= EPOLLET;
+    }
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
 // 初始化新接受的连接
-void http_conn::init(int sockfd, const sockaddr_in& addr)
+void http_conn::init(int sockfd, const sockaddr_in& addr, int epollfd, timer_wheel<http_conn>* timers)
 {
     m_sockfd = sockfd;
     m_address = addr;
-
-    // 端口复用
-    int reuse = 1;
-    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-
-    // 添加到epoll对象中
-    addfd(m_epollfd, m_sockfd, true);
+    m_epollfd = epollfd;
+    m_timers = timers;
+    m_timer = NULL;
+    m_idle = true;
+    m_file_fd = -1;
+    m_file = NULL;
+    m_resp_head = 0;
+    m_resp_count = 0;
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_write_buf = NULL;
+    m_write_size = 0;
+
+    // 添加到epoll对象中，socket由accept4设置为非阻塞
+    if(m_epollfd >= 0) addfd(m_epollfd, m_sockfd, true, m_edge_triggered);
     m_user_cnt++;
+    metrics::count(metrics::CONN_ACCEPTED);
 
     init(); // 下面那个init()
 }
 
 // 初始化其他一些信息
+// 读缓冲按长度使用，不需要清空
 void http_conn::init()
 {
-    m_check_state = CHECK_STATE_REQUESTLINE; // 初始化状态为解析请求首行
-    m_checked_idx = 0; 
-    m_start_line = 0;
     m_read_idx = 0;
+    m_request_start = 0;
+    m_start_line = 0;
+    m_checked_idx = 0;
+    m_write_idx = 0;
+    m_deferred = false;
+    init_request();
+}
+
+void http_conn::init_request()
+{
+    m_check_state = CHECK_STATE_REQUESTLINE; // 初始化状态为解析请求首行
     m_method = GET;
     m_url = 0;
     m_version = 0;
     m_content_length = 0;
     m_linger = false;
+    m_accept_encoding = 0;
+    m_if_modified_since = -1;
+    m_if_none_match = 0;
+    m_range = 0;
+    m_if_range = 0;
     m_host = 0;
-    m_start_line = 0;
-    m_checked_idx = 0;
-    m_read_idx = 0;
-    m_write_idx = 0;
+}
+
+// 请求到此结束，有请求体时还要跳过请求体，后面的字节属于流水线上的下一个请求
+void http_conn::finish_request()
+{
+    int end = m_checked_idx;
+    if (m_check_state == CHECK_STATE_CONTENT) end += m_content_length;
+    m_request_start = m_start_line = m_checked_idx = end;
+    init_request();
+}
 
-    bytes_to_send = 0;
-    bytes_have_send = 0;
+// 丢掉已经处理完的请求，后面不完整的请求连同已经解析出的部分一起前移，指向它的指针同样前移
+void http_conn::compact_read_buf()
+{
+    int delta = m_request_start;
+    if (delta == 0) return;
+    memmove(m_read_buf, m_read_buf + delta, m_read_idx - delta);
+    m_read_idx -= delta;
+    m_checked_idx -= delta;
+    m_start_line -= delta;
+    m_request_start = 0;
+    move_pointers(-delta);
+}
 
-    bzero(m_read_buf, READ_BUFFER_SIZE); // 读缓冲区清空
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+void http_conn::move_pointers(ptrdiff_t delta)
+{
+    if (m_url) m_url += delta;
+    if (m_version) m_version += delta;
+    if (m_host) m_host += delta;
+    if (m_if_none_match) m_if_none_match += delta;
+    if (m_range) m_range += delta;
+    if (m_if_range) m_if_range += delta;
+}
+
+// 请求头比当前的读缓冲大时换成大一级的缓冲，已经读入的数据和解析状态原样搬过去
+bool http_conn::grow_read_buf()
+{
+    size_t capacity;
+    char* buf = m_buffer_pool->acquire(m_read_buf ? m_read_size * 2 : m_buffer_pool->min_size(), &capacity);
+    if (!buf) return false;
+    if (m_read_buf){
+        memcpy(buf, m_read_buf, m_read_idx);
+        move_pointers(buf - m_read_buf);
+        m_buffer_pool->release(m_read_buf, m_read_size);
+    }
+    m_read_buf = buf;
+    m_read_size = capacity;
+    return true;
+}
+
+bool http_conn::reserve_write_buf()
+{
+    if (!m_write_buf){
+        size_t capacity;
+        m_write_buf = m_buffer_pool->acquire(m_buffer_pool->min_size(), &capacity);
+        if (!m_write_buf) return false;
+        m_write_size = capacity;
+        m_write_idx = 0;
+    }
+    return m_write_size - m_write_idx >= WRITE_BUFFER_SIZE;
+}
+
+void http_conn::release_buffers()
+{
+    if (m_read_buf){
+        m_buffer_pool->release(m_read_buf, m_read_size);
+        m_read_buf = NULL;
+        m_read_size = 0;
+    }
+    if (m_write_buf){
+        m_buffer_pool->release(m_write_buf, m_write_size);
+        m_write_buf = NULL;
+        m_write_size = 0;
+    }
 }
 
 // 关闭连接
 void http_conn::close_conn()
 {
     if(m_sockfd != -1){
-        removefd(m_epollfd, m_sockfd);
+        close_file();
+        clear_deadline();
+        // io_uring后端自己关闭socket
+        if(m_epollfd >= 0) removefd(m_epollfd, m_sockfd);
+        release_buffers();
         m_sockfd = -1;
         m_user_cnt --;
+        metrics::count(metrics::CONN_CLOSED);
     }
 }
 
 // 非阻塞读
-// 循环读取客户数据，直到无数据可读
+// 循环读取客户数据，直到recv返回EAGAIN，边沿触发时这是必须的。
+// 缓冲满时提前停下也是安全的：处理完缓冲中的请求后会用modfd重新注册，剩下的数据会再次触发事件
 bool http_conn::read()
 {
-    if(m_read_idx >= READ_BUFFER_SIZE) return false;
+    // 缓冲满了还没有一个完整的请求时换大一级的缓冲，超过上限就放弃这个连接
+    if(m_read_idx >= m_read_size && !grow_read_buf()) return false;
 
     // 读取到的字节
     int bytes_read = 0;
-    while(true){
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0); // 成功返回字节数
+    // 缓冲满了就先停下，剩下的数据等缓冲中的请求处理完、腾出空间后再读
+    while(m_read_idx < m_read_size){
+        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, m_read_size - m_read_idx, 0); // 成功返回字节数
         if(bytes_read == -1){
             if(errno == EAGAIN || errno == EWOULDBLOCK) // 没有数据
             {
@@ -262,11 +514,26 @@ bool http_conn::read()
 
         m_read_idx += bytes_read;
     }
-    printf("读取到了数据：%s\n", m_read_buf);
+    LOG_DEBUG("fd %d 读取到了数据：%.*s", m_sockfd, m_read_idx, m_read_buf);
     return true;
 
 } 
 
+// 缓冲满时，如果没有待发送的响应，缓冲中就是一个还不完整的请求，换大一级的缓冲；
+// 否则等响应发完、处理过的请求被丢掉后再继续复制
+int http_conn::feed(const char* data, int len)
+{
+    if(m_read_idx >= m_read_size){
+        if(m_resp_count > 0) return 0;
+        if(!grow_read_buf()) return -1;
+    }
+    int n = m_read_size - m_read_idx;
+    if(n > len) n = len;
+    memcpy(m_read_buf + m_read_idx, data, n);
+    m_read_idx += n;
+    return n;
+}
+
 // 主状态机，解析HTTP请求
 http_conn::HTTP_CODE http_conn::process_read()
 {
@@ -281,26 +548,28 @@ http_conn::HTTP_CODE http_conn::process_read()
     {
         // 获取一行数据
         text = get_line();
+        int len = m_line_len;
         m_start_line = m_checked_idx;
-        printf("got 1 http line: %s\n", text);
+        LOG_DEBUG("fd %d got 1 http line: %s", m_sockfd, text);
 
         // 有限状态机
         switch(m_check_state){
             case CHECK_STATE_REQUESTLINE:{
-                ret = parse_request_line(text);
+                ret = parse_request_line(text, len);
                 if(ret == BAD_REQUEST) return BAD_REQUEST;
                 break;
             }
 
             case CHECK_STATE_HEADER:{
-                ret = parse_headers(text);
+                ret = parse_headers(text, len);
                 if(ret == BAD_REQUEST) return BAD_REQUEST;
-                else if(ret == GET_REQUEST) return do_request(); // 返回成功，解析具体信息
+                else if(ret == GET_REQUEST) return GET_REQUEST; // 请求完整，由调用者执行do_request
+                break;
             }
 
             case CHECK_STATE_CONTENT:{
-                ret = parse_content(text);
-                if(ret == GET_REQUEST) return do_request();
+                ret = parse_content();
+                if(ret == GET_REQUEST) return GET_REQUEST;
                 line_status = LINE_OPEN;
                 break;
             }
@@ -308,29 +577,32 @@ http_conn::HTTP_CODE http_conn::process_read()
             default: return INTERNAL_ERROR;
         }
     }
+    if(line_status == LINE_BAD) return BAD_REQUEST;
     return NO_REQUEST;
 
 }
 
 // 解析请求首行,获得 请求方法，目标URL，HTTP版本
-http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
+// 三个部分之间是单个空格，用扫描器找分隔位置，不再逐字节strpbrk
+http_conn::HTTP_CODE http_conn::parse_request_line(char* text, int len)
 {
+    char* end = text + len;
     // GET /index.html HTTP/1.1
-    m_url = strpbrk(text, " \t");
-    if(!m_url) return BAD_REQUEST;
+    m_url = (char*)http_scan::find_char(text, end, ' ');
+    if(m_url == end) return BAD_REQUEST;
     // GET\0/index.html HTTP/1.1
     *m_url++ = '\0';
 
     char* method = text;
-    if(strcasecmp(method, "GET") == 0) m_method = GET;
+    if(m_url - method == 4 && strncasecmp(method, "GET", 3) == 0) m_method = GET;
     else return BAD_REQUEST;
 
     // /index.html HTTP/1.1
-    m_version = strpbrk(m_url, " \t");
-    if(!m_version) return BAD_REQUEST;
+    m_version = (char*)http_scan::find_char(m_url, end, ' ');
+    if(m_version == end) return BAD_REQUEST;
     // /index.html\0HTTP/1.1
     *m_version++ = '\0';
-    if(strcasecmp(m_version, "HTTP/1.1") != 0) return BAD_REQUEST;
+    if(end - m_version != 8 || strncasecmp(m_version, "HTTP/1.1", 8) != 0) return BAD_REQUEST;
 
     // 如果是 http://192.168.1.1:10000/index.html
     if(strncasecmp(m_url, "http://", 7) == 0){
@@ -339,7 +611,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
     }
 
     // 如果是 https://192.168.1.1:10000/index.html
-    if (strncasecmp(m_url, "https://", 8) == 0)
+    else if (strncasecmp(m_url, "https://", 8) == 0)
     {
         m_url += 8;
         m_url = strchr(m_url, '/');
@@ -354,10 +626,11 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
 }
 
 // 解析请求头
-http_conn::HTTP_CODE http_conn::parse_headers(char* text)
+// 用扫描器找到冒号，按名称的长度和内容一次识别出请求头，值去掉前后的空白
+http_conn::HTTP_CODE http_conn::parse_headers(char* text, int len)
 {
   // 遇到空行，表示头部字段解析完毕
-    if( text[0] == '\0' ) {
+    if( len == 0 ) {
         // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
         // 状态机转移到CHECK_STATE_CONTENT状态
         if ( m_content_length != 0 ) {
@@ -366,76 +639,125 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text)
         }
         // 否则说明我们已经得到了一个完整的HTTP请求
         return GET_REQUEST;
-    }else if(strncasecmp(text, "Connection:", 11) == 0){
-        // 处理Connection头部字段 Connection: keep-alive
-        text += 11;
-        text += strspn(text, " \t");
-        if (strcasecmp(text, "keep-alive") == 0) m_linger = true;
-    }else if(strncasecmp(text, "Content-Length:", 15) == 0){
-        //处理Content-Length头部字段
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = atol(text);
-    }else if(strncasecmp(text, "Host:", 5) == 0){
-        // 处理Host头部字段
-        text += 5;
-        text += strspn(text, " \t");
-        m_host = text;
-    }else printf("oop! unknow header %s\n", text);
-    
+    }
+
+    char* end = text + len;
+    char* colon = (char*)http_scan::find_char(text, end, ':');
+    if(colon == end) return BAD_REQUEST;
+    HEADER_NAME name = http_scan::lookup(text, colon - text);
+    if(name == HEADER_OTHER) return NO_REQUEST;
+
+    char* value = colon + 1;
+    while(value < end && (*value == ' ' || *value == '\t')) ++value;
+    while(end > value && (end[-1] == ' ' || end[-1] == '\t')) *--end = '\0';
+
+    switch(name){
+        case HEADER_CONNECTION:
+            // 处理Connection头部字段 Connection: keep-alive
+            if(end - value == 10 && strncasecmp(value, "keep-alive", 10) == 0) m_linger = true;
+            break;
+        case HEADER_CONTENT_LENGTH:
+            //处理Content-Length头部字段
+            m_content_length = atol(value);
+            if(m_content_length < 0) return BAD_REQUEST;
+            break;
+        case HEADER_HOST:
+            // 处理Host头部字段
+            m_host = value;
+            break;
+        case HEADER_ACCEPT_ENCODING:
+            m_accept_encoding = parse_accept_encoding(value, end);
+            break;
+        case HEADER_IF_NONE_MATCH:
+            m_if_none_match = value;
+            break;
+        case HEADER_RANGE:
+            m_range = value;
+            break;
+        case HEADER_IF_RANGE:
+            m_if_range = value;
+            break;
+        case HEADER_IF_MODIFIED_SINCE: {
+            // 只接受RFC 7231推荐的IMF-fixdate格式，无法解析时忽略这个条件
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            const char* rest = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+            m_if_modified_since = (rest && *rest == '\0') ? timegm(&tm) : -1;
+            break;
+        }
+        default: break;
+    }
     return NO_REQUEST;
 }
 
 // 解析请求体，没有真正解析，只是判断是否被完整读入
-http_conn::HTTP_CODE http_conn::parse_content(char* text)
+http_conn::HTTP_CODE http_conn::parse_content()
 {
+    // 请求体后面可能紧跟着下一个请求，不能在这里写入'\0'
     if (m_read_idx >= (m_content_length + m_checked_idx)){
-        text[m_content_length] = '\0';
         return GET_REQUEST;
     }
     return NO_REQUEST;
 }
 
 // 解析一行数据, 判断依据 \r\n
+// 从上次停下的位置用扫描器找下一个\r或\n，找到\r\n时把它们改成\0，没有找到时等待更多数据
 http_conn::LINE_STATUS http_conn::parse_line()
 {
-    char tmp;
-    for(; m_checked_idx < m_read_idx; ++m_checked_idx){
-        tmp = m_read_buf[m_checked_idx];
-        if(tmp == '\r'){
-            if((m_checked_idx+1) == m_read_idx){
-                return LINE_OPEN;
-            }else if(m_read_buf[m_checked_idx +1]=='\n'){// '\r\n' 回车换行
-                m_read_buf[m_checked_idx++] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
-                return LINE_OK;
-            } 
-            return LINE_BAD;
-        }else if(tmp == '\n'){
-            if((m_checked_idx > 1) && (m_read_buf[m_checked_idx - 1] == '\r')){ // '\r\n' 回车换行
-                m_read_buf[m_checked_idx-1] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
-        }
-        // return LINE_OPEN;
-
-    }
+    const char* begin = m_read_buf + m_checked_idx;
+    const char* end = m_read_buf + m_read_idx;
+    const char* eol = http_scan::find_eol(begin, end);
+    m_checked_idx = eol - m_read_buf;
+    if(eol == end) return LINE_OPEN;
+    // 单独的\n不是合法的行结束符
+    if(*eol == '\n') return LINE_BAD;
+    // \r是已读数据的最后一个字节，停在这里，等\n到了再判断
+    if(m_checked_idx + 1 == m_read_idx) return LINE_OPEN;
+    if(m_read_buf[m_checked_idx + 1] != '\n') return LINE_BAD;
+
+    m_line_len = m_checked_idx - m_start_line;
+    m_read_buf[m_checked_idx++] = '\0';
+    m_read_buf[m_checked_idx++] = '\0';
     return LINE_OK;
 }
 
 // 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
-// 如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其
-// 映射到内存地址m_file_address处，并告诉调用者获取文件成功
-http_conn::HTTP_CODE http_conn::do_request()
+// 如果目标文件存在、对所有用户可读，且不是目录，则以只读方式打开它，
+// 由write()用sendfile把文件内容从内核直接发送到socket，并告诉调用者获取文件成功。
+// nonblocking时只用缓存判定，缓存没有命中（或者没有缓存）时返回GET_REQUEST，表示请求还没有处理
+http_conn::HTTP_CODE http_conn::do_request(bool nonblocking)
 {
+    if (strncmp(m_url, stats_url, sizeof(stats_url) - 1) == 0 &&
+        (m_url[sizeof(stats_url) - 1] == '\0' || m_url[sizeof(stats_url) - 1] == '?')){
+        return stats_allowed() ? STATS_REQUEST : NO_RESOURCE;
+    }
+    if (m_file_cache){
+        // 命中缓存时不需要拼接路径，也没有stat和open
+        file_entry* entry = NULL;
+        switch (m_file_cache->acquire(m_url, &entry, nonblocking)){
+            case FILE_MISS: return GET_REQUEST;
+            case FILE_NOT_FOUND: return NO_RESOURCE;
+            case FILE_FORBIDDEN: return FORBIDDEN_REQUEST;
+            case FILE_IS_DIR: return BAD_REQUEST;
+            case FILE_ERROR: return INTERNAL_ERROR;
+            default: break;
+        }
+        m_file = entry;
+        m_file_fd = entry->fd;
+        m_file_stat = entry->st;
+        return FILE_REQUEST;
+    }
+    if (nonblocking) return GET_REQUEST;
+
+    // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
     // "/home/wljszj/webserver/resources"
-    strcpy(m_real_file, doc_root);
+    char real_file[FILENAME_LEN];
+    strcpy(real_file, doc_root);
     int len = strlen(doc_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if (stat(m_real_file, &m_file_stat) < 0) return NO_RESOURCE;
+    strncpy(real_file + len, m_url, FILENAME_LEN - len - 1);
+    real_file[FILENAME_LEN - 1] = '\0';
+    // 获取real_file文件的相关的状态信息，-1失败，0成功
+    if (stat(real_file, &m_file_stat) < 0) return NO_RESOURCE;
 
     // 判断访问权限
     if (!(m_file_stat.st_mode & S_IROTH)) return FORBIDDEN_REQUEST;
@@ -443,95 +765,834 @@ http_conn::HTTP_CODE http_conn::do_request()
     // 判断是否是目录
     if (S_ISDIR(m_file_stat.st_mode)) return BAD_REQUEST;    
 
-    // 以只读方式打开文件
-    int fd = open(m_real_file, O_RDONLY);
+    // 客户端的缓存仍然有效时不需要打开文件
+    char etag[64];
+    int etag_len = format_etag(etag, sizeof(etag), m_file_stat, NULL);
+    if (etag_len > 0 && not_modified(etag, etag_len, m_file_stat.st_mtime)) return NOT_MODIFIED;
 
-    // 创建内存映射
-    m_file_address = (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-
-    close(fd);
+    // 以只读方式打开文件
+    m_file_fd = open(real_file, O_RDONLY | O_CLOEXEC);
+    if (m_file_fd < 0) return INTERNAL_ERROR;
 
     return FILE_REQUEST;
 }
 
-// 对内存映射区执行munmap操作
-void http_conn::unmap()
+// 关闭文件，来自缓存的文件只归还引用
+void http_conn::release_file(int& fd, file_entry*& file)
 {
-    if(m_file_address)
+    if(file)
+    {
+        m_file_cache->release(file);
+        file = NULL;
+        fd = -1;
+    }
+    else if(fd != -1)
     {
-        munmap(m_file_address, m_file_stat.st_size);
-        m_file_address = 0;
+        close(fd);
+        fd = -1;
     }
 }
 
+void http_conn::release_response(http_response* r)
+{
+    delete r->owned;
+    r->owned = NULL;
+    if (r->borrowed){
+        r->file_fd = -1;
+        return;
+    }
+    release_file(r->file_fd, r->file);
+}
+
+void http_conn::close_file()
+{
+    release_file(m_file_fd, m_file);
+    // 没有发完的请求也记下访问日志，字节数是已经发出的部分
+    uint64_t unsent = 0;
+    for(int i = m_resp_head; i < m_resp_count; ++i){
+        http_response* r = &m_responses[i];
+        if (access_log::enabled()){
+            for (int j = r->iv_idx; j < r->iv_count; ++j) unsent += r->iv[j].iov_len;
+            unsent += r->file_left;
+            if (r->log_off >= 0){
+                commit_access(r, unsent);
+                unsent = 0;
+            }
+        }
+        release_response(r);
+    }
+    m_resp_head = m_resp_count = 0;
+    m_access.clear();
+}
+
 // 处理客户端请求, 由线程池中的工作线程调用，处理HTTP请求的入口函数
+// 读缓冲中可能有多个流水线请求，依次解析并生成响应，响应在Reactor中合并成一次写
 void http_conn::process()
 {
-    // 解析HTTP请求
-    HTTP_CODE read_ret = process_read();
-    if(read_ret == NO_REQUEST){
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+    uint64_t now = metrics::now();
+    metrics::record(metrics::STAGE_QUEUE, now - m_queued_at);
+    // 排队太久、被CoDel丢弃的请求不处理，直接回复503
+    if(m_load && !m_admission->dequeue(now - m_queued_at, now)){
+        m_admission->done(m_load);
+        shed();
+        modfd(m_epollfd, m_sockfd, EPOLLOUT, m_edge_triggered);
         return;
     }
+    bool write_ret = process_requests();
+    // 在连接交还给Reactor之前结束计数，Reactor随后可能马上为它再次申请准入
+    if(m_load) m_admission->done(m_load);
+    if(write_ret && m_resp_count == 0){
+        if(m_read_idx == 0) release_buffers();
+        modfd(m_epollfd, m_sockfd, EPOLLIN, m_edge_triggered);
+        return;
+    }
+    // 连接只能由所属的Reactor线程关闭，这里关闭socket的读写，Reactor随后会收到EPOLLHUP
+    if(!write_ret) shutdown(m_sockfd, SHUT_RDWR);
+    modfd(m_epollfd, m_sockfd, EPOLLOUT, m_edge_triggered);
+}
 
-    // 生成响应
-    bool write_ret = process_write(read_ret);
-    if(!write_ret) close_conn();
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+// 解析读缓冲中所有完整的请求并把响应加入待发送队列，生成响应失败时返回false
+bool http_conn::process_requests(bool nonblocking)
+{
+    bool write_ret = true;
+    bool idle = m_resp_count == 0;
+    while(m_resp_count < MAX_PIPELINE && (m_write_buf == NULL || m_write_size - m_write_idx >= WRITE_BUFFER_SIZE)){
+        // 解析HTTP请求，只统计最后一次解析，请求分几次到达时之前的部分不计
+        uint64_t begin = metrics::now();
+        HTTP_CODE read_ret = GET_REQUEST;
+        if(m_deferred){
+            // Reactor线程已经解析完这个请求，只差do_request
+            if(nonblocking) break;
+            m_deferred = false;
+        }else{
+            read_ret = process_read();
+            if(read_ret == NO_REQUEST) break;
+            metrics::record(metrics::STAGE_PARSE, metrics::now() - begin);
+            metrics::count(metrics::REQUESTS);
+        }
+        if(read_ret == GET_REQUEST){
+            // 解析具体信息
+            uint64_t parsed = metrics::now();
+            read_ret = do_request(nonblocking);
+            if(read_ret == GET_REQUEST){
+                // 需要访问磁盘，解析状态留在连接中，交给工作线程
+                m_deferred = true;
+                break;
+            }
+            metrics::record(metrics::STAGE_REQUEST, metrics::now() - parsed);
+        }
+        // 语法错误时无法确定下一个请求从哪里开始，响应后关闭连接；进程正在排空时也在这个响应之后关闭
+        if(read_ret == BAD_REQUEST || upgrade::draining()) m_linger = false;
+
+        // 生成响应
+        bool linger = m_linger;
+        int first = m_resp_count;
+        write_ret = process_write(read_ret);
+        if(!write_ret) break;
+        if(access_log::enabled()) stage_access(first, begin);
+        finish_request();
+        // 连接在这个响应之后关闭，后面的请求不再处理
+        if(!linger) break;
+    }
+    compact_read_buf();
+    if(idle && m_resp_count > 0) m_output_start = metrics::now();
+    return write_ret;
 }
 
-// 非阻塞写HTTP响应
-bool http_conn::write()
+void http_conn::set_deadline(time_t expire)
 {
-    int temp = 0;
-    int bytes_have_send = 0;    // 已经发送的字节
-    int bytes_to_send = m_write_idx;// 将要发送的字节 （m_write_idx）写缓冲区中待发送的字节数
-    
-    if (bytes_to_send == 0){
-        // 将要发送的字节为0，这一次响应结束。
-        modfd(m_epollfd, m_sockfd, EPOLLIN); 
-        init();
-        return true;
+    if(m_timer){
+        m_timers->adjust_timer(m_timer, expire);
+    }else{
+        m_timer = m_timers->add_timer(expire, timeout, this);
+    }
+}
+
+void http_conn::clear_deadline()
+{
+    if(m_timer){
+        m_timers->del_timer(m_timer);
+        m_timer = NULL;
     }
+}
 
-    while(1) {
-        // 分散写
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+// 连接超时。此时连接可能正被工作线程处理，所以不直接关闭，而是关闭socket的读写，
+// 等它重新注册到epoll后由Reactor在EPOLLHUP事件中关闭
+void http_conn::timeout(http_conn* conn)
+{
+    conn->m_timer = NULL; // 定时器已经被时间轮回收
+    shutdown(conn->m_sockfd, SHUT_RDWR);
+}
+
+// 非阻塞写HTTP响应
+// 把从队首开始连续的内存块（多个响应的响应头、错误响应、小文件）收集起来一次sendmsg发出，
+// 遇到需要sendfile的响应时在它的响应头处停下，发完文件内容再继续。遇到EAGAIN时记住进度，等下一轮EPOLLOUT继续
+bool http_conn::write()
+{
+    ssize_t temp = 0;
+
+    while(has_output()) {
+        http_response* r = &m_responses[m_resp_head];
+        if (r->iv_idx < r->iv_count){
+            struct iovec iv[MAX_PIPELINE * 3];
+            bool more;
+            int n = gather(iv, &more);
+            // 后面还有文件内容时带上MSG_MORE，让内核把响应头和文件开头合并成满的报文段再发出
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iv;
+            msg.msg_iovlen = n;
+            temp = sendmsg(m_sockfd, &msg, more ? MSG_MORE : 0);
+            if (temp > 0) advance(temp);
+        }else{
+            temp = send_file();
+            if (temp == 0){
+                // 文件在发送过程中被截短了
+                return false;
+            }
+        }
         if (temp <= -1){
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if(errno == EAGAIN){
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                modfd(m_epollfd, m_sockfd, EPOLLOUT, m_edge_triggered);
                 return true;
             }
-            unmap();
             return false;
         }
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if(bytes_have_send >= m_iv[0].iov_len){
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
-        }else{
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
+    }
+
+    if (!finish_output()) return false;
+    // 读缓冲中还有后续请求的数据时由Reactor再交给线程池，这里不能重新注册EPOLLIN
+    if (m_read_idx == 0){
+        modfd(m_epollfd, m_sockfd, EPOLLIN, m_edge_triggered);
+    }
+    return true;
+}
+
+// 从队首开始收集连续的内存块，遇到还有文件内容要发送的响应时停下，more表示后面还有文件内容，返回块数
+int http_conn::gather(struct iovec* iv, bool* more)
+{
+    int n = 0;
+    *more = false;
+    for (int i = m_resp_head; i < m_resp_count; ++i){
+        http_response* p = &m_responses[i];
+        for (int j = p->iv_idx; j < p->iv_count; ++j) iv[n++] = p->iv[j];
+        if (p->file_left > 0){
+            *more = true;
+            break;
         }
-        if(bytes_to_send <= 0){
-            // 没有数据要发送了
-            unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
+    }
+    return n;
+}
 
-            if (m_linger){
-                init();
-                return true;
-            }else return false;
+// 用sendfile发送队首响应的文件内容，返回值同sendfile
+ssize_t http_conn::send_file()
+{
+    http_response* r = &m_responses[m_resp_head];
+    // 文件内容不经过用户态，file_offset由sendfile自动推进
+    ssize_t temp = sendfile(m_sockfd, r->file_fd, &r->file_offset, r->file_left);
+    if (temp > 0){
+        metrics::count(metrics::BYTES_SENT, temp);
+        r->file_left -= temp;
+        if (r->file_left == 0){
+            if (access_log::enabled() && r->log_off >= 0) commit_access(r, 0);
+            release_response(r);
+            ++m_resp_head;
         }
     }
+    return temp;
+}
+
+// 所有响应都发完了，清空队列，返回最后一个响应之后是否保持连接
+bool http_conn::finish_output()
+{
+    bool linger = output_linger();
+    if (m_resp_count > 0) metrics::record(metrics::STAGE_WRITE, metrics::now() - m_output_start);
+    m_resp_head = m_resp_count = 0;
+    m_write_idx = 0;
+    m_access.clear();
+    if (!linger) return false;
+    // 连接进入空闲，缓冲归还给缓冲池
+    if (m_read_idx == 0) release_buffers();
+    return true;
+}
+
+// sendmsg发出了n字节，从队首开始跳过已经发出的块，完全发完的响应出队
+void http_conn::advance(ssize_t n)
+{
+    metrics::count(metrics::BYTES_SENT, n);
+    while (m_resp_head < m_resp_count){
+        http_response* r = &m_responses[m_resp_head];
+        while (n > 0 && r->iv_idx < r->iv_count){
+            struct iovec* v = &r->iv[r->iv_idx];
+            size_t k = (size_t)n < v->iov_len ? (size_t)n : v->iov_len;
+            v->iov_base = (char*)v->iov_base + k;
+            v->iov_len -= k;
+            n -= k;
+            if (v->iov_len == 0) ++r->iv_idx;
+        }
+        if (r->iv_idx < r->iv_count || r->file_left > 0) return;
+        if (access_log::enabled() && r->log_off >= 0) commit_access(r, 0);
+        release_response(r);
+        ++m_resp_head;
+    }
 }
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
+// 响应都是预先生成好的，这里只把它们放进iovec，唯一随连接变化的Connection头部是两个常量之一
 bool http_conn::process_write(HTTP_CODE ret)
+{
+    http_response* r = &m_responses[m_resp_count];
+    r->iv_idx = 0;
+    r->file_fd = -1;
+    r->file = NULL;
+    r->file_offset = 0;
+    r->file_left = 0;
+    r->borrowed = false;
+    r->owned = NULL;
+    r->linger = m_linger;
+
+    if (ret == STATS_REQUEST) return add_stats(r);
+
+    if (ret == FILE_REQUEST || ret == NOT_MODIFIED){
+        // 客户端接受的压缩变体中选最小的一个
+        const file_variant* v = NULL;
+        if (m_file && m_accept_encoding){
+            for (int i = 0; i < ENCODING_COUNT; ++i){
+                const file_variant* c = &m_file->variants[i];
+                if ((m_accept_encoding & (1 << i)) && c->size > 0 && (!v || c->size < v->size)) v = c;
+            }
+        }
+        // 缓存中的文件在选定表示之后才能比较实体标签，未缓存的文件已经在do_request中比较过
+        if (m_file){
+            const std::string& etag = v ? v->etag : m_file->etag;
+            if (not_modified(etag.data(), etag.size(), m_file_stat.st_mtime)) ret = NOT_MODIFIED;
+        }
+        // 范围请求只针对原始内容，不使用压缩变体
+        if (ret == FILE_REQUEST && m_range){
+            int handled = add_ranges();
+            if (handled < 0){
+                release_file(m_file_fd, m_file);
+                return false;
+            }
+            if (handled > 0) return true;
+        }
+        // 缓存中的文件直接引用加载时生成的响应头，否则现场生成到写缓冲
+        if (ret == NOT_MODIFIED){
+            const std::string* header = m_file ? (v ? &v->header_304 : &m_file->header_304) : NULL;
+            int len = -1;
+            if (header){
+                r->iv[0].iov_base = (void*)header->data();
+                r->iv[0].iov_len = header->size();
+            }else if (reserve_write_buf() &&
+                      (len = format_not_modified(m_write_buf + m_write_idx, m_write_size - m_write_idx,
+                                                 m_file_stat, NULL, false)) > 0){
+                r->iv[0].iov_base = m_write_buf + m_write_idx;
+                r->iv[0].iov_len = len;
+                m_write_idx += len;
+            }else{
+                release_file(m_file_fd, m_file);
+                return false;
+            }
+        }else if (v){
+            r->iv[0].iov_base = (void*)v->header.data();
+            r->iv[0].iov_len = v->header.size();
+        }else if (m_file){
+            r->iv[0].iov_base = (void*)m_file->header.data();
+            r->iv[0].iov_len = m_file->header.size();
+        }else{
+            int len = reserve_write_buf() ?
+                      format_file_header(m_write_buf + m_write_idx, m_write_size - m_write_idx, m_file_stat,
+                                         m_file_stat.st_size, mime_lookup(m_url)->type, NULL, false) : -1;
+            if (len < 0){
+                release_file(m_file_fd, m_file);
+                return false;
+            }
+            r->iv[0].iov_base = m_write_buf + m_write_idx;
+            r->iv[0].iov_len = len;
+            m_write_idx += len;
+        }
+        if (m_linger){
+            r->iv[1].iov_base = (void*)connection_keep_alive;
+            r->iv[1].iov_len = sizeof(connection_keep_alive) - 1;
+        }else{
+            r->iv[1].iov_base = (void*)connection_close;
+            r->iv[1].iov_len = sizeof(connection_close) - 1;
+        }
+        r->iv_count = 2;
+        if (ret == NOT_MODIFIED){
+            // 304没有消息体，缓存项要等响应头发完才能归还
+            r->file_left = 0;
+        }else if (v){
+            // 压缩变体和原始内容一样，小的在内存中和响应头一起发送，大的用sendfile
+            if (v->fd == -1){
+                r->iv[2].iov_base = (void*)v->body.data();
+                r->iv[2].iov_len = v->body.size();
+                r->iv_count = 3;
+            }else{
+                r->file_left = v->size;
+            }
+        }else if (m_file && m_file_stat.st_size > 0 && m_file->body.size() == (size_t)m_file_stat.st_size){
+            // 小文件的内容已经在内存中，和响应头一起发送
+            r->iv[2].iov_base = (void*)m_file->body.data();
+            r->iv[2].iov_len = m_file->body.size();
+            r->iv_count = 3;
+        }else{
+            r->file_left = m_file_stat.st_size;
+        }
+        // 文件交给响应，发完后由write()归还。变体的文件属于缓存项，随缓存项一起关闭
+        r->file_fd = (v && v->fd != -1) ? v->fd : m_file_fd;
+        r->file = m_file;
+        m_file_fd = -1;
+        m_file = NULL;
+        ++m_resp_count;
+        metrics::count_status(ret == NOT_MODIFIED ? 304 : 200);
+        return true;
+    }
+
+    if (ret < 0 || ret > CLOSED_CONNECTION) return false;
+    const std::string& response = error_responses[ret][m_linger ? 1 : 0];
+    if (response.empty()) return false;
+    r->iv[0].iov_base = (void*)response.data();
+    r->iv[0].iov_len = response.size();
+    r->iv_count = 1;
+    ++m_resp_count;
+    metrics::count(ret == INTERNAL_ERROR || ret == SERVICE_UNAVAILABLE ? metrics::RESPONSES_5XX : metrics::RESPONSES_4XX);
+    return true;
+}
+
+void http_conn::init_responses()
+{
+    // 借用一个连接对象，用add_*这组函数格式化，之后每个请求只引用生成好的字符串
+    http_conn* conn = new http_conn;
+    char buf[WRITE_BUFFER_SIZE];
+    conn->m_write_buf = buf;
+    conn->m_write_size = WRITE_BUFFER_SIZE;
+    const HTTP_CODE codes[] = { BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, INTERNAL_ERROR, SERVICE_UNAVAILABLE };
+    for (size_t i = 0; i < sizeof(codes) / sizeof(codes[0]); ++i){
+        for (int linger = 0; linger < 2; ++linger){
+            conn->m_write_idx = 0;
+            conn->m_linger = linger;
+            if (conn->format_error(codes[i])){
+                error_responses[codes[i]][linger].assign(conn->m_write_buf, conn->m_write_idx);
+            }
+        }
+    }
+    delete conn;
+}
+
+void http_conn::reject(int sockfd)
+{
+    // 丢掉已经到达的请求数据，否则close时接收队列非空，内核会发RST而不是FIN，客户端可能收不到503
+    char discard[1024];
+    while (recv(sockfd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {}
+    const std::string& response = error_responses[SERVICE_UNAVAILABLE][0];
+    send(sockfd, response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(sockfd);
+    metrics::count(metrics::CONN_REJECTED);
+    metrics::count(metrics::RESPONSES_5XX);
+}
+
+// 连接已经有了连接对象，503和其他响应一样经过发送队列，EAGAIN时等EPOLLOUT继续发送
+void http_conn::shed()
+{
+    // 读缓冲中已经收到的请求都不再处理，503之后关闭连接
+    init();
+    uint64_t now = metrics::now();
+    process_write(SERVICE_UNAVAILABLE);
+    if (access_log::enabled()) stage_access(0, now);
+    m_output_start = now;
+    metrics::count(metrics::REQUESTS_SHED);
+}
+
+void http_conn::prepare_file(file_entry* entry)
+{
+    const mime_type* type = mime_lookup(entry->url.c_str());
+    prepare_variants(entry, type);
+    bool vary = false;
+    for (int i = 0; i < ENCODING_COUNT; ++i){
+        if (entry->variants[i].size > 0) vary = true;
+    }
+
+    char buf[WRITE_BUFFER_SIZE];
+    int len = format_file_header(buf, sizeof(buf), entry->st, entry->st.st_size, type->type, NULL, vary);
+    if (len > 0) entry->header.assign(buf, len);
+    len = format_not_modified(buf, sizeof(buf), entry->st, NULL, vary);
+    if (len > 0) entry->header_304.assign(buf, len);
+    len = format_etag(buf, sizeof(buf), entry->st, NULL);
+    if (len > 0) entry->etag.assign(buf, len);
+
+    // 小文件读入内存，流水线上的多个小文件响应可以在一次写中发出。读不完整时仍然用sendfile
+    if (entry->st.st_size > 0 && entry->st.st_size <= INLINE_FILE_SIZE){
+        char body[INLINE_FILE_SIZE];
+        if (pread(entry->fd, body, entry->st.st_size, 0) == entry->st.st_size){
+            entry->body.assign(body, entry->st.st_size);
+        }
+    }
+}
+
+void http_conn::prepare_variants(file_entry* entry, const mime_type* type)
+{
+    off_t size = entry->st.st_size;
+    if (!type->compressible || size < COMPRESS_MIN_SIZE || size > COMPRESS_MAX_SIZE) return;
+    bool any = false;
+    for (int i = 0; i < ENCODING_COUNT; ++i){
+        if (compressor::available((CONTENT_ENCODING)i)) any = true;
+    }
+    if (!any) return;
+
+    std::string data;
+    data.resize(size);
+    if (pread(entry->fd, &data[0], size, 0) != size) return;
+
+    for (int i = 0; i < ENCODING_COUNT && i < FILE_CACHE_VARIANTS; ++i){
+        std::string out;
+        if (!compressor::compress((CONTENT_ENCODING)i, data.data(), size, &out)) continue;
+        // 至少省下八分之一才值得让客户端解压
+        if ((off_t)out.size() > size - size / 8) continue;
+
+        file_variant* v = &entry->variants[i];
+        char buf[WRITE_BUFFER_SIZE];
+        int len = format_file_header(buf, sizeof(buf), entry->st, out.size(), type->type, encoding_names[i], true);
+        if (len < 0) continue;
+        v->header.assign(buf, len);
+        len = format_not_modified(buf, sizeof(buf), entry->st, encoding_names[i], true);
+        if (len > 0) v->header_304.assign(buf, len);
+        len = format_etag(buf, sizeof(buf), entry->st, encoding_names[i]);
+        if (len > 0) v->etag.assign(buf, len);
+        // 大的变体放进memfd，和原始文件一样用sendfile发送，放不进时留在内存中
+        if (out.size() > (size_t)INLINE_FILE_SIZE){
+            int fd = memfd_create(encoding_names[i], MFD_CLOEXEC);
+            if (fd >= 0 && ::write(fd, out.data(), out.size()) == (ssize_t)out.size()){
+                v->fd = fd;
+            }else if (fd >= 0){
+                close(fd);
+            }
+        }
+        if (v->fd == -1) v->body.swap(out);
+        v->size = v->fd == -1 ? v->body.size() : out.size();
+        entry->extra_bytes += v->size;
+    }
+}
+
+int http_conn::format_etag(char* buf, int size, const struct stat& st, const char* encoding)
+{
+    // 同一个文件被替换后inode或修改时间会变，纳秒精度的修改时间能区分一秒内的多次修改
+    long long mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    int len = snprintf(buf, size, "\"%llx-%llx-%llx%s%s\"", (unsigned long long)st.st_ino, (unsigned long long)st.st_size,
+                       (unsigned long long)mtime, encoding ? "-" : "", encoding ? encoding : "");
+    return (len < 0 || len >= size) ? -1 : len;
+}
+
+// ETag和Last-Modified，200、206和304共用
+int http_conn::format_validators(char* buf, int size, const struct stat& st, const char* encoding)
+{
+    int etag_len = http_conn::format_etag(buf, size, st, encoding);
+    if (etag_len < 0) return -1;
+    char etag[64];
+    if (etag_len >= (int)sizeof(etag)) return -1;
+    memcpy(etag, buf, etag_len + 1);
+    struct tm tm;
+    char date[64];
+    if (!gmtime_r(&st.st_mtime, &tm) || strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm) == 0) return -1;
+    int len = snprintf(buf, size, "ETag: %s\r\nLast-Modified: %s\r\n", etag, date);
+    return (len < 0 || len >= size) ? -1 : len;
+}
+
+int http_conn::format_file_header(char* buf, int size, const struct stat& st, off_t length, const char* type,
+                                  const char* encoding, bool vary)
+{
+    // 范围请求只支持原始内容
+    int len = snprintf(buf, size, "HTTP/1.1 200 %s\r\nContent-Length: %lld\r\nContent-Type:%s\r\n%s%s%s%s",
+                       ok_200_title, (long long)length, type,
+                       encoding ? "Content-Encoding: " : "Accept-Ranges: bytes", encoding ? encoding : "", "\r\n",
+                       vary ? "Vary: Accept-Encoding\r\n" : "");
+    if (len < 0 || len >= size) return -1;
+    int n = format_validators(buf + len, size - len, st, encoding);
+    return n < 0 ? -1 : len + n;
+}
+
+int http_conn::format_not_modified(char* buf, int size, const struct stat& st, const char* encoding, bool vary)
+{
+    int len = snprintf(buf, size, "HTTP/1.1 304 %s\r\n%s", not_modified_304_title, vary ? "Vary: Accept-Encoding\r\n" : "");
+    if (len < 0 || len >= size) return -1;
+    int n = format_validators(buf + len, size - len, st, encoding);
+    return n < 0 ? -1 : len + n;
+}
+
+// If-None-Match优先，有它时忽略If-Modified-Since。实体标签按弱比较，忽略W/前缀
+bool http_conn::not_modified(const char* etag, int etag_len, time_t mtime) const
+{
+    if (m_if_none_match){
+        const char* p = m_if_none_match;
+        while (*p){
+            while (*p == ' ' || *p == '\t' || *p == ',') ++p;
+            if (*p == '*') return true;
+            if (p[0] == 'W' && p[1] == '/') p += 2;
+            const char* tag = p;
+            if (*p == '"'){
+                for (++p; *p && *p != '"'; ++p) {}
+                if (*p == '"') ++p;
+            }else{
+                while (*p && *p != ',' && *p != ' ' && *p != '\t') ++p;
+            }
+            if (p - tag == etag_len && memcmp(tag, etag, etag_len) == 0) return true;
+        }
+        return false;
+    }
+    return m_if_modified_since != -1 && mtime <= m_if_modified_since;
+}
+
+// If-Range是实体标签时按强比较，弱标签永远不匹配；是日期时必须和修改时间完全相同
+bool http_conn::if_range_matches(const char* etag, int etag_len, time_t mtime) const
+{
+    const char* p = m_if_range;
+    if (*p == '"'){
+        return (int)strlen(p) == etag_len && memcmp(p, etag, etag_len) == 0;
+    }
+    if (p[0] == 'W' && p[1] == '/') return false;
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* rest = strptime(p, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return rest && *rest == '\0' && timegm(&tm) == mtime;
+}
+
+// 范围的三种写法：first-last、first-（到文件末尾）、-suffix（最后suffix个字节）。
+// 超出文件的部分截掉，完全在文件之外的范围丢掉；一个范围的语法错误让整个Range被忽略
+int http_conn::parse_range(const char* value, off_t size, byte_range* ranges)
+{
+    if (strncasecmp(value, "bytes=", 6) != 0) return -1;
+    const char* p = value + 6;
+    int count = 0, specs = 0;
+    while (true){
+        while (*p == ' ' || *p == '\t') ++p;
+        if (*p == ',') { ++p; continue; }
+        if (*p == '\0') break;
+        if (++specs > MAX_RANGES) return -1;
+
+        off_t first = -1, last = -1;
+        if (*p >= '0' && *p <= '9'){
+            for (first = 0; *p >= '0' && *p <= '9'; ++p){
+                if (first > (LLONG_MAX - 9) / 10) return -1;
+                first = first * 10 + (*p - '0');
+            }
+        }
+        if (*p++ != '-') return -1;
+        if (*p >= '0' && *p <= '9'){
+            for (last = 0; *p >= '0' && *p <= '9'; ++p){
+                if (last > (LLONG_MAX - 9) / 10) return -1;
+                last = last * 10 + (*p - '0');
+            }
+        }
+        while (*p == ' ' || *p == '\t') ++p;
+        if (*p != ',' && *p != '\0') return -1;
+
+        if (first == -1){
+            // 后缀范围
+            if (last == -1) return -1;
+            if (last == 0 || size == 0) continue;
+            first = last >= size ? 0 : size - last;
+            last = size - 1;
+        }else{
+            if (last != -1 && last < first) return -1;
+            if (first >= size) continue;
+            if (last == -1 || last >= size) last = size - 1;
+        }
+        ranges[count].first = first;
+        ranges[count].last = last;
+        ++count;
+    }
+    return specs == 0 ? -1 : count;
+}
+
+// 单个范围：一个响应，内容从内存中的文件或用带偏移的sendfile发送。
+// 多个范围：multipart/byteranges，每段的分隔行和段头是一项，后面跟这一段的内容，最后一项是结束分隔行并持有文件，
+// 所以每段都走和整个文件相同的零拷贝路径，只是偏移和长度不同。
+// 所有现场生成的头都写在写缓冲中，写不下或者响应队列放不下所有的段时忽略Range，发送整个文件
+int http_conn::add_ranges()
+{
+    if (!reserve_write_buf()) return -1;
+    off_t size = m_file_stat.st_size;
+    char etag[64];
+    const char* tag = etag;
+    int etag_len;
+    if (m_file){
+        tag = m_file->etag.data();
+        etag_len = m_file->etag.size();
+    }else{
+        etag_len = format_etag(etag, sizeof(etag), m_file_stat, NULL);
+    }
+    if (m_if_range && (etag_len <= 0 || !if_range_matches(tag, etag_len, m_file_stat.st_mtime))) return 0;
+
+    byte_range ranges[MAX_RANGES];
+    int n = parse_range(m_range, size, ranges);
+    if (n < 0) return 0;
+    bool vary = false;
+    for (int i = 0; m_file && i < ENCODING_COUNT; ++i){
+        if (m_file->variants[i].size > 0) vary = true;
+    }
+    const char* connection = m_linger ? connection_keep_alive : connection_close;
+    char* buf = m_write_buf + m_write_idx;
+    int room = m_write_size - m_write_idx;
+    http_response* r = &m_responses[m_resp_count];
+
+    if (n == 0){
+        // 没有一个范围落在文件内
+        int len = snprintf(buf, room, "HTTP/1.1 416 %s\r\nContent-Length: 0\r\nContent-Range: bytes */%lld\r\n%s",
+                           error_416_title, (long long)size, connection);
+        if (len < 0 || len >= room) return 0;
+        release_file(m_file_fd, m_file);
+        r->iv[0].iov_base = buf;
+        r->iv[0].iov_len = len;
+        r->iv_count = 1;
+        m_write_idx += len;
+        ++m_resp_count;
+        metrics::count_status(416);
+        return 1;
+    }
+    if (m_resp_count + (n > 1 ? n + 1 : 1) > MAX_PIPELINE) return 0;
+
+    // 小文件的内容已经在内存中
+    const char* body = (m_file && size > 0 && m_file->body.size() == (size_t)size) ? m_file->body.data() : NULL;
+    const char* type = mime_lookup(m_url)->type;
+    char boundary[24];
+    off_t length = 0;
+    int used = 0;
+    if (n == 1){
+        length = ranges[0].last - ranges[0].first + 1;
+        used = snprintf(buf, room, "HTTP/1.1 206 %s\r\nContent-Length: %lld\r\nContent-Type:%s\r\n"
+                        "Content-Range: bytes %lld-%lld/%lld\r\n%s",
+                        partial_206_title, (long long)length, type,
+                        (long long)ranges[0].first, (long long)ranges[0].last, (long long)size,
+                        vary ? "Vary: Accept-Encoding\r\n" : "");
+    }else{
+        static std::atomic<unsigned long> boundary_seq(0);
+        snprintf(boundary, sizeof(boundary), "%016lx", (boundary_seq.fetch_add(1) + 1) * 0x9e3779b97f4a7c15UL);
+        // 先算出所有段头的长度，响应头中的Content-Length要包含它们
+        for (int i = 0; i < n; ++i){
+            length += snprintf(NULL, 0, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                               boundary, type, (long long)ranges[i].first, (long long)ranges[i].last, (long long)size);
+            length += ranges[i].last - ranges[i].first + 1;
+        }
+        length += snprintf(NULL, 0, "\r\n--%s--\r\n", boundary);
+        used = snprintf(buf, room, "HTTP/1.1 206 %s\r\nContent-Length: %lld\r\n"
+                        "Content-Type: multipart/byteranges; boundary=%s\r\n%s",
+                        partial_206_title, (long long)length, boundary, vary ? "Vary: Accept-Encoding\r\n" : "");
+    }
+    if (used < 0 || used >= room) return 0;
+    int len = format_validators(buf + used, room - used, m_file_stat, NULL);
+    if (len < 0) return 0;
+    used += len;
+    len = snprintf(buf + used, room - used, "%s", connection);
+    if (len < 0 || len >= room - used) return 0;
+    used += len;
+
+    // 第一项从响应头开始，多段时紧接着第一段的段头，它们在写缓冲中是连续的一块
+    char* block = buf;
+    for (int i = 0; i < n; ++i){
+        if (n > 1){
+            len = snprintf(buf + used, room - used, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                           boundary, type, (long long)ranges[i].first, (long long)ranges[i].last, (long long)size);
+            if (len < 0 || len >= room - used) return 0;
+            used += len;
+        }
+        r = &m_responses[m_resp_count + i];
+        r->iv_idx = 0;
+        r->iv[0].iov_base = block;
+        r->iv[0].iov_len = buf + used - block;
+        r->iv_count = 1;
+        r->file_fd = m_file_fd;
+        r->file = NULL;
+        r->file_offset = 0;
+        r->file_left = 0;
+        r->borrowed = n > 1;
+        r->owned = NULL;
+        r->linger = m_linger;
+        off_t count = ranges[i].last - ranges[i].first + 1;
+        if (body){
+            r->iv[1].iov_base = (void*)(body + ranges[i].first);
+            r->iv[1].iov_len = count;
+            r->iv_count = 2;
+        }else{
+            r->file_offset = ranges[i].first;
+            r->file_left = count;
+        }
+        block = buf + used;
+    }
+    if (n > 1){
+        len = snprintf(buf + used, room - used, "\r\n--%s--\r\n", boundary);
+        if (len < 0 || len >= room - used) return 0;
+        used += len;
+        r = &m_responses[m_resp_count + n];
+        r->iv_idx = 0;
+        r->iv[0].iov_base = block;
+        r->iv[0].iov_len = buf + used - block;
+        r->iv_count = 1;
+        r->file_offset = 0;
+        r->file_left = 0;
+        r->borrowed = false;
+        r->owned = NULL;
+        r->linger = m_linger;
+    }
+    // 最后一项持有文件，前面各段发完时不归还
+    r->file_fd = m_file_fd;
+    r->file = m_file;
+    r->borrowed = false;
+    m_file_fd = -1;
+    m_file = NULL;
+    m_write_idx += used;
+    m_resp_count += n > 1 ? n + 1 : 1;
+    metrics::count_status(206);
+    return 1;
+}
+
+// 逗号分隔的编码列表，每项可以带q值，q为0表示不接受；*表示没有单独列出的编码都接受
+unsigned char http_conn::parse_accept_encoding(const char* value, const char* end)
+{
+    unsigned char accepted = 0, refused = 0;
+    bool any = false;
+    const char* p = value;
+    while (p < end){
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+        const char* name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') ++p;
+        int name_len = p - name;
+        // 参数中只关心q
+        bool zero = false;
+        while (p < end && *p != ','){
+            if (*p == ';'){
+                ++p;
+                while (p < end && (*p == ' ' || *p == '\t')) ++p;
+                if (end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '='){
+                    p += 2;
+                    zero = p < end && *p == '0';
+                    for (; p < end && *p != ',' && *p != ';'; ++p){
+                        if (*p != '.' && *p != '0' && *p != ' ' && *p != '\t') zero = false;
+                    }
+                    continue;
+                }
+            }
+            ++p;
+        }
+        unsigned char bits = 0;
+        if (name_len == 1 && name[0] == '*'){
+            any = !zero;
+            continue;
+        }
+        for (int i = 0; i < ENCODING_COUNT; ++i){
+            int n = strlen(encoding_names[i]);
+            if (name_len == n && strncasecmp(name, encoding_names[i], n) == 0) bits = 1 << i;
+        }
+        if (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0) bits = 1 << ENCODING_GZIP;
+        if (zero) refused |= bits;
+        else accepted |= bits;
+    }
+    if (any) accepted |= (1 << ENCODING_COUNT) - 1;
+    return accepted & ~refused;
+}
+
+bool http_conn::format_error(HTTP_CODE ret)
 {
     switch (ret)
     {
@@ -559,35 +1620,27 @@ bool http_conn::process_write(HTTP_CODE ret)
             if(!add_content(error_403_form)) return false;
             break;
 
-        case FILE_REQUEST:
-            add_status_line(200, ok_200_title);
-            add_headers(m_file_stat.st_size);
-            m_iv[0].iov_base = m_write_buf;
-            m_iv[0].iov_len = m_write_idx;
-            m_iv[1].iov_base = m_file_address;
-            m_iv[1].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
-
-            bytes_to_send = m_write_idx + m_file_stat.st_size;
-            return true;
+        case SERVICE_UNAVAILABLE:
+            // 建议客户端一秒后重试
+            add_status_line(503, error_503_title);
+            add_response("Retry-After: %d\r\n", 1);
+            add_headers(strlen(error_503_form));
+            if(!add_content(error_503_form)) return false;
+            break;
 
         default: return false;
     }
-
-    m_iv[0].iov_base = m_write_buf;
-    m_iv[0].iov_len = m_write_idx;
-    m_iv_count = 1;
     return true;
 }
 
 // 往写缓冲中写入待发送的数据
 bool http_conn::add_response(const char* format, ...)
 {
-    if(m_write_idx >= WRITE_BUFFER_SIZE) return false;
+    if(m_write_idx >= m_write_size) return false;
     va_list arg_list;
     va_start(arg_list, format);
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-    if(len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx)) return false;
+    int len = vsnprintf(m_write_buf + m_write_idx, m_write_size - 1 - m_write_idx, format, arg_list);
+    if(len >= (m_write_size - 1 - m_write_idx)) return false;
     m_write_idx += len;
     va_end(arg_list);
 
@@ -602,10 +1655,8 @@ bool http_conn::add_status_line(int status, const char* title)
 
 bool http_conn::add_headers(int content_len)
 {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+    return add_content_length(content_len) && add_content_type() &&
+           add_linger() && add_blank_line();
 }
 
 bool http_conn::add_content_length(int content_len)
@@ -634,4 +1685,85 @@ bool http_conn::add_content_type()
 }
 
 
-#endif
\ No newline at end of file
+// 统计页面的响应头和内容放在同一个字符串中，由响应持有，Connection头部照常单独作为一块
+bool http_conn::add_stats(http_response* r)
+{
+    bool json = strstr(m_url, "format=json") != NULL;
+    std::string body;
+    metrics::report(&body, json);
+    char header[128];
+    int len = snprintf(header, sizeof(header), "HTTP/1.1 200 %s\r\nContent-Length: %d\r\nContent-Type:%s\r\n"
+                       "Cache-Control: no-store\r\n", ok_200_title, (int)body.size(),
+                       json ? "application/json" : "text/plain; charset=utf-8");
+    r->owned = new std::string(header, len);
+    r->owned->append(body);
+    r->iv[0].iov_base = &(*r->owned)[0];
+    r->iv[0].iov_len = len;
+    r->iv[1].iov_base = (void*)(m_linger ? connection_keep_alive : connection_close);
+    r->iv[1].iov_len = m_linger ? sizeof(connection_keep_alive) - 1 : sizeof(connection_close) - 1;
+    r->iv[2].iov_base = &(*r->owned)[len];
+    r->iv[2].iov_len = body.size();
+    r->iv_count = 3;
+    ++m_resp_count;
+    metrics::count_status(200);
+    return true;
+}
+
+// io_uring后端不保存客户端地址，这里统一用getpeername获取
+bool http_conn::stats_allowed() const
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(m_sockfd, (struct sockaddr*)&addr, &len) < 0 || addr.sin_family != AF_INET) return false;
+    return (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+}
+
+// 所有响应都以"HTTP/1.1 "加三位状态码开头，状态码直接从第一项的响应头中读出。
+// 记录的time_us暂时存放开始解析的时间，写出时换成完成的时间
+void http_conn::stage_access(int first, uint64_t start)
+{
+    // io_uring后端接受连接时没有地址，第一次需要时获取
+    if (m_address.sin_family != AF_INET){
+        socklen_t len = sizeof(m_address);
+        if (getpeername(m_sockfd, (struct sockaddr*)&m_address, &len) < 0) memset(&m_address, 0, sizeof(m_address));
+    }
+    access_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.time_us = start;
+    rec.addr = m_address.sin_addr.s_addr;
+    rec.port = m_address.sin_port;
+    rec.method = m_method;
+    const char* status = (const char*)m_responses[first].iv[0].iov_base + 9;
+    rec.status = (status[0] - '0') * 100 + (status[1] - '0') * 10 + (status[2] - '0');
+    for (int i = first; i < m_resp_count; ++i){
+        http_response* r = &m_responses[i];
+        for (int j = 0; j < r->iv_count; ++j) rec.bytes += r->iv[j].iov_len;
+        rec.bytes += r->file_left;
+        r->log_off = -1;
+    }
+    // 解析失败的请求可能没有URL
+    size_t url_len = m_url ? strlen(m_url) : 0;
+    rec.url_len = url_len < ACCESS_URL_MAX ? url_len : ACCESS_URL_MAX;
+    m_responses[m_resp_count - 1].log_off = m_access.size();
+    m_access.append((const char*)&rec, sizeof(rec));
+    if (rec.url_len) m_access.append(m_url, rec.url_len);
+}
+
+void http_conn::commit_access(http_response* r, uint64_t unsent)
+{
+    access_record rec;
+    memcpy(&rec, &m_access[r->log_off], sizeof(rec));
+    uint64_t latency = (metrics::now() - rec.time_us) / 1000;
+    rec.latency_us = latency < UINT32_MAX ? latency : UINT32_MAX;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec.time_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    if (unsent > 0){
+        rec.bytes -= unsent < rec.bytes ? unsent : rec.bytes;
+        rec.flags |= ACCESS_PARTIAL;
+    }
+    access_log::write(rec, &m_access[r->log_off + sizeof(rec)]);
+    r->log_off = -1;
+}
+
+#endif
@@ -0,0 +1,218 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86 1
+#endif
+
+// 解析器关心的请求头，其余的一律是HEADER_OTHER
+enum HEADER_NAME { HEADER_OTHER = 0, HEADER_HOST, HEADER_CONNECTION, HEADER_CONTENT_LENGTH, HEADER_ACCEPT_ENCODING,
+                   HEADER_IF_NONE_MATCH, HEADER_IF_MODIFIED_SINCE, HEADER_RANGE, HEADER_IF_RANGE };
+
+/*
+    HTTP请求扫描器：在读缓冲中查找行结束符和请求头的冒号，并识别请求头名称。
+    查找按16字节（SSE4.2）或32字节（AVX2）一步进行，启动时根据CPU支持的指令集选择实现，
+    不支持时使用逐字节的标量实现。扫描的都是[p, end)区间，不依赖'\0'结尾，缓冲中出现'\0'也不会提前停止。
+*/
+class http_scan {
+public:
+    enum ISA { SCALAR = 0, SSE42, AVX2 };
+
+    // 返回CPU支持的最快实现
+    static ISA best();
+    // 选择使用的实现，不支持的指令集退回到标量实现，返回实际使用的实现。默认已经选择了best()
+    static ISA select(ISA isa);
+    static ISA current() { return m_isa; }
+    static const char* name(ISA isa);
+
+    // 返回[p, end)中第一个'\r'或'\n'的位置，没有时返回end
+    static const char* find_eol(const char* p, const char* end) { return m_find_eol(p, end); }
+    // 返回[p, end)中第一个c的位置，没有时返回end
+    static const char* find_char(const char* p, const char* end, char c) { return m_find_char(p, end, c); }
+    // 识别请求头名称，不区分大小写
+    static HEADER_NAME lookup(const char* name, int len);
+
+private:
+    static const char* find_eol_scalar(const char* p, const char* end);
+    static const char* find_char_scalar(const char* p, const char* end, char c);
+#ifdef HTTP_SCAN_X86
+    static const char* find_eol_sse42(const char* p, const char* end);
+    static const char* find_char_sse42(const char* p, const char* end, char c);
+    static const char* find_eol_avx2(const char* p, const char* end);
+    static const char* find_char_avx2(const char* p, const char* end, char c);
+#endif
+    // 按8字节一组不区分大小写地比较，lower必须是小写的请求头名称
+    static bool equals_lower(const char* s, const char* lower, int len);
+
+private:
+    static ISA m_isa;
+    static const char* (*m_find_eol)(const char*, const char*);
+    static const char* (*m_find_char)(const char*, const char*, char);
+};
+
+http_scan::ISA http_scan::m_isa = http_scan::SCALAR;
+const char* (*http_scan::m_find_eol)(const char*, const char*) = http_scan::find_eol_scalar;
+const char* (*http_scan::m_find_char)(const char*, const char*, char) = http_scan::find_char_scalar;
+
+// 程序启动时选择最快的实现
+static http_scan::ISA http_scan_initial_isa = http_scan::select(http_scan::best());
+
+http_scan::ISA http_scan::best()
+{
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return AVX2;
+    if(__builtin_cpu_supports("sse4.2")) return SSE42;
+#endif
+    return SCALAR;
+}
+
+http_scan::ISA http_scan::select(ISA isa)
+{
+    if(isa > best()) isa = SCALAR;
+    switch(isa) {
+#ifdef HTTP_SCAN_X86
+        case AVX2:
+            m_find_eol = find_eol_avx2;
+            m_find_char = find_char_avx2;
+            break;
+        case SSE42:
+            m_find_eol = find_eol_sse42;
+            m_find_char = find_char_sse42;
+            break;
+#endif
+        default:
+            isa = SCALAR;
+            m_find_eol = find_eol_scalar;
+            m_find_char = find_char_scalar;
+            break;
+    }
+    m_isa = isa;
+    return isa;
+}
+
+const char* http_scan::name(ISA isa)
+{
+    switch(isa) {
+        case AVX2: return "avx2";
+        case SSE42: return "sse4.2";
+        default: return "scalar";
+    }
+}
+
+const char* http_scan::find_eol_scalar(const char* p, const char* end)
+{
+    for(; p < end; ++p) {
+        if(*p == '\r' || *p == '\n') return p;
+    }
+    return end;
+}
+
+const char* http_scan::find_char_scalar(const char* p, const char* end, char c)
+{
+    const char* r = (const char*)memchr(p, c, end - p);
+    return r ? r : end;
+}
+
+#ifdef HTTP_SCAN_X86
+// PCMPESTRI一次比较16字节与一个字符集合，长度显式给出，不会在'\0'处停止
+__attribute__((target("sse4.2")))
+const char* http_scan::find_eol_sse42(const char* p, const char* end)
+{
+    const __m128i set = _mm_setr_epi8('\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    while(end - p >= 16) {
+        __m128i data = _mm_loadu_si128((const __m128i*)p);
+        int i = _mm_cmpestri(set, 2, data, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if(i < 16) return p + i;
+        p += 16;
+    }
+    return find_eol_scalar(p, end);
+}
+
+__attribute__((target("sse4.2")))
+const char* http_scan::find_char_sse42(const char* p, const char* end, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    while(end - p >= 16) {
+        __m128i data = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(data, needle));
+        if(mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_char_scalar(p, end, c);
+}
+
+__attribute__((target("avx2")))
+const char* http_scan::find_eol_avx2(const char* p, const char* end)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    while(end - p >= 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(data, cr), _mm256_cmpeq_epi8(data, lf));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if(mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return find_eol_sse42(p, end);
+}
+
+__attribute__((target("avx2")))
+const char* http_scan::find_char_avx2(const char* p, const char* end, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    while(end - p >= 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i*)p);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(data, needle));
+        if(mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return find_char_sse42(p, end, c);
+}
+#endif
+
+// 请求头名称只含字母、数字和'-'，把每个字节的0x20位置1就能把大写字母转成小写，'-'和数字不受影响。
+// 非法字符可能被误判为相等，但它们本来就不会出现在解析器关心的名称中
+bool http_scan::equals_lower(const char* s, const char* lower, int len)
+{
+    const uint64_t fold = 0x2020202020202020ULL;
+    while(len >= 8) {
+        uint64_t a, b;
+        memcpy(&a, s, 8);
+        memcpy(&b, lower, 8);
+        if((a | fold) != b) return false;
+        s += 8;
+        lower += 8;
+        len -= 8;
+    }
+    while(len > 0) {
+        if((*s | 0x20) != *lower) return false;
+        ++s;
+        ++lower;
+        --len;
+    }
+    return true;
+}
+
+// 以长度为键的完美哈希：解析器关心的名称长度各不相同，按长度直接定位唯一的候选，只做一次比较。
+// 以后加入同样长度的名称时，再在对应分支里按首字母区分
+HEADER_NAME http_scan::lookup(const char* name, int len)
+{
+    switch(len) {
+        case 4: return equals_lower(name, "host", 4) ? HEADER_HOST : HEADER_OTHER;
+        case 5: return equals_lower(name, "range", 5) ? HEADER_RANGE : HEADER_OTHER;
+        case 8: return equals_lower(name, "if-range", 8) ? HEADER_IF_RANGE : HEADER_OTHER;
+        case 10: return equals_lower(name, "connection", 10) ? HEADER_CONNECTION : HEADER_OTHER;
+        case 14: return equals_lower(name, "content-length", 14) ? HEADER_CONTENT_LENGTH : HEADER_OTHER;
+        case 13: return equals_lower(name, "if-none-match", 13) ? HEADER_IF_NONE_MATCH : HEADER_OTHER;
+        case 15: return equals_lower(name, "accept-encoding", 15) ? HEADER_ACCEPT_ENCODING : HEADER_OTHER;
+        case 17: return equals_lower(name, "if-modified-since", 17) ? HEADER_IF_MODIFIED_SINCE : HEADER_OTHER;
+        default: return HEADER_OTHER;
+    }
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+#include <string.h>
+#include <strings.h>
+
+// 扩展名到MIME类型的映射，compressible表示内容是文本类的，值得预先压缩
+struct mime_type {
+    const char* ext;
+    const char* type;
+    bool compressible;
+};
+
+static const mime_type mime_types[] = {
+    { "html",  "text/html; charset=utf-8",              true  },
+    { "htm",   "text/html; charset=utf-8",              true  },
+    { "css",   "text/css; charset=utf-8",               true  },
+    { "js",    "text/javascript; charset=utf-8",        true  },
+    { "mjs",   "text/javascript; charset=utf-8",        true  },
+    { "json",  "application/json",                      true  },
+    { "map",   "application/json",                      true  },
+    { "xml",   "application/xml",                       true  },
+    { "txt",   "text/plain; charset=utf-8",             true  },
+    { "csv",   "text/csv; charset=utf-8",               true  },
+    { "md",    "text/markdown; charset=utf-8",          true  },
+    { "svg",   "image/svg+xml",                         true  },
+    { "ico",   "image/x-icon",                          true  },
+    { "wasm",  "application/wasm",                      true  },
+    { "ttf",   "font/ttf",                              true  },
+    { "otf",   "font/otf",                              true  },
+    { "woff",  "font/woff",                             false },
+    { "woff2", "font/woff2",                            false },
+    { "jpg",   "image/jpeg",                            false },
+    { "jpeg",  "image/jpeg",                            false },
+    { "png",   "image/png",                             false },
+    { "gif",   "image/gif",                             false },
+    { "webp",  "image/webp",                            false },
+    { "avif",  "image/avif",                            false },
+    { "mp4",   "video/mp4",                             false },
+    { "webm",  "video/webm",                            false },
+    { "mp3",   "audio/mpeg",                            false },
+    { "pdf",   "application/pdf",                       false },
+    { "zip",   "application/zip",                       false },
+    { "gz",    "application/gzip",                      false },
+};
+
+// 未知扩展名按二进制内容处理，不压缩
+static const mime_type mime_default = { "", "application/octet-stream", false };
+
+// 按路径的扩展名查找MIME类型，只看最后一个路径分量，扩展名不区分大小写
+inline const mime_type* mime_lookup(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    const char* dot = strrchr(slash ? slash : path, '.');
+    if(!dot) {
+        return &mime_default;
+    }
+    ++dot;
+    for(size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); ++i) {
+        if(strcasecmp(dot, mime_types[i].ext) == 0) {
+            return &mime_types[i];
+        }
+    }
+    return &mime_default;
+}
+
+#endif
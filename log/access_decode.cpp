@@ -0,0 +1,67 @@
+// 访问日志解码工具：把服务器-a写出的二进制访问日志转成文本，每条记录一行
+// 编译：g++ -O2 log/access_decode.cpp -o access_decode
+// 运行：./access_decode [文件...]，没有文件或文件名是-时读标准输入
+//
+// 输出格式：完成时间 客户端地址:端口 方法 URL 状态码 字节数 延迟，连接中途关闭的请求在末尾加上partial，
+// 缓冲满时丢弃的记录输出为一行"N records dropped"。
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "access_log.h"
+
+// 解码一个文件，格式不对或记录不完整时返回false
+static bool decode(FILE* in, const char* name)
+{
+    access_file_header h;
+    if(fread(&h, sizeof(h), 1, in) != 1) {
+        fprintf(stderr, "%s: empty or truncated file\n", name);
+        return false;
+    }
+    if(memcmp(h.magic, ACCESS_MAGIC, 4) != 0 || h.version != ACCESS_VERSION || h.record_size != sizeof(access_record)) {
+        fprintf(stderr, "%s: not an access log of this version\n", name);
+        return false;
+    }
+    access_record rec;
+    std::vector<char> url(ACCESS_URL_MAX);
+    char line[ACCESS_URL_MAX + 256];
+    size_t n;
+    while((n = fread(&rec, 1, sizeof(rec), in)) == sizeof(rec)) {
+        if(rec.url_len > ACCESS_URL_MAX || (rec.url_len && fread(&url[0], rec.url_len, 1, in) != 1)) {
+            fprintf(stderr, "%s: truncated record\n", name);
+            return false;
+        }
+        int len = access_log::format(rec, &url[0], line, sizeof(line));
+        if(len > 0) fwrite(line, 1, len < (int)sizeof(line) ? len : sizeof(line) - 1, stdout);
+    }
+    // 服务器被杀死时最后一批可能只写了一部分
+    if(n != 0) {
+        fprintf(stderr, "%s: truncated record\n", name);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    bool ok = true;
+    if(argc < 2) {
+        ok = decode(stdin, "stdin");
+    }
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "-") == 0) {
+            ok = decode(stdin, "stdin") && ok;
+            continue;
+        }
+        FILE* in = fopen(argv[i], "rb");
+        if(!in) {
+            perror(argv[i]);
+            ok = false;
+            continue;
+        }
+        ok = decode(in, argv[i]) && ok;
+        fclose(in);
+    }
+    return ok ? 0 : 1;
+}
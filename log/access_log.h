@@ -0,0 +1,362 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <exception>
+#include <atomic>
+#include <string>
+
+/*
+    访问日志。每个请求的响应发完（或连接中途关闭）时写一条定长的二进制记录，后面跟着URL。
+    记录先放进写它的线程自己的环形缓冲，只有一个生产者和一个消费者，不需要锁；
+    后台线程定期把所有缓冲中的记录收集成一组iovec，一次writev写进文件，然后按大小或时间轮转。
+    缓冲满时丢弃记录并计数，后台线程在文件中写一条丢弃标记，解码时能看出哪里缺了记录。
+
+    文件以access_file_header开头，之后是连续的记录，字节序是本机的。
+    各线程的记录按批交错写入，文件中的顺序不是严格的时间顺序，需要时按time_us排序。
+    log/access_decode.cpp把二进制日志转成文本。
+*/
+
+#define ACCESS_RING_SIZE (1 << 20)   // 每个线程的缓冲字节数，必须是2的幂
+#define ACCESS_URL_MAX 1024          // 记录中URL的最大长度，超过的部分截断
+#define ACCESS_FLUSH_US 100000       // 后台线程写文件的间隔
+#define ACCESS_MAX_IOV 64            // 一次writev最多的块数
+#define ACCESS_MAGIC "WSAL"
+#define ACCESS_VERSION 1
+
+// 文件头
+struct access_file_header {
+    char magic[4];          // ACCESS_MAGIC
+    uint32_t version;       // ACCESS_VERSION
+    uint32_t record_size;   // sizeof(access_record)，解码时检查
+    uint32_t reserved;
+};
+
+// 一条记录，后面紧跟url_len字节的URL，记录的总长度是sizeof(access_record) + url_len
+struct access_record {
+    uint64_t time_us;       // 响应发完的时间，Unix时间的微秒数
+    uint64_t bytes;         // 这个请求的响应实际发出的字节数，丢弃标记中是丢弃的记录数
+    uint32_t addr;          // 客户端IPv4地址，网络字节序
+    uint32_t latency_us;    // 从开始解析请求到最后一个字节交给内核的微秒数
+    uint16_t port;          // 客户端端口，网络字节序
+    uint16_t status;        // 响应状态码
+    uint16_t url_len;
+    uint8_t method;         // http_conn::METHOD
+    uint8_t flags;          // ACCESS_PARTIAL等
+};
+
+enum ACCESS_FLAG {
+    ACCESS_PARTIAL = 1,     // 连接在响应发完之前关闭了
+    ACCESS_DROPPED = 2      // 丢弃标记，不对应请求
+};
+
+// 和http_conn::METHOD的顺序一致
+static const char* const access_method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT" };
+
+class access_log {
+public:
+    // 打开日志文件并启动后台线程。rotate_bytes为0时不按大小轮转，rotate_seconds为0时不按时间轮转
+    static void init(const char* path, size_t rotate_bytes, int rotate_seconds);
+    // 写出所有缓冲中的记录，停止后台线程并关闭文件
+    static void shutdown();
+    // init之后不再改变，不需要原子读
+    static bool enabled() { return m_enabled; }
+
+    // 记录一个请求，url不要求以'\0'结尾
+    static void write(const access_record& rec, const char* url);
+    static uint64_t dropped(); // 所有线程丢弃的记录数
+
+    // 把一条记录格式化成一行文本，返回长度，解码工具使用
+    static int format(const access_record& rec, const char* url, char* buf, int size);
+
+private:
+    // 一个线程的环形缓冲，记录可以跨过缓冲末尾回绕。head只由所属线程写，tail只由后台线程写，分在不同的缓存行
+    struct ring {
+        alignas(64) std::atomic<uint64_t> head;
+        std::atomic<uint64_t> dropped;
+        alignas(64) std::atomic<uint64_t> tail;
+        ring* next;
+        char data[ACCESS_RING_SIZE];
+    };
+
+    static bool m_enabled;
+    static std::atomic<ring*> m_head;
+    static __thread ring* m_local;
+    static std::atomic<bool> m_running;
+    static pthread_t m_thread;
+
+    // 以下只由后台线程访问
+    static std::string m_path;
+    static int m_fd;
+    static size_t m_rotate_bytes;
+    static int m_rotate_seconds;
+    static size_t m_size; // 当前文件的大小
+    static time_t m_opened; // 当前文件开始写的时间
+
+    static ring* local() { return m_local ? m_local : attach(); }
+    static ring* attach();
+    static void copy_in(ring* r, uint64_t pos, const void* src, size_t len);
+    static bool open_file();
+    static void rotate();
+    static void* flusher(void* arg);
+    static void flush_once(uint64_t* reported);
+    static void write_all(struct iovec* iv, int n);
+};
+
+bool access_log::m_enabled = false;
+std::atomic<access_log::ring*> access_log::m_head(NULL);
+__thread access_log::ring* access_log::m_local = NULL;
+std::atomic<bool> access_log::m_running(false);
+pthread_t access_log::m_thread;
+std::string access_log::m_path;
+int access_log::m_fd = -1;
+size_t access_log::m_rotate_bytes = 0;
+int access_log::m_rotate_seconds = 0;
+size_t access_log::m_size = 0;
+time_t access_log::m_opened = 0;
+
+void access_log::init(const char* path, size_t rotate_bytes, int rotate_seconds)
+{
+    m_path = path;
+    m_rotate_bytes = rotate_bytes;
+    m_rotate_seconds = rotate_seconds;
+    if(!open_file()) {
+        throw std::exception();
+    }
+    m_running.store(true);
+    if(pthread_create(&m_thread, NULL, flusher, NULL) != 0) {
+        m_running.store(false);
+        close(m_fd);
+        throw std::exception();
+    }
+    m_enabled = true;
+}
+
+void access_log::shutdown()
+{
+    if(!m_running.exchange(false)) {
+        return;
+    }
+    pthread_join(m_thread, NULL);
+}
+
+access_log::ring* access_log::attach()
+{
+    ring* r = new ring;
+    r->head.store(0, std::memory_order_relaxed);
+    r->tail.store(0, std::memory_order_relaxed);
+    r->dropped.store(0, std::memory_order_relaxed);
+    ring* head = m_head.load(std::memory_order_relaxed);
+    do {
+        r->next = head;
+    } while(!m_head.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+    m_local = r;
+    return r;
+}
+
+void access_log::copy_in(ring* r, uint64_t pos, const void* src, size_t len)
+{
+    size_t off = pos & (ACCESS_RING_SIZE - 1);
+    size_t first = len < ACCESS_RING_SIZE - off ? len : ACCESS_RING_SIZE - off;
+    memcpy(r->data + off, src, first);
+    memcpy(r->data, (const char*)src + first, len - first);
+}
+
+void access_log::write(const access_record& rec, const char* url)
+{
+    ring* r = local();
+    access_record head_rec = rec;
+    if(head_rec.url_len > ACCESS_URL_MAX) head_rec.url_len = ACCESS_URL_MAX;
+    size_t len = sizeof(head_rec) + head_rec.url_len;
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    if(head + len - r->tail.load(std::memory_order_acquire) > ACCESS_RING_SIZE) {
+        // 缓冲满了，丢弃这条记录，只有所属线程写这个计数
+        r->dropped.store(r->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    copy_in(r, head, &head_rec, sizeof(head_rec));
+    copy_in(r, head + sizeof(head_rec), url, head_rec.url_len);
+    r->head.store(head + len, std::memory_order_release);
+}
+
+uint64_t access_log::dropped()
+{
+    uint64_t total = 0;
+    for(ring* r = m_head.load(std::memory_order_acquire); r; r = r->next) {
+        total += r->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+int access_log::format(const access_record& rec, const char* url, char* buf, int size)
+{
+    time_t sec = rec.time_us / 1000000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    if(rec.flags & ACCESS_DROPPED) {
+        return snprintf(buf, size, "%s.%06u - %llu records dropped\n", when, (unsigned)(rec.time_us % 1000000),
+                        (unsigned long long)rec.bytes);
+    }
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in;
+    in.s_addr = rec.addr;
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+    const char* method = rec.method < sizeof(access_method_names) / sizeof(access_method_names[0]) ?
+                         access_method_names[rec.method] : "-";
+    return snprintf(buf, size, "%s.%06u %s:%u %s %.*s %u %llu %uus%s\n", when, (unsigned)(rec.time_us % 1000000),
+                    addr, ntohs(rec.port), method, rec.url_len ? (int)rec.url_len : 1, rec.url_len ? url : "-",
+                    rec.status, (unsigned long long)rec.bytes, rec.latency_us,
+                    (rec.flags & ACCESS_PARTIAL) ? " partial" : "");
+}
+
+// 打开日志文件，新文件先写文件头。文件已经存在时接着写，重启不会覆盖之前的记录
+bool access_log::open_file()
+{
+    m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(m_fd < 0) {
+        return false;
+    }
+    struct stat st;
+    m_size = fstat(m_fd, &st) == 0 ? st.st_size : 0;
+    m_opened = time(NULL);
+    if(m_size == 0) {
+        access_file_header h;
+        memcpy(h.magic, ACCESS_MAGIC, 4);
+        h.version = ACCESS_VERSION;
+        h.record_size = sizeof(access_record);
+        h.reserved = 0;
+        struct iovec iv = { &h, sizeof(h) };
+        write_all(&iv, 1);
+    }
+    return true;
+}
+
+// 当前文件改名为 path.年月日-时分秒，同一秒内轮转多次时再加上序号，然后打开新文件
+void access_log::rotate()
+{
+    char suffix[32];
+    struct tm tm;
+    time_t now = time(NULL);
+    localtime_r(&now, &tm);
+    strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &tm);
+    std::string base = m_path + suffix;
+    std::string target = base;
+    for(int i = 1; access(target.c_str(), F_OK) == 0; ++i) {
+        target = base + "." + std::to_string(i);
+    }
+    if(rename(m_path.c_str(), target.c_str()) < 0) {
+        // 改名失败时继续写原来的文件，下次再试
+        m_opened = now;
+        return;
+    }
+    int old = m_fd;
+    if(!open_file()) {
+        // 新文件打不开时继续写已经改名的文件，不丢记录
+        m_fd = old;
+        m_opened = now;
+        return;
+    }
+    close(old);
+}
+
+// 写出一组块，部分写入时从没写完的地方继续
+void access_log::write_all(struct iovec* iv, int n)
+{
+    while(n > 0) {
+        ssize_t written = writev(m_fd, iv, n);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return;
+        }
+        m_size += written;
+        while(n > 0 && (size_t)written >= iv->iov_len) {
+            written -= iv->iov_len;
+            ++iv;
+            --n;
+        }
+        if(n > 0) {
+            iv->iov_base = (char*)iv->iov_base + written;
+            iv->iov_len -= written;
+        }
+    }
+}
+
+// 收集所有缓冲中已经发布的记录一次writev写出，块数超过ACCESS_MAX_IOV时分几次
+void access_log::flush_once(uint64_t* reported)
+{
+    if((m_rotate_bytes && m_size >= m_rotate_bytes) ||
+       (m_rotate_seconds && time(NULL) - m_opened >= m_rotate_seconds)) {
+        rotate();
+    }
+
+    struct iovec iv[ACCESS_MAX_IOV];
+    ring* rings[ACCESS_MAX_IOV];
+    uint64_t heads[ACCESS_MAX_IOV];
+    int n = 0, count = 0;
+    access_record mark;
+    for(ring* r = m_head.load(std::memory_order_acquire); r; r = r->next) {
+        uint64_t tail = r->tail.load(std::memory_order_relaxed);
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        if(tail == head) continue;
+        if(n + 2 > ACCESS_MAX_IOV - 1) {
+            write_all(iv, n);
+            for(int i = 0; i < count; ++i) rings[i]->tail.store(heads[i], std::memory_order_release);
+            n = count = 0;
+        }
+        // 跨过缓冲末尾的部分分成两块
+        size_t off = tail & (ACCESS_RING_SIZE - 1);
+        size_t len = head - tail;
+        size_t first = len < ACCESS_RING_SIZE - off ? len : ACCESS_RING_SIZE - off;
+        iv[n].iov_base = r->data + off;
+        iv[n++].iov_len = first;
+        if(first < len) {
+            iv[n].iov_base = r->data;
+            iv[n++].iov_len = len - first;
+        }
+        rings[count] = r;
+        heads[count++] = head;
+    }
+    uint64_t total = dropped();
+    if(total != *reported) {
+        memset(&mark, 0, sizeof(mark));
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        mark.time_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        mark.bytes = total - *reported;
+        mark.flags = ACCESS_DROPPED;
+        iv[n].iov_base = &mark;
+        iv[n++].iov_len = sizeof(mark);
+        *reported = total;
+    }
+    if(n > 0) write_all(iv, n);
+    // 记录写出以后才能让生产者覆盖这些位置
+    for(int i = 0; i < count; ++i) rings[i]->tail.store(heads[i], std::memory_order_release);
+}
+
+void* access_log::flusher(void* arg)
+{
+    uint64_t reported = 0;
+    while(m_running.load(std::memory_order_relaxed)) {
+        usleep(ACCESS_FLUSH_US);
+        flush_once(&reported);
+    }
+    // 停止前把剩下的记录写完
+    flush_once(&reported);
+    close(m_fd);
+    m_fd = -1;
+    return arg;
+}
+
+#endif
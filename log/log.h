@@ -0,0 +1,274 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <exception>
+#include <atomic>
+
+/*
+    异步日志。每个线程第一次写日志时分配一个自己的环形缓冲，挂到无锁链表上；
+    写日志的线程在自己的缓冲中格式化一条记录后发布，只有一个生产者和一个消费者，不需要锁。
+    后台的刷新线程轮询所有缓冲，把记录攒成一大块后一次write写出。
+    缓冲满时丢弃新的记录并计数，写日志的线程永远不会等待；刷新线程发现有新的丢弃时写一条提示。
+
+    级别低于当前级别的日志在宏里就被跳过，参数不会求值，开销只是一次relaxed读和比较。
+    编译时定义LOG_COMPILE_LEVEL可以把更低级别的日志整个去掉，例如 -DLOG_COMPILE_LEVEL=1 去掉所有DEBUG日志。
+*/
+
+#define LOG_LINE_SIZE 256       // 一条记录的最大长度，超过的部分截断
+#define LOG_RING_SLOTS 256      // 每个线程缓冲的记录数，必须是2的幂
+#define LOG_BATCH_SIZE 65536    // 刷新线程一次write的最大字节数
+#define LOG_IDLE_US 10000       // 刷新线程没有记录可写时的休眠时间
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 0
+#endif
+
+#define LOG_AT(level, format, ...) \
+    do { \
+        if((level) >= LOG_COMPILE_LEVEL && logger::enabled(level)) logger::write(level, format, ##__VA_ARGS__); \
+    } while(0)
+
+#define LOG_DEBUG(format, ...) LOG_AT(logger::LEVEL_DEBUG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT(logger::LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...) LOG_AT(logger::LEVEL_WARN, format, ##__VA_ARGS__)
+#define LOG_ERROR(format, ...) LOG_AT(logger::LEVEL_ERROR, format, ##__VA_ARGS__)
+
+class logger {
+public:
+    // 日志级别，LEVEL_OFF关闭所有日志
+    enum LEVEL { LEVEL_DEBUG = 0, LEVEL_INFO, LEVEL_WARN, LEVEL_ERROR, LEVEL_OFF };
+
+    // 启动刷新线程，日志写到fd。没有启动时记录留在缓冲中，缓冲满后被丢弃
+    static void init(int fd, LEVEL level);
+    // 写出所有缓冲中的记录并停止刷新线程
+    static void shutdown();
+
+    static bool enabled(LEVEL level) { return level >= m_level.load(std::memory_order_relaxed); }
+    static void set_level(LEVEL level) { m_level.store(level, std::memory_order_relaxed); }
+    static LEVEL level() { return (LEVEL)m_level.load(std::memory_order_relaxed); }
+    // 运行时调整级别，只有一次原子写，可以在信号处理函数中调用
+    static void more_verbose();
+    static void less_verbose();
+    // 按名字解析级别，不认识时返回false
+    static bool parse_level(const char* name, LEVEL* level);
+
+    static void write(LEVEL level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+    static uint64_t dropped(); // 所有线程丢弃的记录数
+
+private:
+    struct slot {
+        uint32_t len;
+        char text[LOG_LINE_SIZE];
+    };
+
+    // 一个线程的环形缓冲，head只由所属线程写，tail只由刷新线程写，分在不同的缓存行
+    struct ring {
+        alignas(64) std::atomic<uint32_t> head;
+        std::atomic<uint64_t> dropped;
+        alignas(64) std::atomic<uint32_t> tail;
+        int id; // 线程的编号，按第一次写日志的顺序
+        ring* next;
+        slot slots[LOG_RING_SLOTS];
+    };
+
+    static std::atomic<int> m_level;
+    static std::atomic<ring*> m_head;
+    static std::atomic<int> m_next_id;
+    static __thread ring* m_local;
+    static int m_fd;
+    static std::atomic<bool> m_running;
+    static pthread_t m_thread;
+    static const char* const m_level_names[LEVEL_OFF];
+
+    static ring* local() { return m_local ? m_local : attach(); }
+    static ring* attach();
+    static int format_prefix(char* buf, int size, LEVEL level, int id);
+    static void* flusher(void* arg);
+    static bool flush_once(char* batch, uint64_t* reported);
+    static void write_all(const char* data, size_t len);
+};
+
+std::atomic<int> logger::m_level(logger::LEVEL_INFO);
+std::atomic<logger::ring*> logger::m_head(NULL);
+std::atomic<int> logger::m_next_id(0);
+__thread logger::ring* logger::m_local = NULL;
+int logger::m_fd = -1;
+std::atomic<bool> logger::m_running(false);
+pthread_t logger::m_thread;
+const char* const logger::m_level_names[logger::LEVEL_OFF] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+void logger::init(int fd, LEVEL level)
+{
+    m_fd = fd;
+    set_level(level);
+    m_running.store(true);
+    if(pthread_create(&m_thread, NULL, flusher, NULL) != 0) {
+        m_running.store(false);
+        throw std::exception();
+    }
+}
+
+void logger::shutdown()
+{
+    if(!m_running.exchange(false)) {
+        return;
+    }
+    pthread_join(m_thread, NULL);
+}
+
+void logger::more_verbose()
+{
+    int l = m_level.load(std::memory_order_relaxed);
+    if(l > LEVEL_DEBUG) m_level.store(l - 1, std::memory_order_relaxed);
+}
+
+void logger::less_verbose()
+{
+    int l = m_level.load(std::memory_order_relaxed);
+    if(l < LEVEL_OFF) m_level.store(l + 1, std::memory_order_relaxed);
+}
+
+bool logger::parse_level(const char* name, LEVEL* level)
+{
+    static const char* const names[LEVEL_OFF + 1] = { "debug", "info", "warn", "error", "off" };
+    for(int i = 0; i <= LEVEL_OFF; ++i) {
+        if(strcmp(name, names[i]) == 0) {
+            *level = (LEVEL)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+logger::ring* logger::attach()
+{
+    ring* r = new ring;
+    r->head.store(0, std::memory_order_relaxed);
+    r->tail.store(0, std::memory_order_relaxed);
+    r->dropped.store(0, std::memory_order_relaxed);
+    r->id = m_next_id.fetch_add(1);
+    ring* head = m_head.load(std::memory_order_relaxed);
+    do {
+        r->next = head;
+    } while(!m_head.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+    m_local = r;
+    return r;
+}
+
+// 时间精确到微秒。格式化年月日时分秒比较慢，每个线程缓存当前这一秒的结果
+int logger::format_prefix(char* buf, int size, LEVEL level, int id)
+{
+    static __thread time_t cached_sec = -1;
+    static __thread char cached[32];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if(ts.tv_sec != cached_sec) {
+        struct tm tm;
+        localtime_r(&ts.tv_sec, &tm);
+        strftime(cached, sizeof(cached), "%Y-%m-%d %H:%M:%S", &tm);
+        cached_sec = ts.tv_sec;
+    }
+    return snprintf(buf, size, "%s.%06ld %-5s [%d] ", cached, ts.tv_nsec / 1000, m_level_names[level], id);
+}
+
+void logger::write(LEVEL level, const char* format, ...)
+{
+    ring* r = local();
+    uint32_t head = r->head.load(std::memory_order_relaxed);
+    if(head - r->tail.load(std::memory_order_acquire) >= LOG_RING_SLOTS) {
+        // 缓冲满了，丢弃这条记录，只有所属线程写这个计数
+        r->dropped.store(r->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    slot* s = &r->slots[head & (LOG_RING_SLOTS - 1)];
+    // 末尾留出换行的位置
+    int len = format_prefix(s->text, LOG_LINE_SIZE - 1, level, r->id);
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(s->text + len, LOG_LINE_SIZE - 1 - len, format, args);
+    va_end(args);
+    if(n > 0) len += n < LOG_LINE_SIZE - 1 - len ? n : LOG_LINE_SIZE - 2 - len;
+    s->text[len++] = '\n';
+    s->len = len;
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+uint64_t logger::dropped()
+{
+    uint64_t total = 0;
+    for(ring* r = m_head.load(std::memory_order_acquire); r; r = r->next) {
+        total += r->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void logger::write_all(const char* data, size_t len)
+{
+    while(len > 0) {
+        ssize_t n = ::write(m_fd, data, len);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// 把所有缓冲中已经发布的记录攒成大块写出，返回是否写了记录
+bool logger::flush_once(char* batch, uint64_t* reported)
+{
+    size_t used = 0;
+    bool wrote = false;
+    for(ring* r = m_head.load(std::memory_order_acquire); r; r = r->next) {
+        uint32_t tail = r->tail.load(std::memory_order_relaxed);
+        uint32_t head = r->head.load(std::memory_order_acquire);
+        for(; tail != head; ++tail) {
+            const slot* s = &r->slots[tail & (LOG_RING_SLOTS - 1)];
+            if(used + s->len > LOG_BATCH_SIZE) {
+                write_all(batch, used);
+                used = 0;
+            }
+            memcpy(batch + used, s->text, s->len);
+            used += s->len;
+            wrote = true;
+        }
+        // 记录复制出来以后才能让生产者覆盖这些位置
+        r->tail.store(tail, std::memory_order_release);
+    }
+    uint64_t total = dropped();
+    if(total != *reported) {
+        // batch在LOG_BATCH_SIZE之后多留了128字节给这条提示
+        int n = snprintf(batch + used, 128,
+                         "log: %llu records dropped because the buffers were full\n", (unsigned long long)(total - *reported));
+        if(n > 0 && n < 128) used += n;
+        *reported = total;
+    }
+    if(used > 0) write_all(batch, used);
+    return wrote;
+}
+
+void* logger::flusher(void* arg)
+{
+    char* batch = new char[LOG_BATCH_SIZE + 128];
+    uint64_t reported = 0;
+    while(m_running.load(std::memory_order_relaxed)) {
+        if(!flush_once(batch, &reported)) {
+            usleep(LOG_IDLE_US);
+        }
+    }
+    // 停止前把剩下的记录写完
+    flush_once(batch, &reported);
+    delete [] batch;
+    return arg;
+}
+
+#endif
@@ -9,13 +9,17 @@
 #include <sys/epoll.h>
 #include <signal.h>
 #include <assert.h>
+#include <getopt.h>
+#include <vector>
 
 #include "http/http_conn.h"
 #include "locker/locker.h"
 #include "threadpool/threadpool.h"
-
-#define MAX_FD 65536
-#define MAX_EVENT_NUMBER 10000
+#include "reactor/reactor.h"
+#include "reactor/uring_reactor.h"
+#include "log/log.h"
+#include "log/access_log.h"
+#include "upgrade/upgrade.h"
 
 // 添加信号捕捉
 void addsig(int sig, void(handler)(int))
@@ -27,128 +31,320 @@ void addsig(int sig, void(handler)(int))
     assert( sigaction( sig, &sa, NULL ) != -1 );
 }
 
+// SIGUSR1让日志更详细，SIGUSR2让日志更简略，运行中不需要重启就能打开DEBUG日志
+void log_more(int) { logger::more_verbose(); }
+void log_less(int) { logger::less_verbose(); }
+
+// 用旧进程的缓存快照预热文件缓存，在后台进行，不推迟开始服务
+void* preload_cache(void* arg)
+{
+    std::vector<std::string>* urls = (std::vector<std::string>*)arg;
+    http_conn::m_file_cache->preload(*urls);
+    LOG_INFO("preloaded %d cached files from the previous process", (int)urls->size());
+    delete urls;
+    return NULL;
+}
+
+// Reactor都已经开始处理连接：通知旧进程排空，然后等待下一次升级
+void start_upgrade(const char* path, const std::vector<int>& listeners, int drain_ms)
+{
+    upgrade::confirm();
+    try{
+        upgrade::serve(path, listeners, http_conn::m_file_cache, drain_ms);
+    }catch(...)
+    {
+        LOG_ERROR("upgrade: cannot listen on %s", path);
+    }
+}
+
+// 监听socket已经交给新进程，主Reactor排空结束。等其他Reactor也结束后退出，
+// 工作线程可能还在处理超过期限被强制关闭的连接，不释放它们使用的共享对象
+void finish_upgrade(int reactor_number)
+{
+    upgrade::wait_drained(reactor_number);
+    LOG_INFO("upgrade: drained, exiting");
+    access_log::shutdown();
+    logger::shutdown();
+    exit(0);
+}
+
 // 添加文件描述符到epoll中
-extern void addfd(int epollfd, int fd, bool one_shot);
+extern void addfd(int epollfd, int fd, bool one_shot, bool edge_triggered);
 
 // 从epoll中删除文件描述符
 extern void removefd(int epollfd, int fd);
 
 // 修改文件描述符
-extern void modfd(int epollfd, int fd, int ev);
+extern void modfd(int epollfd, int fd, int ev, bool edge_triggered);
+
+// 打印用法并退出
+void usage(const char* name)
+{
+    printf("按照如下格式运行：%s port_number [-r reactor_number] [-q list|lockfree|stealing]\n"
+           "    [-t tick_ms] [-H header_timeout_ms] [-k idle_timeout_ms] [-c cache_mb]\n"
+           "    [-b max_header_kb] [-m lt|et] [-l backlog] [-d defer_accept_s] [-f fastopen_qlen]\n"
+           "    [-n max_conns] [-i epoll|uring] [-x pool|inline] [-v debug|info|warn|error|off]\n"
+           "    [-a access_log] [-S rotate_mb] [-T rotate_minutes]\n"
+           "    [-Q max_queue] [-L listener_limit] [-D codel_target_ms]\n"
+           "    [-U upgrade_socket] [-G drain_timeout_ms]\n", name);
+    exit(-1);
+}
 
 int main(int argc, char* argv[])
 {
     if( argc <=1)
     {
-        printf("按照如下格式运行：%s port_number\n", basename(argv[0]));
-        exit(-1);
+        usage(basename(argv[0]));
     }
     printf("port");
-    int port = atoi(argv[1]);
+
+    // -r 指定Reactor线程的数量，默认只有一个Reactor，运行在主线程中
+    // -q 指定线程池请求队列的实现，默认是加锁的list
+    // -t 指定时间轮滴答的毫秒数，-H 指定请求头期限，-k 指定keep-alive连接的空闲期限
+    // -c 指定文件缓存的容量(MB)，为0时不使用缓存。文本类文件的gzip/brotli变体在加载进缓存时生成，
+    //    需要编译时加上 -DUSE_GZIP -lz 和 -DUSE_BROTLI -lbrotlienc
+    // -b 指定请求头的长度上限(KB)，读缓冲从4KB开始按需翻倍到这个大小
+    // -m 指定连接socket的触发方式，lt是水平触发（默认），et是边沿触发，两种方式都使用EPOLLONESHOT
+    // -l 指定监听队列长度，-d 开启TCP_DEFER_ACCEPT并指定最多等待的秒数，-f 开启TCP Fast Open并指定队列长度
+    // -n 指定连接数上限，超过时新连接收到503后关闭
+    // -i 指定I/O后端，epoll是就绪模型加线程池（默认），uring是io_uring完成模型，命中缓存的请求在Reactor线程中直接处理
+    // -x 指定epoll后端在哪里处理请求，pool是全部交给线程池（默认），inline是命中缓存的文件、304和错误响应
+    //    在Reactor线程中处理并立即发送，只有需要访问磁盘的请求交给线程池
+    // -v 指定日志级别，默认info，运行中用SIGUSR1/SIGUSR2调整
+    // -a 指定二进制访问日志的文件，默认不记录，用log/access_decode转成文本。
+    //    -S 文件超过这个大小(MB)时轮转，默认64，-T 每隔这么多分钟轮转，默认不按时间轮转，两者为0时都表示不轮转
+    // -Q 线程池排队请求数的上限，-L 每个Reactor在途请求数的上限，-D 开启CoDel并指定目标排队时间(ms)，
+    //    超过时回复503和Retry-After。默认都不开启，只在线程池队列满时回复503。只对epoll后端有效
+    // -U 指定平滑升级用的Unix域socket路径。路径上有正在运行的进程时接管它的监听socket和缓存快照，
+    //    Reactor的数量和接管的监听socket一致，端口参数不再使用；之后在这个路径上等待下一个新进程。
+    //    -G 指定交出监听socket后排空连接的期限，默认30000
+    int reactor_number = 1;
+    threadpool<http_conn>::QUEUE_MODE queue_mode = threadpool<http_conn>::LIST_QUEUE;
+    reactor_options options;
+    options.tick_ms = 1000;
+    options.header_timeout_ms = 10000;
+    options.idle_timeout_ms = 15000;
+    options.backlog = 1024;
+    options.defer_accept_s = 0;
+    options.fastopen_qlen = 0;
+    options.max_conns = MAX_FD;
+    options.listener_limit = 0;
+    options.inline_requests = false;
+    int cache_mb = 256;
+    int max_header_kb = 8;
+    bool use_uring = false;
+    logger::LEVEL log_level = logger::LEVEL_INFO;
+    const char* access_path = NULL;
+    int rotate_mb = 64;
+    int rotate_minutes = 0;
+    int max_queue = 0;
+    int codel_target_ms = 0;
+    const char* upgrade_path = NULL;
+    int drain_ms = 30000;
+    int opt;
+    while((opt = getopt(argc, argv, "r:q:t:H:k:c:b:m:l:d:f:n:i:x:v:a:S:T:Q:L:D:U:G:")) != -1){
+        switch(opt){
+            case 'r': reactor_number = atoi(optarg); break;
+            case 't': options.tick_ms = atoi(optarg); break;
+            case 'H': options.header_timeout_ms = atoi(optarg); break;
+            case 'k': options.idle_timeout_ms = atoi(optarg); break;
+            case 'c': cache_mb = atoi(optarg); break;
+            case 'b': max_header_kb = atoi(optarg); break;
+            case 'l': options.backlog = atoi(optarg); break;
+            case 'd': options.defer_accept_s = atoi(optarg); break;
+            case 'f': options.fastopen_qlen = atoi(optarg); break;
+            case 'n': options.max_conns = atoi(optarg); break;
+            case 'a': access_path = optarg; break;
+            case 'S': rotate_mb = atoi(optarg); break;
+            case 'T': rotate_minutes = atoi(optarg); break;
+            case 'Q': max_queue = atoi(optarg); break;
+            case 'L': options.listener_limit = atoi(optarg); break;
+            case 'D': codel_target_ms = atoi(optarg); break;
+            case 'U': upgrade_path = optarg; break;
+            case 'G': drain_ms = atoi(optarg); break;
+            case 'm':
+                if(strcmp(optarg, "et") == 0) http_conn::m_edge_triggered = true;
+                else if(strcmp(optarg, "lt") != 0) usage(basename(argv[0]));
+                break;
+            case 'i':
+                if(strcmp(optarg, "uring") == 0) use_uring = true;
+                else if(strcmp(optarg, "epoll") != 0) usage(basename(argv[0]));
+                break;
+            case 'x':
+                if(strcmp(optarg, "inline") == 0) options.inline_requests = true;
+                else if(strcmp(optarg, "pool") != 0) usage(basename(argv[0]));
+                break;
+            case 'v':
+                if(!logger::parse_level(optarg, &log_level)) usage(basename(argv[0]));
+                break;
+            case 'q':
+                if(strcmp(optarg, "lockfree") == 0) queue_mode = threadpool<http_conn>::LOCKFREE_QUEUE;
+                else if(strcmp(optarg, "stealing") == 0) queue_mode = threadpool<http_conn>::WORK_STEALING;
+                else if(strcmp(optarg, "list") != 0) usage(basename(argv[0]));
+                break;
+            default: usage(basename(argv[0]));
+        }
+    }
+    if(optind >= argc || reactor_number <= 0 || options.tick_ms <= 0 || max_header_kb <= 0 ||
+       options.backlog <= 0 || options.max_conns <= 0 || options.max_conns > MAX_FD ||
+       rotate_mb < 0 || rotate_minutes < 0 || max_queue < 0 || options.listener_limit < 0 || codel_target_ms < 0 ||
+       drain_ms < 0){
+        usage(basename(argv[0]));
+    }
+    options.port = atoi(argv[optind]);
+    options.reuse_port = reactor_number > 1;
     
 
     // 对SIGPIPE信号进行处理
     addsig(SIGPIPE, SIG_IGN);
+    addsig(SIGUSR1, log_more);
+    addsig(SIGUSR2, log_less);
 
-    // 创建线程池并初始化
-    threadpool<http_conn>* pool = NULL;
-
-
+    // 日志由后台线程写到标准输出，请求处理线程只写自己的缓冲
     try{
-        pool = new threadpool<http_conn>();
+        logger::init(STDOUT_FILENO, log_level);
     }catch(...)
     {
-
         exit(-1);
     }
 
-    // 创建一个数组用于保存所有的客户端信息
-    http_conn* users = new http_conn[MAX_FD];
-
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    // 访问日志同样由后台线程批量写出，写记录的是发送响应的Reactor线程
+    if(access_path){
+        try{
+            access_log::init(access_path, (size_t)rotate_mb << 20, rotate_minutes * 60);
+        }catch(...)
+        {
+            printf("open access log %s failure!\n", access_path);
+            exit(-1);
+        }
+    }
 
+    // 从正在运行的旧进程接管监听socket
+    std::vector<int> listeners;
+    std::vector<std::string>* cached_urls = new std::vector<std::string>;
+    if(upgrade_path && upgrade::receive(upgrade_path, &listeners, cached_urls)){
+        if((int)listeners.size() != reactor_number){
+            LOG_INFO("upgrade: took over %d listeners, ignoring -r %d", (int)listeners.size(), reactor_number);
+        }
+        reactor_number = listeners.size();
+    }
+    listeners.resize(reactor_number, -1);
 
-    // 设置端口复用
-    int reuse = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    // 创建线程池并初始化，io_uring后端只用几个辅助线程处理需要访问磁盘的请求
+    threadpool<http_conn>* pool = NULL;
+    threadpool<uring_conn>* helpers = NULL;
 
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-    bind(listenfd, (struct sockaddr*)&address, sizeof(address));
+    try{
+        if(!use_uring) pool = new threadpool<http_conn>(8, 10000, queue_mode);
+        else helpers = new threadpool<uring_conn>(URING_HELPER_THREADS, 10000,
+                                                  (threadpool<uring_conn>::QUEUE_MODE)queue_mode);
+    }catch(...)
+    {
 
+        exit(-1);
+    }
 
-    listen(listenfd, 5);
+    // 准入控制，在线程池队列满之前就开始拒绝请求
+    if(!use_uring && (max_queue > 0 || options.listener_limit > 0 || codel_target_ms > 0)){
+        http_conn::m_admission = new admission(max_queue, codel_target_ms);
+    }
 
-    // 创建epoll对象， 事件数组， 添加
-    epoll_event events[MAX_EVENT_NUMBER];
-    int epollfd = epoll_create(5);
+    // 创建连接读写缓冲池，最小一级4KB，逐级翻倍直到请求头的长度上限
+    int buffer_classes = 1;
+    while(buffer_classes < BUFFER_POOL_MAX_CLASSES && (4 << (buffer_classes - 1)) < max_header_kb){
+        ++buffer_classes;
+    }
+    try{
+        http_conn::m_buffer_pool = new buffer_pool(4096, buffer_classes, 256);
+    }catch(...)
+    {
+        exit(-1);
+    }
 
-    // 将监听的文件描述符添加到epoll中
-    addfd(epollfd, listenfd, false);
-    http_conn::m_epollfd = epollfd;
+    // 预先生成错误响应
+    http_conn::init_responses();
 
-    while(true)
-    {
-        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-        if((num<0) && (errno != EINTR)){
-            printf("epoll failure!\n");
-            break;
+    // 创建文件缓存，缓存项数量的上限同时限制了缓存占用的文件描述符
+    if(cache_mb > 0){
+        try{
+            http_conn::m_file_cache = new file_cache(doc_root, (size_t)cache_mb << 20, 4096, http_conn::prepare_file);
+        }catch(...)
+        {
+            exit(-1);
         }
+    }
+    pthread_t preload_thread;
+    if(http_conn::m_file_cache && !cached_urls->empty() &&
+       pthread_create(&preload_thread, NULL, preload_cache, cached_urls) == 0){
+        pthread_detach(preload_thread);
+    }else{
+        delete cached_urls;
+    }
 
-        // 循环遍历事件数组
-        for(int i=0; i<num; ++i){
-            int sockfd = events[i].data.fd;
-            if(sockfd == listenfd){
-                // 有客户端连接进来
-                struct sockaddr_in client_address;
-                socklen_t client_addr_len = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addr_len);
-
-                if ( connfd < 0 ) {
-                    printf( "errno is: %d\n", errno );
-                    continue;
-                } 
-
-                // 连接成功
-                if(http_conn::m_user_cnt >= MAX_FD){
-                    // 目前连接数满了
-                    // 可以告诉客户端，服务器正忙
-                    close(connfd);
-                    continue;
-                }
-
-                // 将新的客户的数据初始化，放到数组中，将文件描述符当成索引
-                users[connfd].init(connfd, client_address);
-            }
-            else if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
-            // 对方异常断开或者错误等事件
-            {
-                users[sockfd].close_conn();
+    // io_uring后端：每个Reactor有自己的环和监听socket
+    if(use_uring){
+        std::vector<uring_reactor*> rings;
+        try{
+            for(int i=0; i<reactor_number; ++i){
+                rings.push_back(new uring_reactor(options, helpers, listeners[i]));
+                listeners[i] = rings[i]->listener();
             }
-            else if(events[i].events & EPOLLIN)
-            {
-                if(users[sockfd].read()){
-                    // 一次性把所有数据读完
-                    pool->append(users + sockfd);
-                }else{
-                    users[sockfd].close_conn();
-                }
-            }
-            else if(events[i].events & EPOLLOUT){
-                if(!users[sockfd].write()){ // 一次性写完所有数据
-                    users[sockfd].close_conn();
-                }
+            for(int i=1; i<reactor_number; ++i){
+                rings[i]->start();
             }
+        }catch(...)
+        {
+            printf("create io_uring reactor failure!\n");
+            exit(-1);
+        }
+        if(upgrade_path){
+            start_upgrade(upgrade_path, listeners, drain_ms);
         }
+        rings[0]->loop();
+        if(upgrade::draining()){
+            finish_upgrade(reactor_number);
+        }
+        delete rings[0];
+        delete http_conn::m_file_cache;
+        delete http_conn::m_buffer_pool;
+        access_log::shutdown();
+        logger::shutdown();
+        return 0;
+    }
 
+    // 创建Reactor，每个Reactor有自己的epoll和监听socket，多于一个时通过SO_REUSEPORT共享端口
+    std::vector<reactor*> reactors;
+    try{
+        for(int i=0; i<reactor_number; ++i){
+            reactors.push_back(new reactor(options, pool, listeners[i]));
+            listeners[i] = reactors[i]->listener();
+        }
+        // 第0个Reactor在主线程中运行，其余的各自创建一个线程
+        for(int i=1; i<reactor_number; ++i){
+            reactors[i]->start();
+        }
+    }catch(...)
+    {
+        printf("create reactor failure!\n");
+        exit(-1);
+    }
+
+    if(upgrade_path){
+        start_upgrade(upgrade_path, listeners, drain_ms);
+    }
+    reactors[0]->loop();
+    if(upgrade::draining()){
+        finish_upgrade(reactor_number);
     }
 
-    close(epollfd);
-    close(listenfd);
-    delete [] users;
+    // 主Reactor出错退出，其余Reactor线程随进程一起结束
+    delete reactors[0];
     delete pool;
+    delete http_conn::m_admission;
+    delete http_conn::m_file_cache;
+    delete http_conn::m_buffer_pool;
+    access_log::shutdown();
+    logger::shutdown();
 
     return 0;
 }
\ No newline at end of file
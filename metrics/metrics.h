@@ -0,0 +1,261 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+/*
+    运行时统计：计数器和各处理阶段的延迟直方图。
+    每个线程第一次记录时分配一块自己的统计区，挂到一个无锁链表上，之后只有这个线程写它，
+    所以更新不需要原子读改写，用relaxed的load和store即可；读取时遍历链表把各线程的值相加，同样不加锁。
+    线程不会退出，统计区也不释放。
+
+    直方图是HDR风格的对数线性分桶：小于HIST_SUB的值每个值一个桶，之后每个2的幂区间均分成HIST_SUB个桶，
+    相对误差不超过1/HIST_SUB。单位是纳秒，超过2^HIST_MAX_BITS纳秒（约68秒）的值都记在最后一个桶里。
+*/
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+class metrics {
+public:
+    // 计数器
+    enum COUNTER {
+        CONN_ACCEPTED = 0,  // 接受并分配了连接对象的连接
+        CONN_REJECTED,      // 连接数满时收到503后关闭的连接
+        CONN_CLOSED,        // 关闭的连接
+        REQUESTS,           // 解析出的完整请求
+        RING_ENTERS,        // io_uring_enter的调用次数，除以请求数就是每个请求的系统调用数，只有io_uring后端有
+        REQUESTS_SHED,      // 过载时没有处理、直接回复503的请求
+        RESPONSES_2XX,
+        RESPONSES_3XX,
+        RESPONSES_4XX,
+        RESPONSES_5XX,
+        BYTES_SENT,         // sendmsg和sendfile发出的字节数
+        COUNTER_COUNT
+    };
+
+    /*
+        请求经过的处理阶段
+        STAGE_ACCEPT    :   从accept返回到连接注册完毕
+        STAGE_PARSE     :   解析出一个完整的请求，不含do_request
+        STAGE_QUEUE     :   请求在线程池队列中等待的时间，只有epoll后端有
+        STAGE_REQUEST   :   do_request查找、打开文件
+        STAGE_WRITE     :   响应进入发送队列到最后一个字节交给内核
+    */
+    enum STAGE { STAGE_ACCEPT = 0, STAGE_PARSE, STAGE_QUEUE, STAGE_REQUEST, STAGE_WRITE, STAGE_COUNT };
+
+    // 单调时钟的纳秒数，在vDSO中完成，不进入内核
+    static uint64_t now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+    static void count(COUNTER c, uint64_t n = 1) { add(&local()->counters[c], n); }
+    static void count_status(int status); // 按状态码的类别计数
+    static void record(STAGE s, uint64_t ns); // 记录一次阶段耗时
+
+    // 汇总所有线程的统计，生成文本或JSON格式的报告，追加到out
+    static void report(std::string* out, bool json);
+    // 直方图的分桶，bench/loadgen.cpp按同样的方式统计客户端看到的延迟
+    static int bucket_index(uint64_t v);
+    static uint64_t bucket_value(int index); // 桶中的最大值
+
+private:
+    struct histogram {
+        std::atomic<uint64_t> buckets[HIST_BUCKETS];
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+    };
+
+    // 一个线程的统计区
+    struct thread_stats {
+        std::atomic<uint64_t> counters[COUNTER_COUNT];
+        histogram stages[STAGE_COUNT];
+        thread_stats* next;
+    };
+
+    // 汇总后的一个阶段
+    struct stage_summary {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[HIST_BUCKETS];
+    };
+
+    static std::atomic<thread_stats*> m_head; // 所有线程的统计区
+    static __thread thread_stats* m_local; // 本线程的统计区
+    static uint64_t m_start; // 进程启动的时间
+
+    static thread_stats* local()
+    {
+        return m_local ? m_local : attach();
+    }
+    static thread_stats* attach(); // 为本线程分配统计区并挂到链表上
+    // 只有所属线程写，不需要原子加
+    static void add(std::atomic<uint64_t>* v, uint64_t n)
+    {
+        v->store(v->load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static uint64_t percentile(const stage_summary& s, double q);
+    static void summarize(STAGE stage, stage_summary* s);
+};
+
+static const char* const counter_names[metrics::COUNTER_COUNT] = {
+    "connections_accepted", "connections_rejected", "connections_closed", "requests", "ring_enters", "requests_shed",
+    "responses_2xx", "responses_3xx", "responses_4xx", "responses_5xx", "bytes_sent"
+};
+static const char* const stage_names[metrics::STAGE_COUNT] = { "accept", "parse", "queue", "request", "write" };
+
+std::atomic<metrics::thread_stats*> metrics::m_head(NULL);
+__thread metrics::thread_stats* metrics::m_local = NULL;
+uint64_t metrics::m_start = metrics::now();
+
+metrics::thread_stats* metrics::attach()
+{
+    // 统计区全部清零，直方图较大，不放在线程栈上
+    thread_stats* s = new thread_stats;
+    memset((void*)s, 0, sizeof(*s));
+    thread_stats* head = m_head.load(std::memory_order_relaxed);
+    do {
+        s->next = head;
+    } while(!m_head.compare_exchange_weak(head, s, std::memory_order_release, std::memory_order_relaxed));
+    m_local = s;
+    return s;
+}
+
+void metrics::count_status(int status)
+{
+    switch(status / 100) {
+        case 2: count(RESPONSES_2XX); break;
+        case 3: count(RESPONSES_3XX); break;
+        case 4: count(RESPONSES_4XX); break;
+        case 5: count(RESPONSES_5XX); break;
+        default: break;
+    }
+}
+
+void metrics::record(STAGE s, uint64_t ns)
+{
+    histogram* h = &local()->stages[s];
+    add(&h->buckets[bucket_index(ns)], 1);
+    add(&h->sum, ns);
+    if(ns > h->max.load(std::memory_order_relaxed)) {
+        h->max.store(ns, std::memory_order_relaxed);
+    }
+}
+
+// v在[2^k, 2^(k+1))中时，k-HIST_SUB_BITS就是这一段每个桶的宽度的对数，桶号是它乘HIST_SUB再加上v的高位
+int metrics::bucket_index(uint64_t v)
+{
+    if(v < HIST_SUB) {
+        return (int)v;
+    }
+    if(v >> HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return shift * HIST_SUB + (int)(v >> shift);
+}
+
+uint64_t metrics::bucket_value(int index)
+{
+    if(index < HIST_SUB) {
+        return index;
+    }
+    int shift = index / HIST_SUB - 1;
+    uint64_t low = (uint64_t)(index - shift * HIST_SUB) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+void metrics::summarize(STAGE stage, stage_summary* s)
+{
+    memset(s, 0, sizeof(*s));
+    for(thread_stats* t = m_head.load(std::memory_order_acquire); t; t = t->next) {
+        const histogram& h = t->stages[stage];
+        for(int i = 0; i < HIST_BUCKETS; ++i) {
+            uint64_t n = h.buckets[i].load(std::memory_order_relaxed);
+            s->buckets[i] += n;
+            s->count += n;
+        }
+        s->sum += h.sum.load(std::memory_order_relaxed);
+        uint64_t max = h.max.load(std::memory_order_relaxed);
+        if(max > s->max) s->max = max;
+    }
+}
+
+// 第ceil(q*count)个值所在的桶，报告桶的上界，但不超过实际的最大值
+uint64_t metrics::percentile(const stage_summary& s, double q)
+{
+    if(s.count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * s.count);
+    if(rank < q * s.count || rank == 0) ++rank;
+    uint64_t seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += s.buckets[i];
+        if(seen >= rank) {
+            uint64_t v = bucket_value(i);
+            return v < s.max ? v : s.max;
+        }
+    }
+    return s.max;
+}
+
+void metrics::report(std::string* out, bool json)
+{
+    uint64_t counters[COUNTER_COUNT];
+    memset(counters, 0, sizeof(counters));
+    for(thread_stats* t = m_head.load(std::memory_order_acquire); t; t = t->next) {
+        for(int i = 0; i < COUNTER_COUNT; ++i) {
+            counters[i] += t->counters[i].load(std::memory_order_relaxed);
+        }
+    }
+    // 各线程的计数不是同一时刻读到的，关闭数可能暂时多于接受数
+    uint64_t open = counters[CONN_ACCEPTED] > counters[CONN_CLOSED] ? counters[CONN_ACCEPTED] - counters[CONN_CLOSED] : 0;
+    unsigned long long uptime_ms = (now() - m_start) / 1000000;
+
+    char line[256];
+    if(json) {
+        snprintf(line, sizeof(line), "{\"uptime_ms\":%llu,\"counters\":{\"connections_open\":%llu", uptime_ms,
+                 (unsigned long long)open);
+    }else{
+        snprintf(line, sizeof(line), "uptime_ms %llu\nconnections_open %llu\n", uptime_ms, (unsigned long long)open);
+    }
+    out->append(line);
+    for(int i = 0; i < COUNTER_COUNT; ++i) {
+        snprintf(line, sizeof(line), json ? ",\"%s\":%llu" : "%s %llu\n", counter_names[i], (unsigned long long)counters[i]);
+        out->append(line);
+    }
+    out->append(json ? "},\"stages\":{" : "\nstage    count        mean_ns      p50_ns       p90_ns       p99_ns       p999_ns      max_ns\n");
+
+    // 汇总数组约8KB，不放在栈上
+    stage_summary* s = new stage_summary;
+    for(int i = 0; i < STAGE_COUNT; ++i) {
+        summarize((STAGE)i, s);
+        unsigned long long mean = s->count ? s->sum / s->count : 0;
+        unsigned long long p50 = percentile(*s, 0.5), p90 = percentile(*s, 0.9);
+        unsigned long long p99 = percentile(*s, 0.99), p999 = percentile(*s, 0.999);
+        if(json) {
+            snprintf(line, sizeof(line), "%s\"%s\":{\"count\":%llu,\"mean_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,"
+                     "\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}", i ? "," : "", stage_names[i],
+                     (unsigned long long)s->count, mean, p50, p90, p99, p999, (unsigned long long)s->max);
+        }else{
+            snprintf(line, sizeof(line), "%-8s %-12llu %-12llu %-12llu %-12llu %-12llu %-12llu %llu\n", stage_names[i],
+                     (unsigned long long)s->count, mean, p50, p90, p99, p999, (unsigned long long)s->max);
+        }
+        out->append(line);
+    }
+    delete s;
+    if(json) out->append("}}\n");
+}
+
+#endif
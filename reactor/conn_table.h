@@ -0,0 +1,115 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <new>
+#include <exception>
+
+#define CONN_CHUNK_BITS 8
+#define CONN_CHUNK_SIZE (1 << CONN_CHUNK_BITS)  // 每次分配的连接对象数
+
+/*
+    连接表：从fd找到连接对象。
+    fd到连接对象的映射是一个指针数组，查找只需一次访存，用calloc分配，没有用到的页不占物理内存。
+    连接对象按块连续分配，第一次需要时才分配一块，之后放回空闲栈重复使用，最近释放的对象最先被复用，它们多半还在缓存中。
+    每个Reactor有自己的连接表，只在Reactor线程中修改，不需要加锁。
+*/
+template<typename T>
+class conn_table {
+public:
+    /*max_fd是fd的上限，fd必须小于它*/
+    conn_table( int max_fd );
+    ~conn_table();
+
+    // fd上的连接对象，没有时返回NULL
+    T* get( int fd ) const
+    {
+        if( fd < 0 || fd >= m_max_fd ) {
+            return NULL;
+        }
+        return m_conns[fd];
+    }
+    // 为fd分配一个连接对象，内存不足时返回NULL
+    T* attach( int fd );
+    // 连接关闭后归还fd上的连接对象
+    void detach( int fd );
+
+    int size() const { return m_used; }
+    int max_fd() const { return m_max_fd; } // 遍历所有连接时fd的上限
+
+private:
+    int m_max_fd;
+    T** m_conns;            // 以fd为下标，NULL表示没有连接
+    T** m_chunks;           // 已经分配的对象块
+    int m_chunk_count;
+    T** m_free;             // 空闲对象栈
+    int m_free_count;
+    int m_used;             // 正在使用的连接对象数
+};
+
+template<typename T>
+conn_table<T>::conn_table( int max_fd ) : m_max_fd( max_fd ), m_chunk_count( 0 ), m_free_count( 0 ), m_used( 0 )
+{
+    if( max_fd <= 0 ) {
+        throw std::exception();
+    }
+    int max_chunks = ( max_fd + CONN_CHUNK_SIZE - 1 ) / CONN_CHUNK_SIZE;
+    m_conns = (T**)calloc( max_fd, sizeof( T* ) );
+    m_chunks = (T**)calloc( max_chunks, sizeof( T* ) );
+    m_free = (T**)malloc( (size_t)max_chunks * CONN_CHUNK_SIZE * sizeof( T* ) );
+    if( !m_conns || !m_chunks || !m_free ) {
+        free( m_conns );
+        free( m_chunks );
+        free( m_free );
+        throw std::exception();
+    }
+}
+
+template<typename T>
+conn_table<T>::~conn_table()
+{
+    for( int i = 0; i < m_chunk_count; ++i ) {
+        delete [] m_chunks[i];
+    }
+    free( m_conns );
+    free( m_chunks );
+    free( m_free );
+}
+
+template<typename T>
+T* conn_table<T>::attach( int fd )
+{
+    if( fd < 0 || fd >= m_max_fd ) {
+        return NULL;
+    }
+    if( m_free_count == 0 ) {
+        // 同时存在的连接数不会超过fd的上限，所以块数也不会超过上限
+        T* chunk = new (std::nothrow) T[CONN_CHUNK_SIZE];
+        if( !chunk ) {
+            return NULL;
+        }
+        m_chunks[m_chunk_count++] = chunk;
+        // 倒序入栈，先用块中靠前的对象
+        for( int i = CONN_CHUNK_SIZE - 1; i >= 0; --i ) {
+            m_free[m_free_count++] = chunk + i;
+        }
+    }
+    T* conn = m_free[--m_free_count];
+    m_conns[fd] = conn;
+    ++m_used;
+    return conn;
+}
+
+template<typename T>
+void conn_table<T>::detach( int fd )
+{
+    if( fd < 0 || fd >= m_max_fd || m_conns[fd] == NULL ) {
+        return;
+    }
+    m_free[m_free_count++] = m_conns[fd];
+    m_conns[fd] = NULL;
+    --m_used;
+}
+
+#endif
@@ -0,0 +1,417 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <exception>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../http/http_conn.h"
+#include "../threadpool/threadpool.h"
+#include "conn_table.h"
+
+#define MAX_FD 65536
+#define MAX_EVENT_NUMBER 10000
+#define MAX_ACCEPT_BATCH 256 // 一次EPOLLIN最多接受的连接数，接受队列中剩下的连接下一轮再处理，避免饿死其他连接的事件
+
+// Reactor的配置
+struct reactor_options {
+    int port;               // 监听端口
+    bool reuse_port;        // 是否开启SO_REUSEPORT，多Reactor时需要
+    int tick_ms;            // 时间轮一个滴答的毫秒数，也是timerfd的触发间隔
+    int header_timeout_ms;  // 从收到请求的第一个字节（或建立连接）起，必须在这段时间内收完请求头
+    int idle_timeout_ms;    // 响应发出后，keep-alive连接最多空闲这么久
+    int backlog;            // 监听socket的全连接队列长度，实际还受net.core.somaxconn限制
+    int defer_accept_s;     // TCP_DEFER_ACCEPT：连接上有数据到达才让accept返回，最多等这么多秒，0表示不开启
+    int fastopen_qlen;      // TCP_FASTOPEN：等待完成握手的TFO请求队列长度，0表示不开启
+    int max_conns;          // 所有Reactor的连接总数上限，达到上限后新连接收到503后立即关闭
+    int listener_limit;     // 每个Reactor交给线程池还没处理完的请求数上限，超过时回复503，0表示不限制
+    bool inline_requests;   // Reactor线程直接处理不需要访问磁盘的请求并当场发送，其余的才交给线程池
+};
+
+// Reactor类：一个事件循环线程，拥有自己的epoll实例和监听socket。
+// 多Reactor模式下每个Reactor都用SO_REUSEPORT绑定同一个端口，由内核在它们之间分配新连接，
+// 连接被哪个Reactor接受，它的读写和EPOLLONESHOT重置就一直由这个Reactor负责。
+// 连接在任一时刻只属于一个线程：Reactor收到事件后拥有连接，交给线程池后归工作线程，
+// 工作线程最后一步是用modfd重新注册，此后不再访问连接，下一个事件又把连接交回Reactor。
+// 因为EPOLLONESHOT，连接属于工作线程时Reactor收不到它的事件，所以也不会关闭它；只有定时器会在这期间shutdown它的socket。
+// 开启inline_requests时，命中缓存的文件、304、错误响应和统计页面在Reactor线程中处理完并立即发送，
+// 连接不离开Reactor，只有需要stat、open或者压缩文件的请求才交给线程池。
+class reactor {
+public:
+    /*options是监听和超时配置，pool是处理请求的线程池，listenfd是从旧进程接管的监听socket，-1表示新建一个*/
+    reactor(const reactor_options& options, threadpool<http_conn>* pool, int listenfd = -1);
+    ~reactor();
+    void start(); // 创建一个新线程运行事件循环
+    void loop(); // 在当前线程中运行事件循环
+    int listener() const { return m_listenfd; }
+
+private:
+    static void* worker(void* arg);
+    void handle_accept(); // 有新的客户端连接进来
+    void handle_timer(); // timerfd可读，处理到期的定时器
+    void update_clock(); // 每轮epoll_wait返回后读取一次时钟，本轮所有事件共用
+    void close_conn(http_conn* conn); // 关闭连接并把连接对象还给连接表
+    // 处理读缓冲中的请求：inline_requests时先在本线程处理能立即回复的请求，其余的交给dispatch，返回false表示连接应当关闭
+    bool serve(http_conn* conn);
+    // 把读入了请求的连接交给线程池，过载时在这里直接回复503，返回false表示连接应当关闭
+    bool dispatch(http_conn* conn);
+    bool drain(); // 平滑升级时停止接受连接并关闭空闲连接，所有连接都关闭或超过期限时返回true
+
+private:
+    int m_listenfd; // 本Reactor的监听socket
+    int m_epollfd; // 本Reactor的epoll，监听socket和它接受的所有连接都注册在这里
+    int m_timerfd; // 每个滴答触发一次，驱动时间轮
+    timer_wheel<http_conn>* m_timers; // 本Reactor所有连接的超时定时器
+    time_t m_now; // 缓存的当前时间，单位是滴答
+    int m_tick_ms;
+    int m_max_conns;
+    bool m_inline; // 是否在本线程处理不需要访问磁盘的请求
+    time_t m_header_ticks; // 请求头期限，单位是滴答
+    time_t m_idle_ticks; // 空闲期限，单位是滴答
+    epoll_event* m_events; // epoll_wait返回的事件数组
+    conn_table<http_conn>* m_conns; // 本Reactor接受的连接，对象在第一次需要时才分配
+    threadpool<http_conn>* m_pool;
+    listener_load m_load; // 本Reactor交给线程池的在途请求数
+    bool m_draining; // 监听socket已经交给新进程
+    pthread_t m_thread;
+};
+
+// 按配置创建、绑定并监听一个socket，失败时返回-1。epoll和io_uring两种Reactor共用
+int open_listener(const reactor_options& options)
+{
+    // 监听socket是非阻塞的，Reactor循环accept到EAGAIN为止
+    int listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listenfd < 0) {
+        return -1;
+    }
+
+    // 设置端口复用
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if(options.reuse_port && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    // 握手完成后不马上唤醒accept，等请求到达，省掉一次只为等待请求的EPOLLIN
+    if(options.defer_accept_s > 0 &&
+       setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options.defer_accept_s, sizeof(options.defer_accept_s)) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    // 允许回访的客户端在SYN中携带请求，省掉一个RTT。还需要net.ipv4.tcp_fastopen的第2位（值2）打开服务端支持
+    if(options.fastopen_qlen > 0 &&
+       setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &options.fastopen_qlen, sizeof(options.fastopen_qlen)) < 0) {
+        close(listenfd);
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(options.port);
+    if(bind(listenfd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listenfd, options.backlog) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+reactor::reactor(const reactor_options& options, threadpool<http_conn>* pool, int listenfd) :
+        m_listenfd(listenfd), m_epollfd(-1), m_timerfd(-1), m_timers(NULL), m_tick_ms(options.tick_ms),
+        m_max_conns(options.max_conns), m_inline(options.inline_requests),
+        m_events(NULL), m_conns(NULL), m_pool(pool), m_draining(false)
+{
+    if(m_tick_ms <= 0 || options.backlog <= 0 || m_max_conns <= 0 || options.listener_limit < 0) {
+        throw std::exception();
+    }
+    m_load.inflight.store(0);
+    m_load.limit = options.listener_limit;
+    // 期限至少一个滴答
+    m_header_ticks = (options.header_timeout_ms + m_tick_ms - 1) / m_tick_ms;
+    m_idle_ticks = (options.idle_timeout_ms + m_tick_ms - 1) / m_tick_ms;
+    if(m_header_ticks <= 0) m_header_ticks = 1;
+    if(m_idle_ticks <= 0) m_idle_ticks = 1;
+
+    if(m_listenfd < 0) m_listenfd = open_listener(options);
+    if(m_listenfd < 0) {
+        throw std::exception();
+    }
+
+    // 创建epoll对象， 事件数组， 添加
+    m_epollfd = epoll_create(5);
+    if(m_epollfd < 0) {
+        close(m_listenfd);
+        throw std::exception();
+    }
+    m_events = new epoll_event[MAX_EVENT_NUMBER];
+
+    // 将监听的文件描述符添加到epoll中
+    addfd(m_epollfd, m_listenfd, false, false);
+
+    // 创建timerfd，每个滴答触发一次
+    m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(m_timerfd < 0) {
+        close(m_epollfd);
+        close(m_listenfd);
+        delete [] m_events;
+        throw std::exception();
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = m_tick_ms / 1000;
+    its.it_interval.tv_nsec = (long)(m_tick_ms % 1000) * 1000000;
+    its.it_value = its.it_interval;
+    timerfd_settime(m_timerfd, 0, &its, NULL);
+    addfd(m_epollfd, m_timerfd, false, false);
+
+    update_clock();
+    m_timers = new timer_wheel<http_conn>(MAX_FD, m_now);
+    m_conns = new conn_table<http_conn>(MAX_FD);
+}
+
+reactor::~reactor()
+{
+    close(m_timerfd);
+    close(m_epollfd);
+    if(m_listenfd >= 0) close(m_listenfd);
+    delete [] m_events;
+    delete m_timers;
+    delete m_conns;
+}
+
+void reactor::start()
+{
+    if(pthread_create(&m_thread, NULL, worker, this) != 0) {
+        throw std::exception();
+    }
+    if(pthread_detach(m_thread)) {
+        throw std::exception();
+    }
+}
+
+void* reactor::worker(void* arg)
+{
+    reactor* r = (reactor*)arg;
+    r->loop();
+    return r;
+}
+
+void reactor::handle_accept()
+{
+    // 一次把接受队列取空，accept4直接设置非阻塞和CLOEXEC，不再需要额外的fcntl
+    for(int i = 0; i < MAX_ACCEPT_BATCH; ++i) {
+        struct sockaddr_in client_address;
+        socklen_t client_addr_len = sizeof(client_address);
+        uint64_t begin = metrics::now();
+        int connfd = accept4(m_listenfd, (struct sockaddr*)&client_address, &client_addr_len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(connfd < 0) {
+            // 对方在被接受前已经断开，继续取下一个
+            if(errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_ERROR("accept errno is: %d", errno);
+            }
+            return;
+        }
+
+        // 连接数满了，告诉客户端服务器正忙
+        if(http_conn::m_user_cnt >= m_max_conns) {
+            http_conn::reject(connfd);
+            continue;
+        }
+
+        // 从连接表中为新的客户分配一个连接对象并初始化
+        http_conn* conn = m_conns->attach(connfd);
+        if(!conn) {
+            http_conn::reject(connfd);
+            continue;
+        }
+        conn->init(connfd, client_address, m_epollfd, m_timers);
+        // 客户端必须在期限内发来完整的请求头
+        conn->set_deadline(m_now + m_header_ticks);
+        metrics::record(metrics::STAGE_ACCEPT, metrics::now() - begin);
+    }
+}
+
+void reactor::handle_timer()
+{
+    uint64_t expirations;
+    if(::read(m_timerfd, &expirations, sizeof(expirations)) < 0) {
+        return;
+    }
+    m_timers->tick(m_now);
+}
+
+void reactor::close_conn(http_conn* conn)
+{
+    int fd = conn->fd();
+    conn->close_conn();
+    m_conns->detach(fd);
+}
+
+// 只关闭在Reactor手中等待请求、也没有收到数据的连接，和超时一样只关闭socket的读写，在随后的EPOLLHUP中关闭。
+// 其余的连接可能正被工作线程处理，不能访问它们的状态，它们的响应会带上Connection: close，发完后关闭
+bool reactor::drain()
+{
+    if(!m_draining) {
+        m_draining = true;
+        // 新进程持有同一个监听socket，这里关闭不影响它
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, 0);
+        close(m_listenfd);
+        m_listenfd = -1;
+        for(int fd = 0; fd < m_conns->max_fd(); ++fd) {
+            http_conn* conn = m_conns->get(fd);
+            // 下一个请求已经到了但还没有处理的连接留到EPOLLIN，回复后带Connection: close关闭，不让客户端收不到响应
+            char c;
+            if(conn && conn->idle() && recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0) {
+                shutdown(fd, SHUT_RDWR);
+            }
+        }
+    }
+    if(m_conns->size() == 0 || metrics::now() >= upgrade::deadline()) {
+        upgrade::drained();
+        return true;
+    }
+    return false;
+}
+
+// 交给线程池再交回来要经过两次跨线程唤醒和两次epoll_ctl，对只需要引用缓存内容的请求来说比处理本身还贵。
+// 这里在本线程生成响应并马上写出，写不完时write已经注册了EPOLLOUT；发完后读缓冲中还有流水线上的请求就继续处理
+bool reactor::serve(http_conn* conn)
+{
+    if(!m_inline) return dispatch(conn);
+    while(true){
+        if(!conn->process_requests(true)) return false;
+        if(!conn->has_output()){
+            if(conn->deferred()) return dispatch(conn);
+            // 请求还不完整，继续等待数据
+            modfd(m_epollfd, conn->fd(), EPOLLIN, http_conn::m_edge_triggered);
+            return true;
+        }
+        if(!conn->write()) return false;
+        if(conn->has_output()) return true;
+        if(!conn->has_buffered_request()){
+            conn->set_deadline(m_now + m_idle_ticks);
+            conn->set_idle(true);
+            return true;
+        }
+        conn->set_deadline(m_now + m_header_ticks);
+    }
+}
+
+bool reactor::dispatch(http_conn* conn)
+{
+    admission* control = http_conn::m_admission;
+    if(control && !control->admit(&m_load)) {
+        conn->shed();
+        return conn->write();
+    }
+    conn->queued(control ? &m_load : NULL);
+    if(!m_pool->append(conn)) {
+        // 请求队列满了，连接还在Reactor手里，同样回复503
+        if(control) control->cancel(&m_load);
+        conn->shed();
+        return conn->write();
+    }
+    return true;
+}
+
+void reactor::update_clock()
+{
+    // 粗粒度时钟不需要进入内核，精度也远高于滴答
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    m_now = ((time_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / m_tick_ms;
+}
+
+void reactor::loop()
+{
+    while(true)
+    {
+        int num = epoll_wait(m_epollfd, m_events, MAX_EVENT_NUMBER, -1);
+        if((num<0) && (errno != EINTR)){
+            LOG_ERROR("epoll failure! errno is: %d", errno);
+            break;
+        }
+        update_clock();
+        bool timeout = false;
+
+        // 循环遍历事件数组
+        for(int i=0; i<num; ++i){
+            int sockfd = m_events[i].data.fd;
+            http_conn* conn;
+            if(sockfd == m_listenfd){
+                handle_accept();
+            }
+            else if(sockfd == m_timerfd){
+                // 定时任务的优先级不高，等本轮的I/O事件处理完再处理
+                timeout = true;
+            }
+            else if(!(conn = m_conns->get(sockfd))){
+                // 本轮前面的事件已经关闭了这个连接
+                continue;
+            }
+            else if(m_events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            // 对方异常断开或者错误等事件
+            {
+                close_conn(conn);
+            }
+            else if(m_events[i].events & EPOLLIN)
+            {
+                // 收到新请求的第一批数据，开始计算请求头期限，之后的数据不再推迟期限
+                conn->set_idle(false);
+                bool waiting = conn->waiting_request();
+                if(conn->read()){
+                    if(waiting){
+                        conn->set_deadline(m_now + m_header_ticks);
+                    }
+                    // 一次性把所有数据读完再处理
+                    if(!serve(conn)){
+                        close_conn(conn);
+                    }
+                }else{
+                    close_conn(conn);
+                }
+            }
+            else if(m_events[i].events & EPOLLOUT){
+                conn->set_idle(false);
+                if(!conn->write()){ // 一次性写完所有数据
+                    close_conn(conn);
+                }else if(conn->has_buffered_request()){
+                    // 流水线上还有已经读入的请求，继续处理，剩下的部分必须在请求头期限内收完
+                    conn->set_deadline(m_now + m_header_ticks);
+                    if(!serve(conn)){
+                        close_conn(conn);
+                    }
+                }else{
+                    // 响应有进展或已经发完，连接进入空闲期限
+                    conn->set_deadline(m_now + m_idle_ticks);
+                    conn->set_idle(!conn->has_output());
+                }
+            }
+        }
+
+        if(timeout){
+            handle_timer();
+        }
+        // epoll_wait至少每个滴答返回一次，排空的期限精确到滴答
+        if(upgrade::draining() && drain()){
+            break;
+        }
+    }
+}
+
+#endif
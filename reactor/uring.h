@@ -0,0 +1,225 @@
+#ifndef URING_H
+#define URING_H
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <exception>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "../metrics/metrics.h"
+
+/*
+    io_uring的最小封装，直接使用系统调用，不依赖liburing。
+    提交队列和完成队列都由内核和用户态共享，头尾指针用acquire/release访问。
+    只由一个线程使用：取SQE、提交、收割CQE都在所属的uring_reactor线程中进行。
+    环以禁用状态创建，注册文件和缓冲后由这个线程调用enable，IORING_SETUP_SINGLE_ISSUER把启用环的线程定为唯一的提交者。
+*/
+class uring {
+public:
+    /*entries是提交队列长度，完成队列是它的4倍，多发请求（multishot）会为一个SQE产生很多CQE*/
+    uring(unsigned entries);
+    ~uring();
+
+    // 取一个空闲的SQE并清零，提交队列满时先把已有的提交给内核
+    io_uring_sqe* get_sqe();
+    // 提交队列中还能取出的SQE数
+    unsigned sq_space() const { return m_sq_entries - (m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE)); }
+    // 提交所有准备好的SQE，wait_nr大于0时等待至少这么多个完成事件，返回io_uring_enter的结果
+    int submit(unsigned wait_nr);
+    // 取下一个完成事件，没有时返回NULL。处理完必须调用cqe_seen
+    io_uring_cqe* peek_cqe()
+    {
+        unsigned head = *m_cq_head;
+        if(head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        return &m_cqes[head & m_cq_mask];
+    }
+    void cqe_seen() { __atomic_store_n(m_cq_head, *m_cq_head + 1, __ATOMIC_RELEASE); }
+
+    // 注册固定文件表，之后SQE用IOSQE_FIXED_FILE和下标引用这些文件
+    int register_files(const int* fds, unsigned count);
+    // 注册提供缓冲环，ring必须按页对齐
+    int register_buf_ring(void* ring, unsigned entries, unsigned short bgid);
+    int unregister_buf_ring(unsigned short bgid);
+    // 启用环，之后只能由调用它的线程提交。不是以禁用状态创建的环直接返回0
+    int enable();
+
+    int fd() const { return m_ring_fd; }
+
+private:
+    int m_ring_fd;
+    bool m_disabled; // 以IORING_SETUP_R_DISABLED创建，还没有启用
+
+    // 提交队列
+    void* m_sq_ring;
+    size_t m_sq_ring_size;
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+    unsigned* m_sq_array;
+    io_uring_sqe* m_sqes;
+    size_t m_sqes_size;
+    unsigned m_sqe_tail; // 已经取出但还没有提交的SQE的尾部
+    unsigned m_sqe_head; // 已经提交给内核的SQE的尾部
+
+    // 完成队列
+    void* m_cq_ring;
+    size_t m_cq_ring_size;
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    io_uring_cqe* m_cqes;
+};
+
+uring::uring(unsigned entries) : m_disabled(true), m_sqe_tail(0), m_sqe_head(0)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // 只有本线程提交，完成事件的任务也推迟到本线程等待时再处理，减少内核中断当前线程的次数。
+    // 创建环的是主线程，运行事件循环的可能是另一个线程，所以先禁用，由事件循环的线程启用
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED;
+    p.cq_entries = entries * 4;
+    m_ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(m_ring_fd < 0 && errno == EINVAL) {
+        // 旧内核不支持这些标志
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        m_disabled = false;
+        p.cq_entries = entries * 4;
+        m_ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if(m_ring_fd < 0) {
+        throw std::exception();
+    }
+
+    m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(m_cq_ring_size > m_sq_ring_size) m_sq_ring_size = m_cq_ring_size;
+        m_cq_ring_size = m_sq_ring_size;
+    }
+    m_sq_ring = mmap(NULL, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    if(m_sq_ring == MAP_FAILED) {
+        close(m_ring_fd);
+        throw std::exception();
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cq_ring = m_sq_ring;
+    }else{
+        m_cq_ring = mmap(NULL, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+        if(m_cq_ring == MAP_FAILED) {
+            munmap(m_sq_ring, m_sq_ring_size);
+            close(m_ring_fd);
+            throw std::exception();
+        }
+    }
+    m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = (io_uring_sqe*)mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+    if(m_sqes == MAP_FAILED) {
+        if(m_cq_ring != m_sq_ring) munmap(m_cq_ring, m_cq_ring_size);
+        munmap(m_sq_ring, m_sq_ring_size);
+        close(m_ring_fd);
+        throw std::exception();
+    }
+
+    char* sq = (char*)m_sq_ring;
+    m_sq_head = (unsigned*)(sq + p.sq_off.head);
+    m_sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    m_sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    m_sq_entries = *(unsigned*)(sq + p.sq_off.ring_entries);
+    m_sq_array = (unsigned*)(sq + p.sq_off.array);
+    // SQE按顺序使用，索引数组固定为恒等映射
+    for(unsigned i = 0; i < m_sq_entries; ++i) {
+        m_sq_array[i] = i;
+    }
+
+    char* cq = (char*)m_cq_ring;
+    m_cq_head = (unsigned*)(cq + p.cq_off.head);
+    m_cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    m_cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+}
+
+uring::~uring()
+{
+    munmap(m_sqes, m_sqes_size);
+    if(m_cq_ring != m_sq_ring) munmap(m_cq_ring, m_cq_ring_size);
+    munmap(m_sq_ring, m_sq_ring_size);
+    close(m_ring_fd);
+}
+
+io_uring_sqe* uring::get_sqe()
+{
+    if(m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries) {
+        submit(0);
+        if(m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries) {
+            return NULL;
+        }
+    }
+    io_uring_sqe* sqe = &m_sqes[m_sqe_tail & m_sq_mask];
+    ++m_sqe_tail;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring::submit(unsigned wait_nr)
+{
+    unsigned to_submit = m_sqe_tail - m_sqe_head;
+    if(to_submit) {
+        __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+        m_sqe_head = m_sqe_tail;
+    }
+    if(to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    metrics::count(metrics::RING_ENTERS);
+    int ret = syscall(__NR_io_uring_enter, m_ring_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    return ret < 0 ? -errno : ret;
+}
+
+int uring::register_files(const int* fds, unsigned count)
+{
+    int ret = syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_FILES, fds, count);
+    return ret < 0 ? -errno : ret;
+}
+
+int uring::register_buf_ring(void* ring, unsigned entries, unsigned short bgid)
+{
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    int ret = syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    return ret < 0 ? -errno : ret;
+}
+
+int uring::unregister_buf_ring(unsigned short bgid)
+{
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = bgid;
+    int ret = syscall(__NR_io_uring_register, m_ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    return ret < 0 ? -errno : ret;
+}
+
+int uring::enable()
+{
+    if(!m_disabled) {
+        return 0;
+    }
+    int ret = syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0);
+    if(ret < 0) {
+        return -errno;
+    }
+    m_disabled = false;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,886 @@
+#ifndef URING_REACTOR_H
+#define URING_REACTOR_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <exception>
+#include <vector>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "reactor.h"
+#include "uring.h"
+
+#define URING_ENTRIES 1024      // 提交队列长度
+#define URING_BUF_ENTRIES 512   // 提供缓冲环中的接收缓冲数，必须是2的幂
+#define URING_BUF_SIZE 4096     // 每个接收缓冲的大小
+#define URING_BUF_GROUP 0       // 提供缓冲环的组号
+#define URING_HELD_BUFS 4       // 一个连接最多暂存的接收缓冲数，超过时关闭连接
+#define URING_LISTEN_INDEX 0    // 监听socket在固定文件表中的下标
+#define URING_HELPER_THREADS 4  // 辅助线程数，处理缓存没有命中、需要访问磁盘的请求
+
+class uring_reactor;
+
+/*
+    io_uring后端的连接。在http_conn之外记录正在进行的操作：内核在操作完成前会访问msg和iv，
+    所以连接对象要等所有操作都完成后才能回收。
+*/
+struct uring_conn : public http_conn {
+    // 读缓冲暂时放不下的接收缓冲，按到达顺序排列
+    struct held_buf {
+        unsigned short bid;
+        int offset;
+        int len;
+    };
+
+    struct msghdr msg; // 正在进行的sendmsg
+    struct iovec iv[MAX_PIPELINE * 3];
+    held_buf held[URING_HELD_BUFS];
+    int held_count;
+    int inflight; // 还没有完成的操作数，多发recv在最后一个CQE之前算一个
+    bool recv_armed; // 多发recv还在进行
+    bool sending; // 正在进行sendmsg或等待POLLOUT
+    bool closing; // 连接正在关闭，不再处理新的数据
+    bool close_pending; // 已经提交了关闭socket的操作
+    bool fd_closed; // socket已经关闭
+    bool offloaded; // 请求正由辅助线程处理，期间收到的数据只暂存，不访问http_conn的状态
+    bool offload_ok; // 辅助线程中process_requests的结果
+    uring_reactor* owner; // 所属的Reactor，辅助线程处理完后交还给它
+
+    // 由辅助线程池调用：处理Reactor线程留下的请求，查找、打开文件，必要时生成压缩变体，然后交还给所属的Reactor
+    void process();
+};
+
+/*
+    io_uring Reactor：和reactor一样每个实例有自己的监听socket和事件循环线程，用SO_REUSEPORT分担新连接，
+    但用完成模型代替就绪模型。监听socket注册为固定文件，用一个多发accept接受所有连接；
+    每个连接一个多发recv，数据由内核直接放进提供缓冲环，复制到连接的读缓冲后立即归还；
+    响应用sendmsg发送，最后一个响应之后要关闭连接时把sendmsg和close链接在一起提交。
+    一轮事件循环中产生的所有SQE在下一次等待时通过同一个io_uring_enter提交，负载高时每个请求平均不到一次系统调用。
+
+    命中文件缓存的请求、304和错误响应在本线程中直接处理：把完成通知传回环所在的线程需要额外的系统调用，
+    而这些请求处理时间很短。缓存没有命中的请求要stat、open，文本文件还要生成gzip和brotli变体，
+    在本线程中处理会让所有连接等着，所以交给辅助线程池，处理完后放进m_done，用eventfd唤醒环，
+    环上一直挂着一个对eventfd的读操作。大文件的sendfile同步进行，遇到EAGAIN时提交POLLOUT等待。
+*/
+class uring_reactor {
+public:
+    /*options是监听和超时配置，helpers是处理需要访问磁盘的请求的辅助线程池，为NULL时在本线程处理，
+      listenfd是从旧进程接管的监听socket，-1表示新建一个*/
+    uring_reactor(const reactor_options& options, threadpool<uring_conn>* helpers, int listenfd = -1);
+    ~uring_reactor();
+    void start(); // 创建一个新线程运行事件循环
+    void loop(); // 在当前线程中运行事件循环
+    int listener() const { return m_listenfd; }
+    void post(uring_conn* conn); // 辅助线程处理完一个连接，交还给环所在的线程
+
+    // user_data的高32位是操作类型，低32位是fd
+    enum OP { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_POLL, OP_CLOSE, OP_CANCEL, OP_TIMER, OP_BUFS, OP_WAKE };
+
+private:
+    static void* worker(void* arg);
+    static uint64_t tag(OP op, int fd) { return ((uint64_t)op << 32) | (uint32_t)fd; }
+
+    io_uring_sqe* get_sqe(); // 取一个SQE，提交队列满时先提交
+    void arm_accept();
+    void arm_recv(uring_conn* conn);
+    void arm_timer();
+    void arm_wake(); // 等待辅助线程交还连接
+    void handle_accept(int res, unsigned flags);
+    void handle_recv(uring_conn* conn, int res, unsigned flags);
+    void handle_send(uring_conn* conn, int res);
+    void handle_poll(uring_conn* conn, int res);
+    void handle_close(uring_conn* conn, int res);
+    void handle_wake(); // 取回辅助线程处理完的连接
+    void deliver(uring_conn* conn, unsigned short bid, int offset, int len); // 把接收缓冲中的数据交给连接
+    void drain_held(uring_conn* conn); // 响应发完后继续复制暂存的接收缓冲
+    void pump(uring_conn* conn); // 处理读缓冲中的请求并开始发送响应
+    void offload(uring_conn* conn); // 把需要访问磁盘的请求交给辅助线程
+    void resume(uring_conn* conn); // 辅助线程处理完，继续发送响应
+    void send_next(uring_conn* conn); // 发送队首开始的响应
+    void output_done(uring_conn* conn); // 所有响应都发完了
+    void close_conn(uring_conn* conn); // 取消连接上的操作，开始关闭
+    void try_release(uring_conn* conn); // 操作都完成后关闭socket、回收连接对象
+    void recycle(unsigned short bid); // 把接收缓冲还给内核
+    bool probe_buf_ring(); // 检查内核能否从提供缓冲环取到缓冲
+    void setup(); // 启用环之后在事件循环的线程中检查提供缓冲环，提交accept、定时器和对eventfd的读
+    void update_clock();
+    bool drain(); // 平滑升级时停止接受连接并关闭空闲连接，所有连接都关闭或超过期限时返回true
+
+private:
+    int m_listenfd;
+    uring* m_ring;
+    timer_wheel<http_conn>* m_timers; // 本Reactor所有连接的超时定时器
+    conn_table<uring_conn>* m_conns;
+    struct io_uring_buf_ring* m_buf_ring; // 提供缓冲环，内核从这里取接收缓冲
+    char* m_bufs; // 所有接收缓冲
+    unsigned short m_buf_tail; // 提供缓冲环的尾部，归还缓冲时推进
+    bool m_provide_sqe; // 提供缓冲环不可用，用IORING_OP_PROVIDE_BUFFERS归还缓冲
+    std::vector<int> m_starved; // 因为没有空闲接收缓冲而停止的recv，归还缓冲后重新提交
+    bool m_recycled; // 这一轮事件循环归还过接收缓冲
+    threadpool<uring_conn>* m_helpers;
+    int m_wakefd; // 辅助线程交还连接时写入的eventfd
+    uint64_t m_wake_value; // 对eventfd的读操作的缓冲
+    locker m_done_lock; // 保护m_done
+    std::vector<uring_conn*> m_done; // 辅助线程处理完、等待环所在的线程取回的连接
+    struct __kernel_timespec m_tick_ts; // 滴答间隔，提交的超时操作引用它
+    time_t m_now; // 缓存的当前时间，单位是滴答
+    int m_tick_ms;
+    int m_max_conns;
+    time_t m_header_ticks; // 请求头期限，单位是滴答
+    time_t m_idle_ticks; // 空闲期限，单位是滴答
+    bool m_draining; // 监听socket已经交给新进程
+    pthread_t m_thread;
+};
+
+uring_reactor::uring_reactor(const reactor_options& options, threadpool<uring_conn>* helpers, int listenfd) :
+        m_listenfd(listenfd), m_ring(NULL), m_timers(NULL), m_conns(NULL), m_buf_ring(NULL), m_bufs(NULL), m_buf_tail(0),
+        m_provide_sqe(false), m_recycled(false), m_helpers(helpers), m_wakefd(-1),
+        m_tick_ms(options.tick_ms), m_max_conns(options.max_conns), m_draining(false)
+{
+    if(m_tick_ms <= 0 || options.backlog <= 0 || m_max_conns <= 0) {
+        throw std::exception();
+    }
+    // 期限至少一个滴答
+    m_header_ticks = (options.header_timeout_ms + m_tick_ms - 1) / m_tick_ms;
+    m_idle_ticks = (options.idle_timeout_ms + m_tick_ms - 1) / m_tick_ms;
+    if(m_header_ticks <= 0) m_header_ticks = 1;
+    if(m_idle_ticks <= 0) m_idle_ticks = 1;
+    m_tick_ts.tv_sec = m_tick_ms / 1000;
+    m_tick_ts.tv_nsec = (long long)(m_tick_ms % 1000) * 1000000;
+
+    if(m_listenfd < 0) m_listenfd = open_listener(options);
+    if(m_listenfd < 0) {
+        throw std::exception();
+    }
+    m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_wakefd < 0) {
+        close(m_listenfd);
+        throw std::exception();
+    }
+    try {
+        m_ring = new uring(URING_ENTRIES);
+    }catch(...) {
+        close(m_listenfd);
+        close(m_wakefd);
+        throw;
+    }
+
+    size_t ring_size = URING_BUF_ENTRIES * sizeof(struct io_uring_buf);
+    void* ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void* bufs = mmap(NULL, (size_t)URING_BUF_ENTRIES * URING_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring == MAP_FAILED || bufs == MAP_FAILED ||
+       m_ring->register_buf_ring(ring, URING_BUF_ENTRIES, URING_BUF_GROUP) < 0 ||
+       m_ring->register_files(&m_listenfd, 1) < 0) {
+        if(ring != MAP_FAILED) munmap(ring, ring_size);
+        if(bufs != MAP_FAILED) munmap(bufs, (size_t)URING_BUF_ENTRIES * URING_BUF_SIZE);
+        delete m_ring;
+        close(m_listenfd);
+        close(m_wakefd);
+        throw std::exception();
+    }
+    m_buf_ring = (struct io_uring_buf_ring*)ring;
+    m_bufs = (char*)bufs;
+    for(int i = 0; i < URING_BUF_ENTRIES; ++i) {
+        recycle(i);
+    }
+
+    update_clock();
+    m_timers = new timer_wheel<http_conn>(MAX_FD, m_now);
+    m_conns = new conn_table<uring_conn>(MAX_FD);
+}
+
+void uring_reactor::setup()
+{
+    // 有的内核注册成功但取不到缓冲，退回到用SQE提供缓冲的旧接口，归还缓冲和其他操作一起提交，不增加系统调用
+    if(!probe_buf_ring()) {
+        m_ring->unregister_buf_ring(URING_BUF_GROUP);
+        m_provide_sqe = true;
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = URING_BUF_ENTRIES;
+        sqe->addr = (uint64_t)(uintptr_t)m_bufs;
+        sqe->len = URING_BUF_SIZE;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->off = 0;
+        sqe->user_data = tag(OP_BUFS, 0);
+    }
+    arm_accept();
+    arm_timer();
+    arm_wake();
+}
+
+uring_reactor::~uring_reactor()
+{
+    delete m_ring;
+    munmap(m_buf_ring, URING_BUF_ENTRIES * sizeof(struct io_uring_buf));
+    munmap(m_bufs, (size_t)URING_BUF_ENTRIES * URING_BUF_SIZE);
+    if(m_listenfd >= 0) close(m_listenfd);
+    close(m_wakefd);
+    delete m_timers;
+    delete m_conns;
+}
+
+void uring_reactor::start()
+{
+    if(pthread_create(&m_thread, NULL, worker, this) != 0) {
+        throw std::exception();
+    }
+    if(pthread_detach(m_thread)) {
+        throw std::exception();
+    }
+}
+
+void* uring_reactor::worker(void* arg)
+{
+    uring_reactor* r = (uring_reactor*)arg;
+    r->loop();
+    return r;
+}
+
+io_uring_sqe* uring_reactor::get_sqe()
+{
+    // 完成队列在处理前就已经腾出，提交总能让内核取走SQE
+    io_uring_sqe* sqe;
+    while(!(sqe = m_ring->get_sqe())) {
+        m_ring->submit(0);
+    }
+    return sqe;
+}
+
+void uring_reactor::arm_accept()
+{
+    // 多发accept：一个SQE接受所有新连接，直接得到非阻塞的socket
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = URING_LISTEN_INDEX;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = tag(OP_ACCEPT, m_listenfd);
+}
+
+void uring_reactor::arm_recv(uring_conn* conn)
+{
+    // 多发recv：每次有数据时内核从提供缓冲环取一个缓冲，缓冲号在CQE的flags中
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd();
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = tag(OP_RECV, conn->fd());
+    conn->recv_armed = true;
+    ++conn->inflight;
+}
+
+void uring_reactor::arm_timer()
+{
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&m_tick_ts;
+    sqe->len = 1;
+    sqe->user_data = tag(OP_TIMER, 0);
+}
+
+void uring_reactor::arm_wake()
+{
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_wakefd;
+    sqe->addr = (uint64_t)(uintptr_t)&m_wake_value;
+    sqe->len = sizeof(m_wake_value);
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = tag(OP_WAKE, 0);
+}
+
+bool uring_reactor::probe_buf_ring()
+{
+    // 从管道读一个字节，只在启动时做一次
+    int fds[2];
+    if(pipe(fds) < 0) {
+        return false;
+    }
+    bool ok = false;
+    if(::write(fds[1], "x", 1) == 1) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fds[0];
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->off = (uint64_t)-1;
+        sqe->user_data = tag(OP_BUFS, 0);
+        m_ring->submit(1);
+        io_uring_cqe* cqe;
+        while((cqe = m_ring->peek_cqe()) != NULL) {
+            if(cqe->res > 0) {
+                ok = true;
+                recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            m_ring->cqe_seen();
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return ok;
+}
+
+void uring_reactor::recycle(unsigned short bid)
+{
+    m_recycled = true;
+    if(m_provide_sqe) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = 1;
+        sqe->addr = (uint64_t)(uintptr_t)(m_bufs + (size_t)bid * URING_BUF_SIZE);
+        sqe->len = URING_BUF_SIZE;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->off = bid;
+        sqe->user_data = tag(OP_BUFS, 0);
+        return;
+    }
+    struct io_uring_buf* buf = &m_buf_ring->bufs[m_buf_tail & (URING_BUF_ENTRIES - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(m_bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ++m_buf_tail;
+    __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+void uring_reactor::handle_accept(int res, unsigned flags)
+{
+    // 连接在完成事件到达时已经接受，这里统计的是注册连接和提交第一个recv的耗时
+    uint64_t begin = metrics::now();
+    // 多发accept出错或被内核终止时重新提交，排空时是被取消的，不再提交
+    if(!(flags & IORING_CQE_F_MORE) && !m_draining) {
+        arm_accept();
+    }
+    if(res < 0) {
+        // 排空时取消accept是有意的，不算错误
+        if(res != -EAGAIN && res != -ECONNABORTED && res != -EINTR && !(res == -ECANCELED && m_draining)) {
+            LOG_ERROR("accept errno is: %d", -res);
+        }
+        return;
+    }
+    int connfd = res;
+
+    // 连接数满了，告诉客户端服务器正忙
+    if(http_conn::m_user_cnt >= m_max_conns) {
+        http_conn::reject(connfd);
+        return;
+    }
+    uring_conn* conn = m_conns->attach(connfd);
+    if(!conn) {
+        http_conn::reject(connfd);
+        return;
+    }
+    // 多发accept的多个连接共用地址参数，无法得到各自的地址，需要时用getpeername获取
+    struct sockaddr_in client_address;
+    memset(&client_address, 0, sizeof(client_address));
+    conn->init(connfd, client_address, -1, m_timers);
+    conn->held_count = 0;
+    conn->inflight = 0;
+    conn->recv_armed = conn->sending = conn->closing = conn->close_pending = conn->fd_closed = false;
+    conn->offloaded = false;
+    conn->owner = this;
+    // 客户端必须在期限内发来完整的请求头
+    conn->set_deadline(m_now + m_header_ticks);
+    arm_recv(conn);
+    metrics::record(metrics::STAGE_ACCEPT, metrics::now() - begin);
+}
+
+void uring_reactor::handle_recv(uring_conn* conn, int res, unsigned flags)
+{
+    if(!(flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = false;
+        --conn->inflight;
+    }
+    if(res > 0) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if(conn->closing) {
+            recycle(bid);
+        }else{
+            // 收到新请求的第一批数据，开始计算请求头期限
+            if(!conn->offloaded && conn->waiting_request() && conn->held_count == 0 && !conn->has_output()) {
+                conn->set_deadline(m_now + m_header_ticks);
+            }
+            deliver(conn, bid, 0, res);
+        }
+        // 多发recv在完成队列溢出等情况下会停止，连接还在使用时重新提交
+        if(!conn->recv_armed && !conn->closing) {
+            arm_recv(conn);
+        }
+    }else if(res == -ENOBUFS) {
+        // 接收缓冲用完了，等有缓冲归还后再重新提交
+        if(!conn->closing) {
+            m_starved.push_back(conn->fd());
+        }
+    }else{
+        // 对方关闭连接、socket被定时器shutdown或出错
+        close_conn(conn);
+    }
+    try_release(conn);
+}
+
+void uring_reactor::deliver(uring_conn* conn, unsigned short bid, int offset, int len)
+{
+    // 前面还有暂存的数据时只能排在后面，辅助线程正在使用读缓冲时也只能暂存
+    if(conn->held_count == 0 && !conn->offloaded) {
+        char* data = m_bufs + (size_t)bid * URING_BUF_SIZE;
+        // pump可能把连接交给了辅助线程，剩下的数据暂存
+        while(len > 0 && !conn->closing && !conn->offloaded) {
+            int n = conn->feed(data + offset, len);
+            if(n < 0) {
+                // 请求头超过了长度上限
+                close_conn(conn);
+                break;
+            }
+            if(n == 0) break;
+            offset += n;
+            len -= n;
+            pump(conn);
+        }
+        if(len == 0 || conn->closing) {
+            recycle(bid);
+            return;
+        }
+    }
+    if(conn->held_count == URING_HELD_BUFS) {
+        // 客户端在响应发完前发来太多流水线请求
+        recycle(bid);
+        close_conn(conn);
+        return;
+    }
+    uring_conn::held_buf* h = &conn->held[conn->held_count++];
+    h->bid = bid;
+    h->offset = offset;
+    h->len = len;
+}
+
+void uring_reactor::drain_held(uring_conn* conn)
+{
+    while(conn->held_count > 0 && !conn->closing && !conn->sending && !conn->offloaded) {
+        uring_conn::held_buf h = conn->held[0];
+        --conn->held_count;
+        memmove(conn->held, conn->held + 1, conn->held_count * sizeof(uring_conn::held_buf));
+        // 重新交给deliver，放不下时它会把剩下的部分暂存回队首
+        int count = conn->held_count;
+        uring_conn::held_buf rest[URING_HELD_BUFS];
+        memcpy(rest, conn->held, count * sizeof(uring_conn::held_buf));
+        conn->held_count = 0;
+        deliver(conn, h.bid, h.offset, h.len);
+        if(conn->closing) {
+            for(int i = 0; i < count; ++i) recycle(rest[i].bid);
+            return;
+        }
+        memcpy(conn->held + conn->held_count, rest, count * sizeof(uring_conn::held_buf));
+        conn->held_count += count;
+        if(conn->held_count > count) {
+            // 这个缓冲没有复制完，后面的继续等
+            return;
+        }
+    }
+}
+
+void uring_reactor::pump(uring_conn* conn)
+{
+    if(conn->sending || conn->closing || conn->offloaded || conn->has_output()) {
+        return;
+    }
+    if(!conn->process_requests(true)) {
+        close_conn(conn);
+        return;
+    }
+    // 前面的响应先发出去，发完后output_done再调用pump，那时才交给辅助线程
+    if(conn->has_output()) {
+        send_next(conn);
+    }else if(conn->deferred()) {
+        offload(conn);
+    }
+}
+
+// 辅助线程处理期间连接算一个还没有完成的操作，连接关闭时等它回来才回收
+void uring_reactor::offload(uring_conn* conn)
+{
+    conn->offloaded = true;
+    ++conn->inflight;
+    if(m_helpers && m_helpers->append(conn)) {
+        return;
+    }
+    // 辅助线程的队列满了，在本线程处理
+    conn->offload_ok = conn->process_requests();
+    resume(conn);
+}
+
+void uring_reactor::resume(uring_conn* conn)
+{
+    conn->offloaded = false;
+    --conn->inflight;
+    if(conn->closing) {
+        return;
+    }
+    if(!conn->offload_ok) {
+        close_conn(conn);
+        return;
+    }
+    if(conn->has_output()) {
+        send_next(conn);
+    }else{
+        drain_held(conn);
+        pump(conn);
+    }
+}
+
+void uring_reactor::post(uring_conn* conn)
+{
+    m_done_lock.lock();
+    m_done.push_back(conn);
+    bool first = m_done.size() == 1;
+    m_done_lock.unlock();
+    // 列表原来不为空时已经写过eventfd，环所在的线程取走列表之前不需要再写
+    if(first) {
+        uint64_t one = 1;
+        ssize_t n;
+        while((n = ::write(m_wakefd, &one, sizeof(one))) < 0 && errno == EINTR) {}
+    }
+}
+
+void uring_reactor::handle_wake()
+{
+    arm_wake();
+    std::vector<uring_conn*> done;
+    m_done_lock.lock();
+    done.swap(m_done);
+    m_done_lock.unlock();
+    for(size_t i = 0; i < done.size(); ++i) {
+        resume(done[i]);
+        try_release(done[i]);
+    }
+}
+
+void uring_reactor::send_next(uring_conn* conn)
+{
+    while(conn->has_output()) {
+        bool more;
+        int n = conn->gather(conn->iv, &more);
+        if(n > 0) {
+            memset(&conn->msg, 0, sizeof(conn->msg));
+            conn->msg.msg_iov = conn->iv;
+            conn->msg.msg_iovlen = n;
+            // 最后一个响应之后要关闭连接，并且剩下的都在这一次发送中：发送和关闭链接在一起提交，
+            // MSG_WAITALL让内核发完为止，没发完时链接断开，关闭操作被取消，由try_release重新关闭
+            bool last = !more && !conn->output_linger();
+            if(last) {
+                // 链接的两个SQE必须在同一次提交中，先留出取消、发送、关闭三个位置
+                if(m_ring->sq_space() < 3) {
+                    m_ring->submit(0);
+                }
+                conn->clear_deadline();
+                conn->closing = true;
+                // 先取消多发recv，否则它持有socket的引用，关闭后连接也不会真正断开
+                if(conn->recv_armed) {
+                    io_uring_sqe* cancel = get_sqe();
+                    cancel->opcode = IORING_OP_ASYNC_CANCEL;
+                    cancel->fd = conn->fd();
+                    cancel->cancel_flags = IORING_ASYNC_CANCEL_FD;
+                    cancel->user_data = tag(OP_CANCEL, conn->fd());
+                }
+            }
+            io_uring_sqe* sqe = get_sqe();
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = conn->fd();
+            sqe->addr = (uint64_t)(uintptr_t)&conn->msg;
+            sqe->len = 1;
+            // 后面还有文件内容时带上MSG_MORE，让内核把响应头和文件开头合并成满的报文段再发出
+            sqe->msg_flags = more ? MSG_MORE : (last ? MSG_WAITALL : 0);
+            sqe->user_data = tag(OP_SEND, conn->fd());
+            conn->sending = true;
+            ++conn->inflight;
+            if(last) {
+                sqe->flags = IOSQE_IO_LINK;
+                io_uring_sqe* close_sqe = get_sqe();
+                close_sqe->opcode = IORING_OP_CLOSE;
+                close_sqe->fd = conn->fd();
+                close_sqe->user_data = tag(OP_CLOSE, conn->fd());
+                conn->close_pending = true;
+                ++conn->inflight;
+            }
+            return;
+        }
+        // 队首响应只剩文件内容，io_uring没有sendfile，直接同步发送
+        ssize_t ret = conn->send_file();
+        if(ret == 0) {
+            // 文件在发送过程中被截短了
+            close_conn(conn);
+            return;
+        }
+        if(ret < 0) {
+            if(errno != EAGAIN) {
+                close_conn(conn);
+                return;
+            }
+            // 发送缓冲满了，等socket可写
+            io_uring_sqe* sqe = get_sqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = conn->fd();
+            sqe->poll32_events = POLLOUT;
+            sqe->user_data = tag(OP_POLL, conn->fd());
+            conn->sending = true;
+            ++conn->inflight;
+            return;
+        }
+    }
+    output_done(conn);
+}
+
+void uring_reactor::handle_send(uring_conn* conn, int res)
+{
+    conn->sending = false;
+    --conn->inflight;
+    if(conn->closing) {
+        // 和关闭链接在一起的最后一次发送：记下发出的字节，发完的请求写出访问日志，
+        // 没发完的部分在回收连接时由close_file记为partial
+        if(res > 0) {
+            conn->advance(res);
+        }
+        // 全部发完时和其他响应一样记下写阶段的耗时
+        if(res >= 0 && !conn->has_output()) {
+            conn->finish_output();
+        }
+        try_release(conn);
+        return;
+    }
+    if(res < 0) {
+        close_conn(conn);
+        try_release(conn);
+        return;
+    }
+    conn->advance(res);
+    send_next(conn);
+    try_release(conn);
+}
+
+void uring_reactor::handle_poll(uring_conn* conn, int res)
+{
+    conn->sending = false;
+    --conn->inflight;
+    if(!conn->closing) {
+        if(res < 0 || (res & (POLLERR | POLLHUP))) {
+            close_conn(conn);
+        }else{
+            send_next(conn);
+        }
+    }
+    try_release(conn);
+}
+
+void uring_reactor::output_done(uring_conn* conn)
+{
+    if(!conn->finish_output()) {
+        close_conn(conn);
+        return;
+    }
+    // 流水线上还有请求时继续处理
+    drain_held(conn);
+    pump(conn);
+    // 交给了辅助线程的连接在它回来、响应发完后再设置期限
+    if(conn->closing || conn->sending || conn->offloaded) {
+        return;
+    }
+    if(conn->waiting_request()) {
+        // 响应发完，连接进入空闲期限
+        conn->set_deadline(m_now + m_idle_ticks);
+    }else{
+        // 缓冲中还有不完整的请求，剩下的部分必须在请求头期限内收完
+        conn->set_deadline(m_now + m_header_ticks);
+    }
+}
+
+void uring_reactor::close_conn(uring_conn* conn)
+{
+    if(conn->closing) {
+        return;
+    }
+    conn->closing = true;
+    conn->clear_deadline();
+    // 取消连接上所有还在进行的操作，它们的CQE到齐后由try_release关闭socket
+    if(conn->inflight > 0) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = conn->fd();
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = tag(OP_CANCEL, conn->fd());
+    }
+}
+
+void uring_reactor::handle_close(uring_conn* conn, int res)
+{
+    conn->close_pending = false;
+    --conn->inflight;
+    // 链接的发送没有发完时关闭操作被取消，socket还开着
+    if(res != -ECANCELED) {
+        conn->fd_closed = true;
+    }
+    try_release(conn);
+}
+
+void uring_reactor::try_release(uring_conn* conn)
+{
+    if(!conn->closing || conn->inflight > 0) {
+        return;
+    }
+    if(!conn->fd_closed) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = conn->fd();
+        sqe->user_data = tag(OP_CLOSE, conn->fd());
+        conn->close_pending = true;
+        ++conn->inflight;
+        return;
+    }
+    for(int i = 0; i < conn->held_count; ++i) {
+        recycle(conn->held[i].bid);
+    }
+    conn->held_count = 0;
+    int fd = conn->fd();
+    conn->close_conn();
+    m_conns->detach(fd);
+}
+
+// 本线程是连接唯一的处理者，空闲的连接可以直接关闭。正在处理请求的连接在响应中带上Connection: close，发完后关闭
+bool uring_reactor::drain()
+{
+    if(!m_draining) {
+        m_draining = true;
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = tag(OP_ACCEPT, m_listenfd);
+        sqe->user_data = tag(OP_CANCEL, m_listenfd);
+        // 环的固定文件表还引用着监听socket，进程退出时才释放；新进程持有同一个socket，不受影响
+        close(m_listenfd);
+        m_listenfd = -1;
+        for(int fd = 0; fd < m_conns->max_fd(); ++fd) {
+            uring_conn* conn = m_conns->get(fd);
+            if(conn && !conn->closing && !conn->offloaded && conn->waiting_request() && conn->held_count == 0 &&
+               !conn->has_output()) {
+                close_conn(conn);
+                try_release(conn);
+            }
+        }
+    }
+    if(m_conns->size() == 0 || metrics::now() >= upgrade::deadline()) {
+        upgrade::drained();
+        return true;
+    }
+    return false;
+}
+
+void uring_reactor::update_clock()
+{
+    // 粗粒度时钟不需要进入内核，精度也远高于滴答
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    m_now = ((time_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / m_tick_ms;
+}
+
+void uring_reactor::loop()
+{
+    // 环在构造时是禁用的，由运行事件循环的线程启用，之后只有这个线程提交
+    int ret = m_ring->enable();
+    if(ret < 0) {
+        LOG_ERROR("enable io_uring errno is: %d", -ret);
+        return;
+    }
+    setup();
+    while(true)
+    {
+        // 提交上一轮产生的所有SQE，并等待至少一个完成事件
+        ret = m_ring->submit(1);
+        if(ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+            LOG_ERROR("io_uring failure!");
+            break;
+        }
+        update_clock();
+        bool timeout = false;
+
+        io_uring_cqe* cqe;
+        while((cqe = m_ring->peek_cqe()) != NULL) {
+            // 先复制出来再腾出完成队列，处理过程中产生的提交不会因为完成队列满而失败
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            m_ring->cqe_seen();
+
+            OP op = (OP)(data >> 32);
+            int fd = (int)(uint32_t)data;
+            if(op == OP_ACCEPT) {
+                handle_accept(res, flags);
+                continue;
+            }
+            if(op == OP_TIMER) {
+                // 定时任务的优先级不高，等本轮的I/O事件处理完再处理
+                timeout = true;
+                arm_timer();
+                continue;
+            }
+            if(op == OP_WAKE) {
+                handle_wake();
+                continue;
+            }
+            if(op == OP_CANCEL || op == OP_BUFS) {
+                continue;
+            }
+            uring_conn* conn = m_conns->get(fd);
+            if(!conn) {
+                if(op == OP_RECV && res > 0) {
+                    recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                continue;
+            }
+            switch(op) {
+                case OP_RECV: handle_recv(conn, res, flags); break;
+                case OP_SEND: handle_send(conn, res); break;
+                case OP_POLL: handle_poll(conn, res); break;
+                case OP_CLOSE: handle_close(conn, res); break;
+                default: break;
+            }
+        }
+
+        // 有缓冲归还了，重新提交因为没有缓冲而停止的recv。没有归还时重新提交只会马上再次得到-ENOBUFS，
+        // 让这些连接停在这里，对方的数据留在内核的接收缓冲中，由TCP窗口限制对方的发送速度
+        if(m_recycled && !m_starved.empty()) {
+            std::vector<int> starved;
+            starved.swap(m_starved);
+            for(size_t i = 0; i < starved.size(); ++i) {
+                uring_conn* conn = m_conns->get(starved[i]);
+                if(conn && !conn->closing && !conn->recv_armed) {
+                    arm_recv(conn);
+                }
+            }
+        }
+        m_recycled = false;
+
+        if(timeout){
+            m_timers->tick(m_now);
+        }
+        // 超时操作至少每个滴答完成一次，排空的期限精确到滴答
+        if(upgrade::draining() && drain()) {
+            break;
+        }
+    }
+}
+
+void uring_conn::process()
+{
+    offload_ok = process_requests();
+    owner->post(this);
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <math.h>
+#include <stdint.h>
+#include <exception>
+#include <atomic>
+#include "../locker/locker.h"
+
+/*
+    线程池的准入控制。过载时与其让请求在队列中越排越久，不如尽早回复503，让排队时间和p99保持有界。
+    三道关口：
+    1. 队列深度：交给线程池还没有被工作线程取出的请求超过max_queue时，Reactor直接拒绝新请求；
+    2. 监听socket的并发：每个Reactor交给线程池、还没有处理完的请求超过它的上限时拒绝，
+       一个端口（或一个Reactor）的突发不会占满整个线程池；
+    3. CoDel：工作线程取出请求时检查它的排队时间，排队时间持续一个interval都高于target时进入丢弃状态，
+       按interval/sqrt(count)的间隔丢弃请求，直到排队时间回到target以下。被丢弃的请求同样回复503。
+    被拒绝的请求回复预先生成的503和Retry-After，不进入do_request。
+*/
+
+#define CODEL_INTERVAL_MS 100 // CoDel的观察间隔，RFC 8289建议的100ms适合大多数场景
+
+// 一个监听socket（一个Reactor）的在途请求数和上限
+struct listener_load {
+    std::atomic<int> inflight; // 交给线程池还没有处理完的请求数
+    int limit; // 0表示不限制
+};
+
+class admission {
+public:
+    // max_queue为0时不限制队列深度，target_ms为0时不启用CoDel
+    admission(int max_queue, int target_ms);
+
+    // Reactor把请求交给线程池之前调用，返回false时请求应当被拒绝
+    bool admit(listener_load* load);
+    // 线程池的队列满了，撤销admit的计数
+    void cancel(listener_load* load);
+    // 工作线程取出请求时调用，sojourn是排队的纳秒数，返回false时按CoDel丢弃这个请求
+    bool dequeue(uint64_t sojourn, uint64_t now);
+    // 请求处理完，连接交还给Reactor之前调用
+    void done(listener_load* load) { load->inflight.fetch_sub(1, std::memory_order_release); }
+
+    int depth() const { return m_depth.load(std::memory_order_relaxed); } // 当前的队列深度
+
+private:
+    uint64_t control_law(uint64_t t) const { return t + (uint64_t)(m_interval / sqrt((double)m_count)); }
+
+    int m_max_queue;
+    uint64_t m_target; // 单位都是纳秒
+    uint64_t m_interval;
+    std::atomic<int> m_depth; // 交给线程池还没有被取出的请求数
+
+    // CoDel的状态，由m_lock保护。排队时间低于目标而且不在丢弃状态时是常态，只读m_above就返回，不加锁
+    std::atomic<bool> m_above; // first_above或dropping不为零
+    locker m_lock;
+    uint64_t m_first_above; // 排队时间开始超过目标后再过一个interval的时刻，0表示没有超过
+    bool m_dropping; // 是否处于丢弃状态
+    uint64_t m_drop_next; // 丢弃状态下下一次丢弃的时刻
+    uint32_t m_count; // 这次丢弃状态中丢弃的请求数，决定丢弃的频率
+};
+
+admission::admission(int max_queue, int target_ms) :
+        m_max_queue(max_queue), m_target((uint64_t)target_ms * 1000000),
+        m_interval((uint64_t)CODEL_INTERVAL_MS * 1000000), m_depth(0), m_above(false),
+        m_first_above(0), m_dropping(false), m_drop_next(0), m_count(0)
+{
+    if(max_queue < 0 || target_ms < 0) {
+        throw std::exception();
+    }
+}
+
+bool admission::admit(listener_load* load)
+{
+    if(load->limit > 0 && load->inflight.load(std::memory_order_relaxed) >= load->limit) {
+        return false;
+    }
+    if(m_max_queue > 0 && m_depth.load(std::memory_order_relaxed) >= m_max_queue) {
+        return false;
+    }
+    load->inflight.fetch_add(1, std::memory_order_relaxed);
+    m_depth.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void admission::cancel(listener_load* load)
+{
+    load->inflight.fetch_sub(1, std::memory_order_relaxed);
+    m_depth.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// RFC 8289的出队逻辑。队列中没有别的请求时丢弃也不会缩短任何人的排队时间，当作低于目标处理
+bool admission::dequeue(uint64_t sojourn, uint64_t now)
+{
+    int left = m_depth.fetch_sub(1, std::memory_order_relaxed) - 1;
+    if(m_target == 0) {
+        return true;
+    }
+    if(sojourn < m_target || left == 0) {
+        if(m_above.load(std::memory_order_relaxed)) {
+            m_lock.lock();
+            m_first_above = 0;
+            m_dropping = false;
+            m_above.store(false, std::memory_order_relaxed);
+            m_lock.unlock();
+        }
+        return true;
+    }
+
+    bool ok = true;
+    m_lock.lock();
+    m_above.store(true, std::memory_order_relaxed);
+    if(m_dropping) {
+        if(now >= m_drop_next) {
+            ++m_count;
+            m_drop_next = control_law(m_drop_next);
+            ok = false;
+        }
+    }else if(m_first_above == 0) {
+        m_first_above = now + m_interval;
+    }else if(now >= m_first_above) {
+        // 持续一个interval高于目标，进入丢弃状态。刚离开丢弃状态不久时从上次的频率附近继续
+        m_dropping = true;
+        m_count = (m_count > 2 && now - m_drop_next < 16 * m_interval) ? m_count - 2 : 1;
+        m_drop_next = control_law(now);
+        ok = false;
+    }
+    m_lock.unlock();
+    return ok;
+}
+
+#endif
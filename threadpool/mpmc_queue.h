@@ -0,0 +1,121 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+
+#define CACHELINE_SIZE 64
+
+// 无锁有界多生产者多消费者队列（Dmitry Vyukov的环形队列算法）
+// 每个槽位带一个序号，生产者和消费者各自用CAS抢占位置，槽位的序号表明它当前能否被写入或读出。
+// 所有槽位在构造时一次性分配，入队出队都不再申请内存。
+template<typename T>
+class mpmc_queue {
+public:
+    /*capacity是队列最多能容纳的元素数量*/
+    mpmc_queue(size_t capacity);
+    ~mpmc_queue();
+
+    // 入队，队列满时返回false
+    bool push(T* item);
+    // 批量出队，最多取出max_items个元素放到items中，返回实际取出的数量，队列为空时返回0
+    int pop_batch(T** items, int max_items);
+
+private:
+    struct cell {
+        std::atomic<size_t> seq; // 等于pos表示可以写入，等于pos+1表示可以读出
+        T* data;
+    };
+
+    cell* m_buffer;
+    size_t m_capacity;
+
+    // 生产者和消费者的位置分别独占一个缓存行，避免伪共享
+    alignas(CACHELINE_SIZE) std::atomic<size_t> m_enqueue_pos;
+    alignas(CACHELINE_SIZE) std::atomic<size_t> m_dequeue_pos;
+};
+
+template<typename T>
+mpmc_queue<T>::mpmc_queue(size_t capacity) : m_buffer(NULL), m_capacity(capacity)
+{
+    if(capacity == 0) {
+        throw std::exception();
+    }
+    m_buffer = new cell[capacity];
+    for(size_t i = 0; i < capacity; ++i) {
+        m_buffer[i].seq.store(i, std::memory_order_relaxed);
+        m_buffer[i].data = NULL;
+    }
+    m_enqueue_pos.store(0, std::memory_order_relaxed);
+    m_dequeue_pos.store(0, std::memory_order_relaxed);
+}
+
+template<typename T>
+mpmc_queue<T>::~mpmc_queue()
+{
+    delete [] m_buffer;
+}
+
+template<typename T>
+bool mpmc_queue<T>::push(T* item)
+{
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    cell* c;
+    while(true) {
+        c = &m_buffer[pos % m_capacity];
+        size_t seq = c->seq.load(std::memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+        if(diff == 0) {
+            // 槽位空闲，尝试占住这个位置
+            if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if(diff < 0) {
+            // 槽位里还是上一轮未被取走的数据，队列已满
+            return false;
+        } else {
+            // 位置已被其他生产者占用，重新读取
+            pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    c->data = item;
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T>
+int mpmc_queue<T>::pop_batch(T** items, int max_items)
+{
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    int n;
+    while(true) {
+        // 统计从pos开始连续可读的槽位数量
+        for(n = 0; n < max_items; ++n) {
+            cell* c = &m_buffer[(pos + n) % m_capacity];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            if(seq != pos + n + 1) break;
+        }
+        if(n == 0) {
+            cell* c = &m_buffer[pos % m_capacity];
+            ptrdiff_t diff = (ptrdiff_t)c->seq.load(std::memory_order_acquire) - (ptrdiff_t)(pos + 1);
+            if(diff < 0) {
+                return 0; // 队列为空
+            }
+            pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            continue;
+        }
+        // 一次CAS占住n个槽位，这些槽位只有占住它们的消费者才能修改，所以此后仍然可读
+        if(m_dequeue_pos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+            break;
+        }
+    }
+    for(int i = 0; i < n; ++i) {
+        cell* c = &m_buffer[(pos + i) % m_capacity];
+        items[i] = c->data;
+        c->seq.store(pos + i + m_capacity, std::memory_order_release);
+    }
+    return n;
+}
+
+#endif
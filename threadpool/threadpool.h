@@ -3,9 +3,13 @@
 
 #include <list>
 #include <cstdio>
+#include <atomic>
 #include <exception>
+#include <stdint.h>
 #include <pthread.h>
 #include "../locker/locker.h"
+#include "mpmc_queue.h"
+#include "../log/log.h"
 
 
 
@@ -13,8 +17,17 @@
 template<typename T>
 class threadpool {
 public:
+    /*
+        请求队列的实现方式
+        LIST_QUEUE      :   std::list加互斥锁，每个请求都唤醒一次工作线程
+        LOCKFREE_QUEUE  :   无锁有界环形队列，只在有空闲线程时才唤醒，工作线程批量取出请求
+        WORK_STEALING   :   每个工作线程一个本地无锁队列，同一个请求对象总是投递给同一个线程，
+                            空闲的线程从其他线程的队列中窃取请求
+    */
+    enum QUEUE_MODE { LIST_QUEUE = 0, LOCKFREE_QUEUE, WORK_STEALING };
+
     /*thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量*/
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    threadpool(int thread_number = 8, int max_requests = 10000, QUEUE_MODE mode = LIST_QUEUE);
     ~threadpool();
     bool append(T* request);
 
@@ -22,6 +35,20 @@ private:
     /*工作线程运行的函数，它不断从工作队列中取出任务并执行之*/
     static void* worker(void* arg);
     void run();
+    void run_lockfree();
+    void run_stealing(int index);
+    int steal(int index, T** requests); // 从其他工作线程的队列中窃取请求
+    void wake_idle_worker(int index); // 唤醒一个空闲的工作线程，优先唤醒index号线程
+
+    // 无锁模式下工作线程一次最多取出的请求数量
+    static const int DEQUEUE_BATCH = 8;
+
+    // 工作窃取模式下每个工作线程私有的请求队列
+    struct worker_queue {
+        mpmc_queue<T>* queue;
+        sem wakeup; // 本线程空闲时在这个信号量上等待
+        std::atomic<bool> idle;
+    };
 
 private:
     // 线程的数量
@@ -42,6 +69,20 @@ private:
     // 是否有任务需要处理
     sem m_queuestat;
 
+    QUEUE_MODE m_mode;
+
+    // 无锁模式下的请求队列，容量为m_max_requests，构造时一次性分配
+    mpmc_queue<T>* m_lockfree_queue;
+
+    // 无锁模式下正在等待信号量的工作线程数量，为0时append不需要post
+    std::atomic<int> m_idle_workers;
+
+    // 工作窃取模式下各工作线程的队列，每个的容量为m_max_requests / m_thread_number
+    worker_queue* m_worker_queues;
+
+    // 工作线程启动时领取自己的编号
+    std::atomic<int> m_next_index;
+
     // 是否结束线程          
     bool m_stop;   
 
@@ -49,15 +90,27 @@ private:
 };
 
 template< typename T >
-threadpool< T >::threadpool(int thread_number, int max_requests) : 
+threadpool< T >::threadpool(int thread_number, int max_requests, QUEUE_MODE mode) : 
         m_thread_number(thread_number), m_max_requests(max_requests), 
-        m_stop(false), m_threads(NULL) 
+        m_stop(false), m_threads(NULL), m_mode(mode), m_lockfree_queue(NULL), m_idle_workers(0),
+        m_worker_queues(NULL), m_next_index(0)
 {
 
     if((thread_number <= 0) || (max_requests <= 0) ) {
         throw std::exception();
     }
 
+    if(m_mode == LOCKFREE_QUEUE) {
+        m_lockfree_queue = new mpmc_queue<T>(m_max_requests);
+    }else if(m_mode == WORK_STEALING) {
+        int capacity = (m_max_requests + m_thread_number - 1) / m_thread_number;
+        m_worker_queues = new worker_queue[m_thread_number];
+        for ( int i = 0; i < m_thread_number; ++i ) {
+            m_worker_queues[i].queue = new mpmc_queue<T>(capacity);
+            m_worker_queues[i].idle.store(false);
+        }
+    }
+
     m_threads = new pthread_t[m_thread_number];
     if(!m_threads) {
         throw std::exception();
@@ -65,7 +118,7 @@ threadpool< T >::threadpool(int thread_number, int max_requests) :
 
     // 创建thread_number 个线程，并将他们设置为脱离线程。
     for ( int i = 0; i < thread_number; ++i ) {
-        printf( "create the %dth thread\n", i);
+        LOG_INFO("create the %dth thread", i);
         if(pthread_create(m_threads + i, NULL, worker, this ) != 0) {
             delete [] m_threads;
             throw std::exception();
@@ -81,12 +134,49 @@ threadpool< T >::threadpool(int thread_number, int max_requests) :
 template< typename T >
 threadpool< T >::~threadpool() {
     delete [] m_threads;
+    delete m_lockfree_queue;
+    if (m_worker_queues){
+        for ( int i = 0; i < m_thread_number; ++i ) {
+            delete m_worker_queues[i].queue;
+        }
+        delete [] m_worker_queues;
+    }
     m_stop = true;
 }
 
 template< typename T >
 bool threadpool< T >::append( T* request )
 {
+    if (m_mode == LOCKFREE_QUEUE){
+        if (!m_lockfree_queue->push(request)){
+            return false;
+        }
+        // 与run_lockfree中登记空闲线程的顺序配对，保证入队和检查空闲线程不会被重排
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_idle_workers.load(std::memory_order_relaxed) > 0){
+            m_queuestat.post();
+        }
+        return true;
+    }
+
+    if (m_mode == WORK_STEALING){
+        // 按请求对象在数组中的位置选择线程，同一个连接总是交给同一个线程，它的状态留在那个核的缓存里
+        int index = (int)(((uintptr_t)request / sizeof(T)) % m_thread_number);
+        int i = 0;
+        // 目标线程的队列满了就依次尝试后面的线程
+        for (; i < m_thread_number; ++i){
+            if (m_worker_queues[(index + i) % m_thread_number].queue->push(request)){
+                break;
+            }
+        }
+        if (i == m_thread_number){
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wake_idle_worker((index + i) % m_thread_number);
+        return true;
+    }
+
     // 操作工作队列时一定要加锁，因为它被所有线程共享。
     m_queuelocker.lock();
     if (m_workqueue.size() > m_max_requests){
@@ -103,7 +193,13 @@ template<typename T>
 void* threadpool<T>::worker(void* arg)
 {
     threadpool* pool = (threadpool*)arg;
-    pool->run();
+    if (pool->m_mode == LOCKFREE_QUEUE){
+        pool->run_lockfree();
+    }else if (pool->m_mode == WORK_STEALING){
+        pool->run_stealing(pool->m_next_index.fetch_add(1));
+    }else{
+        pool->run();
+    }
     return pool;
 }
 
@@ -129,8 +225,101 @@ void threadpool< T >::run()
 
 }
 
+template<typename T>
+void threadpool< T >::run_lockfree()
+{
+    T* requests[DEQUEUE_BATCH];
+    while (!m_stop){
+        int n = m_lockfree_queue->pop_batch(requests, DEQUEUE_BATCH);
+        if (n == 0){
+            // 队列为空，先登记为空闲线程再检查一次队列，避免在两者之间入队的请求没人唤醒
+            m_idle_workers.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            n = m_lockfree_queue->pop_batch(requests, DEQUEUE_BATCH);
+            if (n == 0){
+                m_queuestat.wait();
+            }
+            m_idle_workers.fetch_sub(1);
+            if (n == 0){
+                continue;
+            }
+        }
+        for (int i = 0; i < n; ++i){
+            if (requests[i]){
+                requests[i]->process();
+            }
+        }
+    }
+}
+
+template<typename T>
+void threadpool< T >::wake_idle_worker(int index)
+{
+    if (m_worker_queues[index].idle.load(std::memory_order_relaxed)){
+        m_worker_queues[index].wakeup.post();
+        return;
+    }
+    // 目标线程正忙，唤醒一个空闲线程来窃取这个请求
+    if (m_idle_workers.load(std::memory_order_relaxed) == 0){
+        return;
+    }
+    for (int i = 1; i < m_thread_number; ++i){
+        worker_queue& wq = m_worker_queues[(index + i) % m_thread_number];
+        if (wq.idle.load(std::memory_order_relaxed)){
+            wq.wakeup.post();
+            return;
+        }
+    }
+}
 
+template<typename T>
+int threadpool< T >::steal(int index, T** requests)
+{
+    // 每次只窃取一个请求，其余的留给原线程，尽量保持连接与线程的亲和性
+    for (int i = 1; i < m_thread_number; ++i){
+        int n = m_worker_queues[(index + i) % m_thread_number].queue->pop_batch(requests, 1);
+        if (n > 0){
+            return n;
+        }
+    }
+    return 0;
+}
 
+template<typename T>
+void threadpool< T >::run_stealing(int index)
+{
+    worker_queue& self = m_worker_queues[index];
+    T* requests[DEQUEUE_BATCH];
+    while (!m_stop){
+        int n = self.queue->pop_batch(requests, DEQUEUE_BATCH);
+        if (n == 0){
+            n = steal(index, requests);
+        }
+        if (n == 0){
+            // 先登记为空闲再检查一次所有队列，避免在两者之间投递的请求没人唤醒
+            self.idle.store(true);
+            m_idle_workers.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            n = self.queue->pop_batch(requests, DEQUEUE_BATCH);
+            if (n == 0){
+                n = steal(index, requests);
+            }
+            if (n == 0){
+                self.wakeup.wait();
+            }
+            m_idle_workers.fetch_sub(1);
+            self.idle.store(false);
+            if (n == 0){
+                continue;
+            }
+        }
+        for (int i = 0; i < n; ++i){
+            if (requests[i]){
+                requests[i]->process();
+            }
+        }
+    }
+}
 
 
-#endif
+#endif
\ No newline at end of file
@@ -0,0 +1,224 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdio.h>
+#include <time.h>
+#include <exception>
+
+#define TW_LEVELS 4                     // 时间轮的层数
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)    // 每层的槽数
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+
+// 时间轮上的定时器，模板参数T是回调函数处理的用户数据类型
+template<typename T>
+class wheel_timer {
+public:
+    wheel_timer() : prev(NULL), next(NULL) {}
+
+public:
+    time_t expire;          // 任务超时时间，使用绝对时间，单位是一个滴答
+    void (*cb_func)( T* );  // 任务回调函数
+    T* user_data;
+    wheel_timer* prev;      // 指向同一个槽中的前一个定时器
+    wheel_timer* next;      // 指向同一个槽中的后一个定时器
+};
+
+/*
+    分层时间轮，共TW_LEVELS层，每层TW_SLOTS个槽。第0层的每个槽对应一个滴答，第1层的每个槽对应TW_SLOTS个滴答，依此类推。
+    定时器根据距离超时的滴答数放入对应层的槽中，添加、调整、删除都只是双向链表的插入和摘除，是O(1)的。
+    第0层转完一圈时，把第1层下一个槽中的定时器重新分配到第0层，高层同理。
+    所有定时器在构造时从一块连续内存中预先分配，用空闲链表管理，运行时不再new/delete。
+*/
+template<typename T>
+class timer_wheel {
+public:
+    /*max_timers是最多同时存在的定时器数量，now是当前时间，之后传入的时间都与它使用相同的单位*/
+    timer_wheel( int max_timers, time_t now );
+    ~timer_wheel();
+
+    // 从定时器池中取出一个定时器并加入时间轮，定时器用完时返回NULL
+    wheel_timer<T>* add_timer( time_t expire, void (*cb_func)( T* ), T* user_data );
+    // 修改定时器的超时时间，延长或提前都可以
+    void adjust_timer( wheel_timer<T>* timer, time_t expire );
+    // 将定时器从时间轮中删除，并归还到定时器池
+    void del_timer( wheel_timer<T>* timer );
+    // 处理所有超时时间不晚于now的定时器。回调函数被调用时定时器已经被回收，回调中不能再使用它
+    void tick( time_t now );
+
+    int size() const { return m_count; }
+
+private:
+    void place( wheel_timer<T>* timer ); // 根据超时时间把定时器挂到对应的槽上
+    void unlink( wheel_timer<T>* timer );
+    void cascade( int level, int index ); // 把高层一个槽中的定时器重新分配到低层
+
+private:
+    wheel_timer<T> m_slots[TW_LEVELS][TW_SLOTS]; // 每个槽是一个带头结点的循环双向链表
+    time_t m_current;           // 下一个要处理的滴答，比它早的滴答都已处理完毕
+    wheel_timer<T>* m_pool;     // 预先分配的定时器
+    wheel_timer<T>* m_free;     // 空闲定时器链表
+    int m_count;                // 时间轮中定时器的数量
+};
+
+template<typename T>
+timer_wheel<T>::timer_wheel( int max_timers, time_t now ) : m_current( now ), m_count( 0 )
+{
+    if( max_timers <= 0 ) {
+        throw std::exception();
+    }
+    for( int i = 0; i < TW_LEVELS; ++i ) {
+        for( int j = 0; j < TW_SLOTS; ++j ) {
+            m_slots[i][j].prev = m_slots[i][j].next = &m_slots[i][j];
+        }
+    }
+    m_pool = new wheel_timer<T>[max_timers];
+    for( int i = 0; i < max_timers - 1; ++i ) {
+        m_pool[i].next = &m_pool[i + 1];
+    }
+    m_pool[max_timers - 1].next = NULL;
+    m_free = m_pool;
+}
+
+template<typename T>
+timer_wheel<T>::~timer_wheel()
+{
+    delete [] m_pool;
+}
+
+template<typename T>
+wheel_timer<T>* timer_wheel<T>::add_timer( time_t expire, void (*cb_func)( T* ), T* user_data )
+{
+    wheel_timer<T>* timer = m_free;
+    if( !timer ) {
+        return NULL;
+    }
+    m_free = timer->next;
+    timer->expire = expire;
+    timer->cb_func = cb_func;
+    timer->user_data = user_data;
+    place( timer );
+    ++m_count;
+    return timer;
+}
+
+template<typename T>
+void timer_wheel<T>::adjust_timer( wheel_timer<T>* timer, time_t expire )
+{
+    if( !timer ) {
+        return;
+    }
+    unlink( timer );
+    timer->expire = expire;
+    place( timer );
+}
+
+template<typename T>
+void timer_wheel<T>::del_timer( wheel_timer<T>* timer )
+{
+    if( !timer ) {
+        return;
+    }
+    unlink( timer );
+    timer->next = m_free;
+    m_free = timer;
+    --m_count;
+}
+
+template<typename T>
+void timer_wheel<T>::tick( time_t now )
+{
+    // 时间轮为空时直接跳到当前时间，不必逐个滴答空转
+    if( m_count == 0 ) {
+        if( now >= m_current ) {
+            m_current = now + 1;
+        }
+        return;
+    }
+    while( m_current <= now ) {
+        int index = m_current & TW_SLOT_MASK;
+        // 第0层转完一圈，从高层取下一批定时器
+        if( index == 0 ) {
+            for( int level = 1; level < TW_LEVELS; ++level ) {
+                int i = ( m_current >> ( level * TW_SLOT_BITS ) ) & TW_SLOT_MASK;
+                cascade( level, i );
+                if( i != 0 ) {
+                    break;
+                }
+            }
+        }
+
+        // 一次取下整个槽，批量执行到期的定时器
+        wheel_timer<T>* head = &m_slots[0][index];
+        while( head->next != head ) {
+            wheel_timer<T>* timer = head->next;
+            unlink( timer );
+            void (*cb_func)( T* ) = timer->cb_func;
+            T* user_data = timer->user_data;
+            timer->next = m_free;
+            m_free = timer;
+            --m_count;
+            cb_func( user_data );
+        }
+        ++m_current;
+        if( m_count == 0 ) {
+            if( now >= m_current ) {
+                m_current = now + 1;
+            }
+            return;
+        }
+    }
+}
+
+template<typename T>
+void timer_wheel<T>::place( wheel_timer<T>* timer )
+{
+    time_t expire = timer->expire;
+    // 已经超时的定时器放到下一个要处理的槽中
+    if( expire < m_current ) {
+        expire = m_current;
+    }
+    time_t delta = expire - m_current;
+    // 超出时间轮表示范围的定时器放在最高层的最远处，转到那里时会被重新分配
+    if( delta >= ( (time_t)1 << ( TW_LEVELS * TW_SLOT_BITS ) ) ) {
+        delta = ( (time_t)1 << ( TW_LEVELS * TW_SLOT_BITS ) ) - 1;
+        expire = m_current + delta;
+    }
+    int level = 0;
+    while( level < TW_LEVELS - 1 && delta >= ( (time_t)1 << ( ( level + 1 ) * TW_SLOT_BITS ) ) ) {
+        ++level;
+    }
+    wheel_timer<T>* head = &m_slots[level][( expire >> ( level * TW_SLOT_BITS ) ) & TW_SLOT_MASK];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+template<typename T>
+void timer_wheel<T>::unlink( wheel_timer<T>* timer )
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+}
+
+template<typename T>
+void timer_wheel<T>::cascade( int level, int index )
+{
+    wheel_timer<T>* head = &m_slots[level][index];
+    if( head->next == head ) {
+        return;
+    }
+    // 先把整个槽摘下来，再逐个重新放置，避免放回同一个槽时死循环
+    wheel_timer<T>* timer = head->next;
+    head->prev->next = NULL;
+    head->prev = head->next = head;
+    while( timer ) {
+        wheel_timer<T>* next = timer->next;
+        place( timer );
+        timer = next;
+    }
+}
+
+#endif
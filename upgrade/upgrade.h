@@ -0,0 +1,276 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <exception>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "../cache/file_cache.h"
+#include "../metrics/metrics.h"
+#include "../log/log.h"
+
+/*
+    平滑升级：新进程接管旧进程的监听socket，旧进程处理完手上的连接后退出，不丢连接也不需要重新bind。
+
+    运行中的进程在一个Unix域socket上等待新进程。新进程用同一个路径启动：
+    1. 新进程连接这个路径，旧进程用SCM_RIGHTS发来所有监听socket，接着发来文件缓存中的URL，每行一个，然后关闭写端；
+    2. 新进程用收到的监听socket创建Reactor并开始处理连接，回复一个字节确认，然后自己在这个路径上等待下一次升级；
+    3. 旧进程收到确认后进入排空状态：Reactor不再接受连接，空闲的连接立即关闭，其余的发完当前的响应后关闭，
+       所有连接都关闭或者超过期限后进程退出。
+    新进程在确认之前失败时，旧进程收不到确认，继续正常服务，等待下一个新进程。
+    两个进程共用同一个监听socket，交接期间新连接由内核分给正在accept的一方，已经在接受队列中的连接不会丢失。
+*/
+
+#define UPGRADE_MAGIC 0x50555357 // "WSUP"
+#define UPGRADE_MAX_LISTENERS 64
+
+// 旧进程发给新进程的第一个消息，监听socket附在这个消息上
+struct upgrade_hello {
+    uint32_t magic;
+    uint32_t count; // 监听socket的个数
+};
+
+class upgrade {
+public:
+    // 新进程：从path上的旧进程接收监听socket和缓存快照，没有旧进程在等待时返回false
+    static bool receive(const char* path, std::vector<int>* listeners, std::vector<std::string>* urls);
+    // 新进程：Reactor已经开始处理连接，通知旧进程排空
+    static void confirm();
+    // 在path上等待下一个新进程，收到确认后交出listeners并开始排空，drain_ms是排空的期限。失败时抛出异常
+    static void serve(const char* path, const std::vector<int>& listeners, file_cache* cache, int drain_ms);
+
+    // 是否正在排空，Reactor每轮事件循环检查一次
+    static bool draining() { return m_draining.load(std::memory_order_acquire); }
+    static uint64_t deadline() { return m_deadline; } // 排空的期限，单调时钟的纳秒数
+    // Reactor排空结束后调用
+    static void drained() { m_drained.fetch_add(1); }
+    // 等待count个Reactor排空结束，最多等到期限
+    static void wait_drained(int count);
+
+private:
+    static bool handoff(int conn); // 把监听socket和缓存快照交给新进程，等待它的确认
+    static void* worker(void* arg);
+    static bool make_addr(const char* path, struct sockaddr_un* addr);
+
+    static std::atomic<bool> m_draining;
+    static std::atomic<int> m_drained;
+    static uint64_t m_deadline; // 在m_draining置位之前写入
+    static int m_peer; // 新进程与旧进程的连接，确认后关闭
+    static int m_listenfd; // 等待新进程的Unix域socket
+    static std::vector<int> m_listeners;
+    static file_cache* m_cache;
+    static int m_drain_ms;
+};
+
+std::atomic<bool> upgrade::m_draining(false);
+std::atomic<int> upgrade::m_drained(0);
+uint64_t upgrade::m_deadline = 0;
+int upgrade::m_peer = -1;
+int upgrade::m_listenfd = -1;
+std::vector<int> upgrade::m_listeners;
+file_cache* upgrade::m_cache = NULL;
+int upgrade::m_drain_ms = 0;
+
+bool upgrade::make_addr(const char* path, struct sockaddr_un* addr)
+{
+    if(strlen(path) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+bool upgrade::receive(const char* path, std::vector<int>* listeners, std::vector<std::string>* urls)
+{
+    struct sockaddr_un addr;
+    if(!make_addr(path, &addr)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return false;
+    }
+    // 路径不存在或者上一个进程已经退出，正常启动
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return false;
+    }
+
+    upgrade_hello hello;
+    struct iovec iv = { &hello, sizeof(hello) };
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iv;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    while((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {}
+    for(struct cmsghdr* c = CMSG_FIRSTHDR(&msg); n > 0 && c; c = CMSG_NXTHDR(&msg, c)) {
+        if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int* fds = (int*)CMSG_DATA(c);
+            listeners->insert(listeners->end(), fds, fds + count);
+        }
+    }
+    if(n != sizeof(hello) || hello.magic != UPGRADE_MAGIC || hello.count != listeners->size() || listeners->empty()) {
+        for(size_t i = 0; i < listeners->size(); ++i) close((*listeners)[i]);
+        listeners->clear();
+        close(fd);
+        return false;
+    }
+
+    // 之后是缓存快照，读到旧进程关闭写端为止
+    std::string text;
+    char buf[4096];
+    while((n = ::read(fd, buf, sizeof(buf))) != 0) {
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            break;
+        }
+        text.append(buf, n);
+    }
+    size_t start = 0, end;
+    while((end = text.find('\n', start)) != std::string::npos) {
+        urls->push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    m_peer = fd;
+    return true;
+}
+
+void upgrade::confirm()
+{
+    if(m_peer < 0) {
+        return;
+    }
+    ssize_t n;
+    while((n = ::write(m_peer, "y", 1)) < 0 && errno == EINTR) {}
+    close(m_peer);
+    m_peer = -1;
+}
+
+void upgrade::serve(const char* path, const std::vector<int>& listeners, file_cache* cache, int drain_ms)
+{
+    struct sockaddr_un addr;
+    if(!make_addr(path, &addr) || listeners.empty() || listeners.size() > UPGRADE_MAX_LISTENERS) {
+        throw std::exception();
+    }
+    m_listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(m_listenfd < 0) {
+        throw std::exception();
+    }
+    // 旧进程留下的路径由新进程删除，旧进程只关闭自己的socket，不会删掉新进程的路径
+    unlink(path);
+    if(bind(m_listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(m_listenfd, 1) < 0) {
+        close(m_listenfd);
+        throw std::exception();
+    }
+    m_listeners = listeners;
+    m_cache = cache;
+    m_drain_ms = drain_ms;
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, worker, NULL) != 0) {
+        close(m_listenfd);
+        throw std::exception();
+    }
+    pthread_detach(thread);
+}
+
+bool upgrade::handoff(int conn)
+{
+    upgrade_hello hello;
+    hello.magic = UPGRADE_MAGIC;
+    hello.count = m_listeners.size();
+    struct iovec iv = { &hello, sizeof(hello) };
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iv;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * m_listeners.size());
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * m_listeners.size());
+    memcpy(CMSG_DATA(c), &m_listeners[0], sizeof(int) * m_listeners.size());
+    if(sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+        return false;
+    }
+
+    // 快照只有URL，新进程重新打开文件并生成响应头和压缩变体，比从磁盘冷启动少了等待请求到来的时间
+    std::string text;
+    if(m_cache) {
+        std::vector<std::string> urls;
+        m_cache->snapshot(&urls);
+        for(size_t i = 0; i < urls.size(); ++i) {
+            text += urls[i];
+            text += '\n';
+        }
+    }
+    const char* p = text.data();
+    size_t left = text.size();
+    while(left > 0) {
+        ssize_t n = send(conn, p, left, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        left -= n;
+    }
+    shutdown(conn, SHUT_WR);
+
+    // 新进程开始服务后才回复，它在这之前退出时读到的是EOF
+    char ack;
+    ssize_t n;
+    while((n = ::read(conn, &ack, 1)) < 0 && errno == EINTR) {}
+    return n == 1;
+}
+
+void* upgrade::worker(void* arg)
+{
+    while(true) {
+        int conn = accept4(m_listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if(conn < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            LOG_ERROR("upgrade accept errno is: %d", errno);
+            return arg;
+        }
+        bool ok = handoff(conn);
+        close(conn);
+        if(ok) {
+            break;
+        }
+        LOG_WARN("upgrade: the new process exited before confirming, keep serving");
+    }
+    close(m_listenfd);
+    m_deadline = metrics::now() + (uint64_t)m_drain_ms * 1000000;
+    m_draining.store(true, std::memory_order_release);
+    LOG_INFO("upgrade: handed off %d listeners, draining", (int)m_listeners.size());
+    return arg;
+}
+
+void upgrade::wait_drained(int count)
+{
+    // 期限过后Reactor也会结束，多等一点时间让它们完成最后一轮
+    while(m_drained.load() < count && metrics::now() < m_deadline + 1000000000ULL) {
+        usleep(10000);
+    }
+}
+
+#endif